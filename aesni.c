@@ -0,0 +1,297 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	aesni.c: AES-NI sector routines
+*/
+
+#include "crypto.h"
+#include "aesni.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <wmmintrin.h>
+
+#define AESNI	__attribute__((target("aes,sse2")))
+
+int aesni_available(void)
+{
+	__builtin_cpu_init();
+	return(__builtin_cpu_supports("aes")&&__builtin_cpu_supports("sse2"));
+}
+
+// Key expansion helpers, after Intel's AES-NI white paper
+static inline AESNI __m128i expand_step(__m128i t1, __m128i t2) // folds the previous round key into itself and mixes in the keygenassist output t2 (already shuffled)
+{
+	__m128i t4=_mm_slli_si128(t1, 4);
+	t1=_mm_xor_si128(t1, t4);
+	t4=_mm_slli_si128(t4, 4);
+	t1=_mm_xor_si128(t1, t4);
+	t4=_mm_slli_si128(t4, 4);
+	t1=_mm_xor_si128(t1, t4);
+	return(_mm_xor_si128(t1, t2));
+}
+
+#define EXPAND128(i, rcon)	rk[i]=expand_step(rk[i-1], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i-1], rcon), 0xff))
+
+static AESNI void expand128(const unsigned char *key, __m128i *rk)
+{
+	rk[0]=_mm_loadu_si128((const __m128i *)key);
+	EXPAND128(1, 0x01);
+	EXPAND128(2, 0x02);
+	EXPAND128(3, 0x04);
+	EXPAND128(4, 0x08);
+	EXPAND128(5, 0x10);
+	EXPAND128(6, 0x20);
+	EXPAND128(7, 0x40);
+	EXPAND128(8, 0x80);
+	EXPAND128(9, 0x1b);
+	EXPAND128(10, 0x36);
+}
+
+static inline AESNI void assist192(__m128i *t1, __m128i t2, __m128i *t3)
+{
+	*t1=expand_step(*t1, _mm_shuffle_epi32(t2, 0x55));
+	t2=_mm_shuffle_epi32(*t1, 0xff);
+	__m128i t4=_mm_slli_si128(*t3, 4);
+	*t3=_mm_xor_si128(*t3, t4);
+	*t3=_mm_xor_si128(*t3, t2);
+}
+
+#define SHUF_LO(a, b)	_mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(a), _mm_castsi128_pd(b), 0))
+#define SHUF_HI(a, b)	_mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(a), _mm_castsi128_pd(b), 1))
+
+static AESNI void expand192(const unsigned char *key, __m128i *rk)
+{
+	__m128i t1=_mm_loadu_si128((const __m128i *)key), t3;
+	unsigned char top[16]={0};
+	memcpy(top, key+16, 8);
+	t3=_mm_loadu_si128((const __m128i *)top);
+	rk[0]=t1;
+	rk[1]=t3;
+	assist192(&t1, _mm_aeskeygenassist_si128(t3, 0x01), &t3);
+	rk[1]=SHUF_LO(rk[1], t1);
+	rk[2]=SHUF_HI(t1, t3);
+	assist192(&t1, _mm_aeskeygenassist_si128(t3, 0x02), &t3);
+	rk[3]=t1;
+	rk[4]=t3;
+	assist192(&t1, _mm_aeskeygenassist_si128(t3, 0x04), &t3);
+	rk[4]=SHUF_LO(rk[4], t1);
+	rk[5]=SHUF_HI(t1, t3);
+	assist192(&t1, _mm_aeskeygenassist_si128(t3, 0x08), &t3);
+	rk[6]=t1;
+	rk[7]=t3;
+	assist192(&t1, _mm_aeskeygenassist_si128(t3, 0x10), &t3);
+	rk[7]=SHUF_LO(rk[7], t1);
+	rk[8]=SHUF_HI(t1, t3);
+	assist192(&t1, _mm_aeskeygenassist_si128(t3, 0x20), &t3);
+	rk[9]=t1;
+	rk[10]=t3;
+	assist192(&t1, _mm_aeskeygenassist_si128(t3, 0x40), &t3);
+	rk[10]=SHUF_LO(rk[10], t1);
+	rk[11]=SHUF_HI(t1, t3);
+	assist192(&t1, _mm_aeskeygenassist_si128(t3, 0x80), &t3);
+	rk[12]=t1;
+	explicit_bzero(top, sizeof(top));
+}
+
+#define EXPAND256A(i, rcon)	rk[i]=expand_step(rk[i-2], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i-1], rcon), 0xff))
+#define EXPAND256B(i)		rk[i]=expand_step(rk[i-2], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i-1], 0), 0xaa))
+
+static AESNI void expand256(const unsigned char *key, __m128i *rk)
+{
+	rk[0]=_mm_loadu_si128((const __m128i *)key);
+	rk[1]=_mm_loadu_si128((const __m128i *)(key+16));
+	EXPAND256A(2, 0x01);
+	EXPAND256B(3);
+	EXPAND256A(4, 0x02);
+	EXPAND256B(5);
+	EXPAND256A(6, 0x04);
+	EXPAND256B(7);
+	EXPAND256A(8, 0x08);
+	EXPAND256B(9);
+	EXPAND256A(10, 0x10);
+	EXPAND256B(11);
+	EXPAND256A(12, 0x20);
+	EXPAND256B(13);
+	EXPAND256A(14, 0x40);
+}
+
+AESNI int aesni_expand_key(size_t key_len, const unsigned char *key, bool decrypt, unsigned char rk[][AES_BLOCK_SIZE], unsigned int *rounds)
+{
+	__m128i ek[15];
+	switch(key_len)
+	{
+		case KEY_LENGTH_LOW:
+			expand128(key, ek);
+			*rounds=10;
+		break;
+		case KEY_LENGTH_MED:
+			expand192(key, ek);
+			*rounds=12;
+		break;
+		case KEY_LENGTH_HIGH:
+			expand256(key, ek);
+			*rounds=14;
+		break;
+		default:
+			return(1);
+	}
+	for(unsigned int r=0;r<=*rounds;r++)
+	{
+		__m128i k;
+		if(!decrypt)
+			k=ek[r];
+		else if(!r||r==*rounds)
+			k=ek[*rounds-r];
+		else
+			k=_mm_aesimc_si128(ek[*rounds-r]);
+		_mm_storeu_si128((__m128i *)rk[r], k);
+	}
+	explicit_bzero(ek, sizeof(ek));
+	return(0);
+}
+
+#define RK(op, r)	_mm_load_si128((const __m128i *)(op).key->sched.rk[r])
+
+AESNI void aesni_encrypt_sectors(size_t n, const struct sector_op *ops)
+{
+	// CBC encryption is serial within a sector, so we run up to SECTOR_BATCH sectors side by side to keep the AES unit busy
+	__m128i st[SECTOR_BATCH];
+	unsigned int rounds=ops[0].key->rounds;
+	for(size_t k=0;k<n;k++)
+		st[k]=_mm_loadu_si128((const __m128i *)ops[k].iv);
+	for(size_t j=0;j<SECTOR_LENGTH;j+=AES_BLOCK_SIZE)
+	{
+		for(size_t k=0;k<n;k++)
+			st[k]=_mm_xor_si128(_mm_xor_si128(st[k], _mm_loadu_si128((const __m128i *)(ops[k].in+j))), RK(ops[k], 0));
+		for(unsigned int r=1;r<rounds;r++)
+			for(size_t k=0;k<n;k++)
+				st[k]=_mm_aesenc_si128(st[k], RK(ops[k], r));
+		for(size_t k=0;k<n;k++)
+		{
+			st[k]=_mm_aesenclast_si128(st[k], RK(ops[k], rounds));
+			_mm_storeu_si128((__m128i *)(ops[k].out+j), st[k]);
+		}
+	}
+}
+
+#define DEC_LANES	8
+
+AESNI void aesni_decrypt_blocks(const sector_key *sk, const unsigned char *prev, const unsigned char *in, size_t nblocks, unsigned char *out)
+{
+	// CBC decryption of each AES block only needs the previous ciphertext block, so we can do DEC_LANES at once
+	unsigned int rounds=sk->rounds;
+	__m128i last=_mm_loadu_si128((const __m128i *)prev);
+	for(size_t j=0;j<nblocks;j+=DEC_LANES)
+	{
+		size_t m=nblocks-j;
+		if(m>DEC_LANES) m=DEC_LANES;
+		__m128i c[DEC_LANES], st[DEC_LANES];
+		for(size_t k=0;k<m;k++)
+		{
+			c[k]=_mm_loadu_si128((const __m128i *)(in+(j+k)*AES_BLOCK_SIZE));
+			st[k]=_mm_xor_si128(c[k], _mm_load_si128((const __m128i *)sk->sched.rk[0]));
+		}
+		for(unsigned int r=1;r<rounds;r++)
+			for(size_t k=0;k<m;k++)
+				st[k]=_mm_aesdec_si128(st[k], _mm_load_si128((const __m128i *)sk->sched.rk[r]));
+		for(size_t k=0;k<m;k++)
+		{
+			st[k]=_mm_xor_si128(_mm_aesdeclast_si128(st[k], _mm_load_si128((const __m128i *)sk->sched.rk[rounds])), k?c[k-1]:last);
+			_mm_storeu_si128((__m128i *)(out+(j+k)*AES_BLOCK_SIZE), st[k]);
+		}
+		last=c[m-1];
+	}
+}
+
+AESNI void aesni_decrypt_sector(const struct sector_op *op)
+{
+	aesni_decrypt_blocks(op->key, op->iv, op->in, SECTOR_LENGTH/AES_BLOCK_SIZE, op->out);
+}
+
+AESNI void aesni_ctr_blocks(const sector_key *sk, unsigned char *ctr, unsigned char *out, size_t nblocks)
+{
+	unsigned char in[DEC_LANES][AES_BLOCK_SIZE];
+	unsigned int rounds=sk->rounds;
+	for(size_t j=0;j<nblocks;j+=DEC_LANES)
+	{
+		size_t m=nblocks-j;
+		if(m>DEC_LANES) m=DEC_LANES;
+		__m128i st[DEC_LANES];
+		for(size_t k=0;k<m;k++)
+		{
+			memcpy(in[k], ctr, AES_BLOCK_SIZE);
+			for(size_t i=AES_BLOCK_SIZE;i--&&!++ctr[i];); // big-endian increment
+			st[k]=_mm_xor_si128(_mm_loadu_si128((const __m128i *)in[k]), _mm_load_si128((const __m128i *)sk->sched.rk[0]));
+		}
+		for(unsigned int r=1;r<rounds;r++)
+			for(size_t k=0;k<m;k++)
+				st[k]=_mm_aesenc_si128(st[k], _mm_load_si128((const __m128i *)sk->sched.rk[r]));
+		for(size_t k=0;k<m;k++)
+			_mm_storeu_si128((__m128i *)(out+(j+k)*AES_BLOCK_SIZE), _mm_aesenclast_si128(st[k], _mm_load_si128((const __m128i *)sk->sched.rk[rounds])));
+	}
+}
+
+#else // !x86
+
+int aesni_available(void)
+{
+	return(0);
+}
+
+int aesni_expand_key(size_t key_len, const unsigned char *key, bool decrypt, unsigned char rk[][AES_BLOCK_SIZE], unsigned int *rounds)
+{
+	(void)key_len; (void)key; (void)decrypt; (void)rk; (void)rounds;
+	return(1);
+}
+
+void aesni_encrypt_sectors(size_t n, const struct sector_op *ops)
+{
+	(void)n; (void)ops;
+}
+
+void aesni_decrypt_blocks(const sector_key *sk, const unsigned char *prev, const unsigned char *in, size_t nblocks, unsigned char *out)
+{
+	(void)sk; (void)prev; (void)in; (void)nblocks; (void)out;
+}
+
+void aesni_decrypt_sector(const struct sector_op *op)
+{
+	(void)op;
+}
+
+void aesni_ctr_blocks(const sector_key *sk, unsigned char *ctr, unsigned char *out, size_t nblocks)
+{
+	(void)sk; (void)ctr; (void)out; (void)nblocks;
+}
+
+#endif // x86
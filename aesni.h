@@ -0,0 +1,43 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	aesni.h: AES-NI sector routines
+*/
+
+#include <stdbool.h>
+
+// These are only ever called through crypto.c, which decides at startup whether the CPU has AES-NI
+int aesni_available(void); // nonzero if this CPU supports the AES-NI instructions
+int aesni_expand_key(size_t key_len, const unsigned char *key, bool decrypt, unsigned char rk[][AES_BLOCK_SIZE], unsigned int *rounds); // expands key into rk (which must have room for 15 round keys); if decrypt, produces the equivalent-inverse-cipher schedule in order of use
+void aesni_encrypt_sectors(size_t n, const struct sector_op *ops); // CBC-encrypts n (at most SECTOR_BATCH) sectors in lockstep, so that their AES rounds pipeline
+void aesni_decrypt_blocks(const sector_key *sk, const unsigned char *prev, const unsigned char *in, size_t nblocks, unsigned char *out); // CBC-decrypts nblocks AES blocks of in, prev being the ciphertext block (or IV) before them
+void aesni_decrypt_sector(const struct sector_op *op); // CBC-decrypts one sector, several AES blocks at a time
+void aesni_ctr_blocks(const sector_key *sk, unsigned char *ctr, unsigned char *out, size_t nblocks); // AES-CTR keystream: encrypts nblocks successive values of the big-endian counter ctr into out, and advances ctr
@@ -0,0 +1,984 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	backing.c: where an onion layer's image is stored
+*/
+
+#define _GNU_SOURCE // for pread/pwrite, preadv/pwritev, posix_fadvise and mremap
+
+#include "backing.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+int backing_start_readv(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint, int *ticket)
+{
+	if(b->start_readv)
+		return(b->start_readv(b, n, ext, hint, ticket));
+	*ticket=-1;
+	return(b->readv(b, n, ext, hint));
+}
+
+int backing_wait(struct backing *b, int ticket)
+{
+	if(ticket<0)
+		return(0);
+	return(b->wait(b, ticket));
+}
+
+int backing_sync(struct backing *b)
+{
+	if(!b->sync)
+		return(0);
+	return(b->sync(b));
+}
+
+int backing_resize(struct backing *b, size_t size)
+{
+	if(size<b->size)
+		return(-EINVAL);
+	if(size==b->size)
+		return(0);
+	if(!b->resize)
+		return(-EOPNOTSUPP);
+	return(b->resize(b, size));
+}
+
+static void backing_free(struct backing *b)
+{
+	free(b);
+}
+
+static int map_readv(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint)
+{
+	(void)hint; // it's all in memory already
+	const unsigned char *map=b->priv;
+	for(size_t i=0;i<n;i++)
+		memcpy(ext[i].buf, map+ext[i].off, ext[i].len);
+	return(0);
+}
+
+static int map_writev(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint)
+{
+	(void)hint; // it's all in memory already
+	unsigned char *map=b->priv;
+	for(size_t i=0;i<n;i++)
+		memcpy(map+ext[i].off, ext[i].buf, ext[i].len);
+	return(0);
+}
+
+static int map_sync(struct backing *b)
+{
+	return(msync(b->priv, b->size, MS_SYNC)?-errno:0);
+}
+
+// In place if the address space after the mapping is free, otherwise wherever the kernel finds room
+static int map_resize(struct backing *b, size_t size)
+{
+	void *map=mremap(b->priv, b->size, size, MREMAP_MAYMOVE);
+	if(map==MAP_FAILED)
+		return(-errno);
+	b->priv=map;
+	b->size=size;
+	return(0);
+}
+
+struct backing *backing_map(unsigned char *map, size_t size)
+{
+	struct backing *b=malloc(sizeof(*b));
+	if(!b) return(NULL);
+	*b=(struct backing){.size=size, .readv=map_readv, .writev=map_writev, .sync=map_sync, .resize=map_resize, .release=backing_free, .priv=map};
+	return(b);
+}
+
+// Windows are mapped without MAP_POPULATE, so mounting costs nothing however big the image is, and pages are only faulted in as they're used
+struct window
+{
+	unsigned char *map; // NULL if not mapped
+	size_t users; // I/Os currently copying to or from it; it can't be unmapped while this is nonzero
+	unsigned long last_use;
+	enum access_hint hint; // what it was last madvise()d for
+};
+
+struct windows
+{
+	pthread_mutex_t lock;
+	int fd;
+	size_t size, nwin, mapped;
+	unsigned long clock;
+	struct window *win; // [nwin]; reallocated (under lock) as the file grows
+};
+
+static size_t window_len(const struct windows *w, size_t i)
+{
+	size_t off=i*(size_t)WINDOW_LENGTH;
+	return(w->size-off<WINDOW_LENGTH?w->size-off:WINDOW_LENGTH);
+}
+
+static unsigned char *window_get(struct windows *w, size_t i, enum access_hint hint)
+{
+	pthread_mutex_lock(&w->lock);
+	struct window *win=w->win+i;
+	if(!win->map)
+	{
+		if(w->mapped>=WINDOW_MAX)
+		{
+			// unmap the least recently used idle window; if all are busy we go over the limit for now
+			struct window *lru=NULL;
+			for(size_t j=0;j<w->nwin;j++)
+				if(w->win[j].map&&!w->win[j].users&&(!lru||w->win[j].last_use<lru->last_use))
+					lru=w->win+j;
+			if(lru)
+			{
+				munmap(lru->map, window_len(w, lru-w->win));
+				lru->map=NULL;
+				w->mapped--;
+			}
+		}
+		void *map=mmap(NULL, window_len(w, i), PROT_READ|PROT_WRITE, MAP_SHARED, w->fd, i*(size_t)WINDOW_LENGTH);
+		if(map==MAP_FAILED)
+		{
+			pthread_mutex_unlock(&w->lock);
+			return(NULL);
+		}
+		win->map=map;
+		win->hint=!hint; // so it gets advised below
+		w->mapped++;
+	}
+	if(win->hint!=hint)
+	{
+		madvise(win->map, window_len(w, i), hint==HINT_SEQUENTIAL?MADV_SEQUENTIAL:MADV_RANDOM);
+		win->hint=hint;
+	}
+	win->users++;
+	win->last_use=++w->clock;
+	pthread_mutex_unlock(&w->lock);
+	return(win->map);
+}
+
+static void window_put(struct windows *w, size_t i)
+{
+	pthread_mutex_lock(&w->lock);
+	w->win[i].users--;
+	pthread_mutex_unlock(&w->lock);
+}
+
+static int window_io(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint, bool write)
+{
+	struct windows *w=b->priv;
+	for(size_t e=0;e<n;e++)
+	{
+		size_t off=ext[e].off, done=0;
+		while(done<ext[e].len)
+		{
+			size_t i=(off+done)/WINDOW_LENGTH, woff=(off+done)%WINDOW_LENGTH, len=ext[e].len-done;
+			if(len>WINDOW_LENGTH-woff) len=WINDOW_LENGTH-woff;
+			unsigned char *map=window_get(w, i, hint);
+			if(!map) return(-errno);
+			if(write)
+				memcpy(map+woff, ext[e].buf+done, len);
+			else
+				memcpy(ext[e].buf+done, map+woff, len);
+			window_put(w, i);
+			done+=len;
+		}
+	}
+	return(0);
+}
+
+static int window_readv(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint)
+{
+	return(window_io(b, n, ext, hint, false));
+}
+
+static int window_writev(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint)
+{
+	return(window_io(b, n, ext, hint, true));
+}
+
+static int window_sync(struct backing *b)
+{
+	struct windows *w=b->priv;
+	int e=0;
+	pthread_mutex_lock(&w->lock);
+	for(size_t i=0;i<w->nwin&&!e;i++)
+		if(w->win[i].map&&msync(w->win[i].map, window_len(w, i), MS_SYNC))
+			e=-errno;
+	pthread_mutex_unlock(&w->lock);
+	if(!e&&fdatasync(w->fd))
+		e=-errno;
+	return(e);
+}
+
+static void window_release(struct backing *b)
+{
+	struct windows *w=b->priv;
+	for(size_t i=0;i<w->nwin;i++)
+		if(w->win[i].map)
+			munmap(w->win[i].map, window_len(w, i));
+	pthread_mutex_destroy(&w->lock);
+	free(w->win);
+	free(w);
+	free(b);
+}
+
+// The lock keeps out a concurrent window_sync(); reads and writes can't be in flight, so no window has users
+static int window_resize(struct backing *b, size_t size)
+{
+	struct windows *w=b->priv;
+	size_t nwin=(size+WINDOW_LENGTH-1)/WINDOW_LENGTH;
+	pthread_mutex_lock(&w->lock);
+	struct window *win=realloc(w->win, nwin*sizeof(*win));
+	if(!win)
+	{
+		pthread_mutex_unlock(&w->lock);
+		return(-ENOMEM);
+	}
+	w->win=win;
+	memset(win+w->nwin, 0, (nwin-w->nwin)*sizeof(*win));
+	// the old last window may have been mapped short; it's mapped again at its new length when next used
+	size_t last=w->nwin-1;
+	if(w->nwin&&win[last].map&&window_len(w, last)<WINDOW_LENGTH)
+	{
+		munmap(win[last].map, window_len(w, last));
+		win[last].map=NULL;
+		w->mapped--;
+	}
+	w->nwin=nwin;
+	w->size=b->size=size;
+	pthread_mutex_unlock(&w->lock);
+	return(0);
+}
+
+struct backing *backing_window(int fd, size_t size)
+{
+	size_t nwin=(size+WINDOW_LENGTH-1)/WINDOW_LENGTH;
+	struct backing *b=malloc(sizeof(*b));
+	struct windows *w=calloc(1, sizeof(*w));
+	struct window *win=calloc(nwin, sizeof(*win));
+	if(!b||!w||!win)
+	{
+		free(b);
+		free(w);
+		free(win);
+		return(NULL);
+	}
+	w->win=win;
+	w->fd=fd;
+	w->size=size;
+	w->nwin=nwin;
+	if((errno=pthread_mutex_init(&w->lock, NULL)))
+	{
+		free(b);
+		free(w);
+		free(win);
+		return(NULL);
+	}
+	*b=(struct backing){.size=size, .readv=window_readv, .writev=window_writev, .sync=window_sync, .resize=window_resize, .release=window_release, .priv=w};
+	return(b);
+}
+
+// Readahead state belongs to the open file description, so a second one (opened through /proc) is kept for sequential access
+struct files
+{
+	int fd[2]; // indexed by enum access_hint
+};
+
+static struct files *files_open(int fd)
+{
+	struct files *f=malloc(sizeof(*f));
+	if(!f) return(NULL);
+	char path[32];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	f->fd[HINT_RANDOM]=fd;
+	f->fd[HINT_SEQUENTIAL]=open(path, O_RDWR);
+	if(f->fd[HINT_SEQUENTIAL]<0) // no /proc; share the one description, and its readahead
+		f->fd[HINT_SEQUENTIAL]=fd;
+	else
+		posix_fadvise(f->fd[HINT_SEQUENTIAL], 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+	return(f);
+}
+
+static void files_close(struct files *f)
+{
+	if(f->fd[HINT_SEQUENTIAL]!=f->fd[HINT_RANDOM])
+		close(f->fd[HINT_SEQUENTIAL]);
+	free(f);
+}
+
+static int pread_io(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint, bool write)
+{
+	struct files *f=b->priv;
+	int fd=f->fd[hint];
+	for(size_t e=0;e<n;e++)
+		for(size_t done=0;done<ext[e].len;)
+		{
+			ssize_t rv=write?pwrite(fd, ext[e].buf+done, ext[e].len-done, ext[e].off+done):pread(fd, ext[e].buf+done, ext[e].len-done, ext[e].off+done);
+			if(rv<0)
+			{
+				if(errno==EINTR) continue;
+				return(-errno);
+			}
+			if(!rv) return(-EIO); // the file has shrunk under us
+			done+=rv;
+		}
+	return(0);
+}
+
+static int pread_readv(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint)
+{
+	return(pread_io(b, n, ext, hint, false));
+}
+
+static int pread_writev(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint)
+{
+	return(pread_io(b, n, ext, hint, true));
+}
+
+static int pread_sync(struct backing *b)
+{
+	struct files *f=b->priv;
+	return(fdatasync(f->fd[HINT_RANDOM])?-errno:0);
+}
+
+// Nothing is mapped or cached by size, so the new blocks can simply be read and written
+static int pread_resize(struct backing *b, size_t size)
+{
+	b->size=size;
+	return(0);
+}
+
+static void pread_release(struct backing *b)
+{
+	files_close(b->priv);
+	free(b);
+}
+
+struct backing *backing_pread(int fd, size_t size)
+{
+	struct backing *b=malloc(sizeof(*b));
+	struct files *f=b?files_open(fd):NULL;
+	if(!f)
+	{
+		free(b);
+		return(NULL);
+	}
+	*b=(struct backing){.size=size, .readv=pread_readv, .writev=pread_writev, .sync=pread_sync, .resize=pread_resize, .release=pread_release, .priv=f};
+	return(b);
+}
+
+// io_uring, driven with raw syscalls.  Each thread gets its own ring the first time it does I/O, so submission needs no locking; runs of extents that are contiguous in the file go in as one READV or WRITEV
+#define URING_ENTRIES	128 // submission queue depth of each thread's ring
+#define URING_BATCHES	16 // start_readv()s a thread can have outstanding at once
+#define URING_MAXIOV	1024 // iovecs per request, at most
+
+struct uring_req
+{
+	size_t off, len; // in the file
+	unsigned int iov0, niov; // within the batch's iov
+};
+
+// One start_readv() (or a whole writev()); its ticket is its index
+struct batch
+{
+	bool busy;
+	bool write;
+	int fd;
+	size_t pending; // requests not yet completed
+	int err; // first error, as -errno
+	struct iovec *iov;
+	struct uring_req *req; // allocated along with iov
+};
+
+struct ring
+{
+	int fd; // -1 if this thread couldn't get a ring, and does its I/O synchronously
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+	unsigned int sq_entries, unsubmitted;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_len, cq_len, sqes_len;
+	struct batch batch[URING_BATCHES];
+};
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_once=PTHREAD_ONCE_INIT;
+static bool ring_key_ok;
+
+static void ring_free(void *arg)
+{
+	struct ring *r=arg;
+	if(r->fd>=0)
+	{
+		munmap(r->sqes, r->sqes_len);
+		if(r->cq_map!=r->sq_map)
+			munmap(r->cq_map, r->cq_len);
+		munmap(r->sq_map, r->sq_len);
+		close(r->fd);
+	}
+	for(size_t i=0;i<URING_BATCHES;i++)
+		free(r->batch[i].iov);
+	free(r);
+}
+
+static void ring_key_init(void)
+{
+	ring_key_ok=!pthread_key_create(&ring_key, ring_free);
+}
+
+static int ring_setup(struct ring *r)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	if((r->fd=syscall(__NR_io_uring_setup, URING_ENTRIES, &p))<0)
+		return(-1);
+	r->sq_len=p.sq_off.array+p.sq_entries*sizeof(unsigned int);
+	r->cq_len=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+	if(p.features&IORING_FEAT_SINGLE_MMAP)
+	{
+		if(r->cq_len>r->sq_len) r->sq_len=r->cq_len;
+		r->cq_len=r->sq_len;
+	}
+	r->sq_map=mmap(NULL, r->sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if(r->sq_map==MAP_FAILED)
+		goto fail;
+	if(p.features&IORING_FEAT_SINGLE_MMAP)
+		r->cq_map=r->sq_map;
+	else if((r->cq_map=mmap(NULL, r->cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING))==MAP_FAILED)
+	{
+		munmap(r->sq_map, r->sq_len);
+		goto fail;
+	}
+	r->sqes_len=p.sq_entries*sizeof(struct io_uring_sqe);
+	if((r->sqes=mmap(NULL, r->sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES))==MAP_FAILED)
+	{
+		if(r->cq_map!=r->sq_map)
+			munmap(r->cq_map, r->cq_len);
+		munmap(r->sq_map, r->sq_len);
+		goto fail;
+	}
+	unsigned char *sq=r->sq_map, *cq=r->cq_map;
+	r->sq_head=(unsigned int *)(sq+p.sq_off.head);
+	r->sq_tail=(unsigned int *)(sq+p.sq_off.tail);
+	r->sq_mask=(unsigned int *)(sq+p.sq_off.ring_mask);
+	r->sq_array=(unsigned int *)(sq+p.sq_off.array);
+	r->cq_head=(unsigned int *)(cq+p.cq_off.head);
+	r->cq_tail=(unsigned int *)(cq+p.cq_off.tail);
+	r->cq_mask=(unsigned int *)(cq+p.cq_off.ring_mask);
+	r->cqes=(struct io_uring_cqe *)(cq+p.cq_off.cqes);
+	r->sq_entries=p.sq_entries;
+	return(0);
+	fail:
+	close(r->fd);
+	r->fd=-1;
+	return(-1);
+}
+
+static struct ring *ring_get(void)
+{
+	pthread_once(&ring_once, ring_key_init);
+	if(!ring_key_ok) return(NULL);
+	struct ring *r=pthread_getspecific(ring_key);
+	if(r) return(r);
+	if(!(r=calloc(1, sizeof(*r)))) return(NULL);
+	ring_setup(r); // on failure r->fd is -1, which is remembered so we don't keep trying
+	if(pthread_setspecific(ring_key, r))
+	{
+		ring_free(r);
+		return(NULL);
+	}
+	return(r);
+}
+
+static int ring_enter(struct ring *r, unsigned int min_complete)
+{
+	for(;;)
+	{
+		int rv=syscall(__NR_io_uring_enter, r->fd, r->unsubmitted, min_complete, min_complete?IORING_ENTER_GETEVENTS:0, NULL, 0);
+		if(rv>=0)
+		{
+			r->unsubmitted-=rv;
+			return(0);
+		}
+		if(errno!=EINTR&&errno!=EAGAIN&&errno!=EBUSY) return(-errno);
+	}
+}
+
+// Finishes a request synchronously, from skip bytes in; for short completions, and when the ring can't take it
+static int sync_io(int fd, bool write, struct iovec *iov, unsigned int niov, size_t off, size_t skip)
+{
+	while(niov)
+	{
+		if(skip>=iov->iov_len)
+		{
+			skip-=iov->iov_len;
+			off+=iov->iov_len;
+			iov++;
+			niov--;
+			continue;
+		}
+		iov->iov_base=(unsigned char *)iov->iov_base+skip;
+		iov->iov_len-=skip;
+		off+=skip;
+		ssize_t rv=write?pwritev(fd, iov, niov, off):preadv(fd, iov, niov, off);
+		if(rv<0)
+		{
+			if(errno==EINTR) continue;
+			return(-errno);
+		}
+		if(!rv) return(-EIO); // the file has shrunk under us
+		skip=rv;
+	}
+	return(0);
+}
+
+static void ring_reap(struct ring *r)
+{
+	unsigned int head=*r->cq_head, tail=__atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	for(;head!=tail;head++)
+	{
+		const struct io_uring_cqe *cqe=r->cqes+(head&*r->cq_mask);
+		struct batch *bt=r->batch+(cqe->user_data>>32);
+		struct uring_req *q=bt->req+(cqe->user_data&0xFFFFFFFF);
+		int e=0;
+		if(cqe->res<0)
+			e=cqe->res;
+		else if((size_t)cqe->res<q->len)
+			e=sync_io(bt->fd, bt->write, bt->iov+q->iov0, q->niov, q->off, cqe->res);
+		if(e&&!bt->err) bt->err=e;
+		bt->pending--;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *ring_sqe(struct ring *r)
+{
+	unsigned int tail=*r->sq_tail;
+	if(tail-__atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)>=r->sq_entries)
+	{
+		// full, so hand what's there to the kernel, which takes it off the queue
+		if(ring_enter(r, 0)||tail-__atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)>=r->sq_entries)
+			return(NULL);
+	}
+	unsigned int idx=tail&*r->sq_mask;
+	struct io_uring_sqe *sqe=r->sqes+idx;
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx]=idx;
+	return(sqe);
+}
+
+static void ring_push(struct ring *r)
+{
+	__atomic_store_n(r->sq_tail, *r->sq_tail+1, __ATOMIC_RELEASE);
+	r->unsubmitted++;
+}
+
+static int uring_start(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint, bool write, int *ticket)
+{
+	struct files *f=b->priv;
+	int fd=f->fd[hint];
+	struct iovec *iov=malloc(n*(sizeof(struct iovec)+sizeof(struct uring_req)));
+	if(!iov) return(-errno);
+	struct uring_req *req=(struct uring_req *)(iov+n);
+	size_t nreq=0;
+	for(size_t i=0;i<n;i++)
+	{
+		iov[i]=(struct iovec){.iov_base=ext[i].buf, .iov_len=ext[i].len};
+		if(nreq&&req[nreq-1].off+req[nreq-1].len==ext[i].off&&req[nreq-1].niov<URING_MAXIOV)
+		{
+			req[nreq-1].len+=ext[i].len;
+			req[nreq-1].niov++;
+		}
+		else
+			req[nreq++]=(struct uring_req){.off=ext[i].off, .len=ext[i].len, .iov0=i, .niov=1};
+	}
+	struct ring *r=ring_get();
+	size_t bi=URING_BATCHES;
+	if(r&&r->fd>=0)
+		for(bi=0;bi<URING_BATCHES&&r->batch[bi].busy;bi++);
+	if(bi==URING_BATCHES) // no ring, or too much outstanding on it already
+	{
+		int e=0;
+		for(size_t q=0;q<nreq&&!e;q++)
+			e=sync_io(fd, write, iov+req[q].iov0, req[q].niov, req[q].off, 0);
+		free(iov);
+		*ticket=-1;
+		return(e);
+	}
+	struct batch *bt=r->batch+bi;
+	*bt=(struct batch){.busy=true, .write=write, .fd=fd, .pending=nreq, .err=0, .iov=iov, .req=req};
+	for(size_t q=0;q<nreq;q++)
+	{
+		struct io_uring_sqe *sqe=ring_sqe(r);
+		if(!sqe)
+		{
+			int e=sync_io(fd, write, iov+req[q].iov0, req[q].niov, req[q].off, 0);
+			if(e&&!bt->err) bt->err=e;
+			bt->pending--;
+			continue;
+		}
+		sqe->opcode=write?IORING_OP_WRITEV:IORING_OP_READV;
+		sqe->fd=fd;
+		sqe->off=req[q].off;
+		sqe->addr=(unsigned long)(iov+req[q].iov0);
+		sqe->len=req[q].niov;
+		sqe->user_data=(unsigned long long)bi<<32|q;
+		ring_push(r);
+	}
+	if(r->unsubmitted)
+		ring_enter(r, 0); // if this fails, the requests are still queued, and go in when we wait
+	*ticket=bi;
+	return(0);
+}
+
+static int uring_wait(struct backing *b, int ticket)
+{
+	(void)b;
+	struct ring *r=ring_get();
+	struct batch *bt=r->batch+ticket;
+	int e;
+	for(;;)
+	{
+		ring_reap(r);
+		if(!bt->pending) break;
+		if((e=ring_enter(r, 1)))
+			return(e); // the batch stays busy, as the kernel may yet write into its buffers
+	}
+	e=bt->err;
+	free(bt->iov);
+	bt->iov=NULL;
+	bt->busy=false;
+	return(e);
+}
+
+static int uring_start_readv(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint, int *ticket)
+{
+	return(uring_start(b, n, ext, hint, false, ticket));
+}
+
+static int uring_readv(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint)
+{
+	int ticket, e;
+	if((e=uring_start(b, n, ext, hint, false, &ticket)))
+		return(e);
+	return(backing_wait(b, ticket));
+}
+
+static int uring_writev(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint)
+{
+	int ticket, e;
+	if((e=uring_start(b, n, ext, hint, true, &ticket)))
+		return(e);
+	return(backing_wait(b, ticket));
+}
+
+struct backing *backing_uring(int fd, size_t size)
+{
+	struct ring *r=ring_get();
+	if(!r) return(NULL);
+	if(r->fd<0) // it's no use if the kernel won't let us have it
+	{
+		errno=ENOSYS;
+		return(NULL);
+	}
+	struct backing *b=malloc(sizeof(*b));
+	struct files *f=b?files_open(fd):NULL;
+	if(!f)
+	{
+		free(b);
+		return(NULL);
+	}
+	*b=(struct backing){.size=size, .readv=uring_readv, .writev=uring_writev, .sync=pread_sync, .resize=pread_resize, .release=pread_release, .start_readv=uring_start_readv, .wait=uring_wait, .priv=f};
+	return(b);
+}
+
+// Striping: a request's extents are cut at chunk boundaries and sorted by member, and each member's share but one goes to that member's thread, while the caller does the one left itself
+#define STRIPE_STACK	64 // pieces a request can be cut into without a malloc()
+
+struct stripe_req
+{
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	size_t pending; // shares the member threads haven't finished
+	int err; // the first error, as -errno
+};
+
+struct stripe_share
+{
+	struct stripe_req *req;
+	size_t n;
+	const struct extent *ext;
+	enum access_hint hint;
+	bool write;
+	struct stripe_share *next; // in the member's queue
+};
+
+struct stripe_member
+{
+	struct stripe *s;
+	struct backing *b;
+	pthread_t thread;
+	pthread_cond_t kick; // wakes the thread
+	struct stripe_share *queue, **tail;
+};
+
+struct stripe
+{
+	size_t n, chunk;
+	pthread_mutex_t lock; // over every member's queue
+	bool started, stopping;
+	struct stripe_member m[];
+};
+
+static int share_io(struct backing *b, const struct stripe_share *sh)
+{
+	return(sh->write?b->writev(b, sh->n, sh->ext, sh->hint):b->readv(b, sh->n, sh->ext, sh->hint));
+}
+
+static void *stripe_worker(void *arg)
+{
+	struct stripe_member *m=arg;
+	struct stripe *s=m->s;
+	pthread_mutex_lock(&s->lock);
+	for(;;)
+	{
+		while(!m->queue&&!s->stopping)
+			pthread_cond_wait(&m->kick, &s->lock);
+		struct stripe_share *sh=m->queue;
+		if(!sh) break; // so we're stopping
+		if(!(m->queue=sh->next))
+			m->tail=&m->queue;
+		pthread_mutex_unlock(&s->lock);
+		int e=share_io(m->b, sh);
+		struct stripe_req *req=sh->req; // sh is gone once pending reaches 0
+		pthread_mutex_lock(&req->lock);
+		if(e&&!req->err) req->err=e;
+		if(!--req->pending)
+			pthread_cond_signal(&req->done);
+		pthread_mutex_unlock(&req->lock);
+		pthread_mutex_lock(&s->lock);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return(NULL);
+}
+
+// The threads are started on first use rather than at creation, as onionmount creates its backings before fuse_main() daemonises, and threads don't survive that.  Call with s->lock held
+static int stripe_start(struct stripe *s)
+{
+	if(s->started) return(0);
+	size_t i;
+	int e=0;
+	for(i=0;i<s->n&&!e;i++)
+		e=pthread_create(&s->m[i].thread, NULL, stripe_worker, s->m+i);
+	if(e) // take back the ones that did start
+	{
+		s->stopping=true;
+		for(size_t j=0;j<s->n;j++)
+			pthread_cond_signal(&s->m[j].kick);
+		pthread_mutex_unlock(&s->lock);
+		for(size_t j=0;j+1<i;j++)
+			pthread_join(s->m[j].thread, NULL);
+		pthread_mutex_lock(&s->lock);
+		s->stopping=false;
+		return(-e);
+	}
+	s->started=true;
+	return(0);
+}
+
+// Cuts the piece of ext starting done bytes in at the next chunk boundary; returns its length
+static size_t stripe_cut(const struct stripe *s, const struct extent *ext, size_t done, struct extent *piece, size_t *member)
+{
+	size_t off=ext->off+done, c=off/s->chunk, within=off%s->chunk, len=ext->len-done;
+	if(len>s->chunk-within) len=s->chunk-within;
+	*member=c%s->n;
+	*piece=(struct extent){.off=(c/s->n)*s->chunk+within, .len=len, .buf=ext->buf+done};
+	return(len);
+}
+
+static int stripe_io(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint, bool write)
+{
+	struct stripe *s=b->priv;
+	size_t count[s->n], pos[s->n], np=0, m;
+	struct extent piece, stack[STRIPE_STACK];
+	memset(count, 0, sizeof(count));
+	for(size_t i=0;i<n;i++)
+		for(size_t done=0;done<ext[i].len;np++)
+		{
+			done+=stripe_cut(s, ext+i, done, &piece, &m);
+			count[m]++;
+		}
+	struct extent *p=np>STRIPE_STACK?malloc(np*sizeof(*p)):stack;
+	if(!p) return(-ENOMEM);
+	size_t active=0, first=s->n;
+	for(m=0;m<s->n;m++)
+	{
+		pos[m]=m?pos[m-1]+count[m-1]:0;
+		if(count[m])
+		{
+			active++;
+			if(first==s->n) first=m;
+		}
+	}
+	for(size_t i=0;i<n;i++)
+		for(size_t done=0;done<ext[i].len;)
+		{
+			done+=stripe_cut(s, ext+i, done, &piece, &m);
+			p[pos[m]++]=piece;
+		}
+	// pos[m] is now the end of member m's pieces
+	struct stripe_share shares[s->n];
+	struct stripe_req req={.pending=0, .err=0};
+	bool threaded=active>1, all_here=!threaded;
+	if(threaded)
+	{
+		pthread_mutex_init(&req.lock, NULL);
+		pthread_cond_init(&req.done, NULL);
+		pthread_mutex_lock(&s->lock);
+		if(stripe_start(s)) // then it's all done here, one member after another
+			all_here=true;
+		else
+			for(m=first+1;m<s->n;m++)
+				if(count[m])
+				{
+					shares[m]=(struct stripe_share){.req=&req, .n=count[m], .ext=p+pos[m]-count[m], .hint=hint, .write=write, .next=NULL};
+					*s->m[m].tail=shares+m;
+					s->m[m].tail=&shares[m].next;
+					req.pending++;
+					pthread_cond_signal(&s->m[m].kick);
+				}
+		pthread_mutex_unlock(&s->lock);
+	}
+	int e=0, e2;
+	for(m=first;m<s->n;m++)
+		if(count[m]&&(m==first||all_here))
+		{
+			struct stripe_share sh={.n=count[m], .ext=p+pos[m]-count[m], .hint=hint, .write=write};
+			if((e2=share_io(s->m[m].b, &sh))&&!e)
+				e=e2;
+		}
+	if(threaded)
+	{
+		pthread_mutex_lock(&req.lock);
+		while(req.pending)
+			pthread_cond_wait(&req.done, &req.lock);
+		pthread_mutex_unlock(&req.lock);
+		if(req.err&&!e) e=req.err;
+		pthread_cond_destroy(&req.done);
+		pthread_mutex_destroy(&req.lock);
+	}
+	if(p!=stack) free(p);
+	return(e);
+}
+
+static int stripe_readv(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint)
+{
+	return(stripe_io(b, n, ext, hint, false));
+}
+
+static int stripe_writev(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint)
+{
+	return(stripe_io(b, n, ext, hint, true));
+}
+
+static int stripe_sync(struct backing *b)
+{
+	struct stripe *s=b->priv;
+	int e=0, e2;
+	for(size_t m=0;m<s->n;m++)
+		if((e2=backing_sync(s->m[m].b))&&!e)
+			e=e2;
+	return(e);
+}
+
+static void stripe_release(struct backing *b)
+{
+	struct stripe *s=b->priv;
+	pthread_mutex_lock(&s->lock);
+	bool started=s->started;
+	s->stopping=true;
+	for(size_t m=0;m<s->n;m++)
+		pthread_cond_signal(&s->m[m].kick);
+	pthread_mutex_unlock(&s->lock);
+	for(size_t m=0;m<s->n;m++)
+	{
+		if(started)
+			pthread_join(s->m[m].thread, NULL);
+		pthread_cond_destroy(&s->m[m].kick);
+	}
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+	free(b);
+}
+
+struct backing *backing_stripe(size_t n, struct backing *const members[], size_t chunk)
+{
+	if(!n||n>STRIPE_MAX||!chunk)
+	{
+		errno=EINVAL;
+		return(NULL);
+	}
+	size_t msize=members[0]->size;
+	for(size_t m=1;m<n;m++)
+		if(members[m]->size<msize)
+			msize=members[m]->size;
+	msize-=msize%chunk;
+	struct backing *b=malloc(sizeof(*b));
+	struct stripe *s=calloc(1, sizeof(*s)+n*sizeof(struct stripe_member));
+	if(!b||!s)
+	{
+		free(b);
+		free(s);
+		return(NULL);
+	}
+	s->n=n;
+	s->chunk=chunk;
+	pthread_mutex_init(&s->lock, NULL);
+	for(size_t m=0;m<n;m++)
+	{
+		s->m[m]=(struct stripe_member){.s=s, .b=members[m], .queue=NULL};
+		s->m[m].tail=&s->m[m].queue;
+		pthread_cond_init(&s->m[m].kick, NULL);
+	}
+	*b=(struct backing){.size=n*msize, .readv=stripe_readv, .writev=stripe_writev, .sync=stripe_sync, .release=stripe_release, .priv=s};
+	return(b);
+}
@@ -0,0 +1,85 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	backing.h: where an onion layer's image is stored
+*/
+
+#ifndef BACKING_H
+#define BACKING_H
+
+#include <stddef.h>
+
+struct extent
+{
+	size_t off, len; // byte range within the backing
+	unsigned char *buf;
+};
+
+// How the blocks an I/O touches are likely to be followed up, so the backing can tell the kernel
+enum access_hint {HINT_RANDOM, HINT_SEQUENTIAL};
+
+// Where a layer's image lives: a file, or the keystream of the layer beneath.  readv and writev return 0 or -errno
+struct backing
+{
+	size_t size; // in bytes
+	int (*readv)(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint);
+	int (*writev)(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint);
+	void (*release)(struct backing *b); // frees the backing itself, but not whatever it is backed by
+	// Optional asynchronous reads: start_readv queues the reads (ext needn't outlive the call, but the buffers must) and sets *ticket, then wait finishes them.  Each ticket must be waited for exactly once, by the thread that started it
+	int (*start_readv)(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint, int *ticket);
+	int (*wait)(struct backing *b, int ticket);
+	int (*sync)(struct backing *b); // optional: makes everything written so far durable.  Returns 0 or -errno
+	int (*resize)(struct backing *b, size_t size); // optional: takes in the file having grown to size bytes.  Not with reads or writes in flight.  Returns 0 or -errno
+	void *priv;
+};
+
+// These work on any backing, falling back to a plain readv (with a ticket of -1) if it can't read asynchronously
+int backing_start_readv(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint, int *ticket);
+int backing_wait(struct backing *b, int ticket);
+int backing_sync(struct backing *b); // 0 if the backing has nothing to sync
+int backing_resize(struct backing *b, size_t size); // -EOPNOTSUPP if the backing can't change size, -EINVAL if size is smaller
+
+#define WINDOW_LENGTH	(32<<20) // bytes per mapping window of backing_window()
+#define WINDOW_MAX		32 // windows kept mapped at once, at most
+
+// These return NULL with errno set on failure.  None of them takes ownership of fd
+struct backing *backing_map(unsigned char *map, size_t size); // an image already mapped (or held) in memory.  Its resize mremap()s map, which may move it to b->priv
+struct backing *backing_window(int fd, size_t size); // maps WINDOW_LENGTH windows of fd as they're touched, unmapping the least recently used beyond WINDOW_MAX
+struct backing *backing_pread(int fd, size_t size); // pread()s and pwrite()s fd, letting sequential and random access have separate readahead
+struct backing *backing_uring(int fd, size_t size); // reads and writes fd through io_uring, with a ring per thread; reads can be asynchronous
+
+#define STRIPE_MAX		16 // members of a stripe set, at most
+#define STRIPE_CHUNK	(256<<10) // default bytes per stripe chunk; a whole number of blocks, clusters and pages
+
+// RAID-0 across members: chunk c of the image (chunk bytes long; a whole number of blocks, so that none is split) is at (c/n)*chunk in members[c%n], and the size is n times the smallest member's whole chunks.  A request touching several members has them each do their share in parallel, on a thread per member.  Doesn't take ownership of the members
+struct backing *backing_stripe(size_t n, struct backing *const members[], size_t chunk);
+
+#endif // BACKING_H
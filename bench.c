@@ -0,0 +1,486 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	bench.c: micro-benchmarks of the crypto and onion primitives, and of whole reads and writes of an in-memory layer
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "layer.h"
+#include "backing.h"
+#include "bits.h"
+
+#define SECTOR_KEY_LENGTH	(SECTOR_LENGTH-0x10) // as mkonion uses
+#define SECTOR_KEY_STRIDE	13
+#define MAX_THREADS			256
+#define REQUEST_MAX			(1<<17) // largest layer_read/layer_write a bench makes
+#define KS_BATCH			512 // blocks per decode_keystreams/encode_keystreams call, ie. a 4k page of keystream
+#define RANGE_LENGTH		100 // bytes each decrypt_sector_range bench call decrypts, from the end of a sector as the end of a read would
+
+// Per-thread state; each thread works on its own buffers, and the layer benches pick their own random positions
+struct worker
+{
+	pthread_t thread;
+	const struct bench *b;
+	unsigned long long rnd; // xorshift state
+	size_t index; // block index, for the benches that walk the key table
+	unsigned char key[KEY_LENGTH_HIGH];
+	unsigned char iv[SECTOR_BATCH*IV_LENGTH], newiv[IV_LENGTH], ks[KS_BLKLEN];
+	unsigned char in[SECTOR_BATCH*SECTOR_LENGTH], out[SECTOR_BATCH*SECTOR_LENGTH];
+	unsigned char ivs[KS_BATCH*IV_LENGTH], kss[KS_BATCH*KS_BLKLEN]; // for the batch keystream benches
+	unsigned char *req; // [REQUEST_MAX]
+	size_t bytes; // work done, in bytes of unit
+	int err; // -errno if a call failed
+};
+
+// One benchmark: fn does a round of work and returns how many bytes of it it did, or -errno.  A "sector" is unit bytes of that work
+struct bench
+{
+	const char *name;
+	ssize_t (*fn)(struct worker *w);
+	size_t unit;
+	bool layer; // uses the layer, so layer_flush() it at the end and count that in the time
+};
+
+static struct layer layer;
+static unsigned char sectorkey[SECTOR_KEY_LENGTH];
+static pthread_mutex_t start_mx=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond=PTHREAD_COND_INITIALIZER;
+static bool go, stop;
+
+static unsigned long long xorshift(struct worker *w)
+{
+	w->rnd^=w->rnd<<13;
+	w->rnd^=w->rnd>>7;
+	w->rnd^=w->rnd<<17;
+	return(w->rnd);
+}
+
+// The crypto functions return 0, positive, or negative with errno set
+static ssize_t crypto_rv(int e, size_t bytes)
+{
+	if(e<0) return(-errno);
+	if(e) return(-EIO);
+	return(bytes);
+}
+
+static ssize_t bench_derive_key(struct worker *w)
+{
+	return(crypto_rv(derive_key(SECTOR_KEY_LENGTH, sectorkey, KEY_LENGTH_HIGH, w->key, SECTOR_KEY_STRIDE, w->index++), SECTOR_LENGTH));
+}
+
+static ssize_t bench_encrypt_sector(struct worker *w)
+{
+	return(crypto_rv(encrypt_sector(KEY_LENGTH_HIGH, w->key, w->iv, w->in, w->out), SECTOR_LENGTH));
+}
+
+static ssize_t bench_decrypt_sector(struct worker *w)
+{
+	return(crypto_rv(decrypt_sector(KEY_LENGTH_HIGH, w->key, w->iv, w->in, w->out), SECTOR_LENGTH));
+}
+
+static ssize_t bench_decrypt_sector_range(struct worker *w)
+{
+	size_t blk=w->index++;
+	return(crypto_rv(decrypt_sector_range(key_table_dec(&layer.keys, blk), w->iv, w->in, SECTOR_LENGTH-RANGE_LENGTH, RANGE_LENGTH, w->out), RANGE_LENGTH));
+}
+
+static ssize_t bench_sectors(struct worker *w, bool enc)
+{
+	struct sector_op ops[SECTOR_BATCH];
+	for(size_t i=0;i<SECTOR_BATCH;i++)
+	{
+		size_t blk=w->index++;
+		ops[i]=(struct sector_op){.key=enc?key_table_enc(&layer.keys, blk):key_table_dec(&layer.keys, blk), .iv=w->iv+i*IV_LENGTH, .in=w->in+i*SECTOR_LENGTH, .out=w->out+i*SECTOR_LENGTH};
+	}
+	return(crypto_rv(enc?encrypt_sectors(SECTOR_BATCH, ops):decrypt_sectors(SECTOR_BATCH, ops), SECTOR_BATCH*SECTOR_LENGTH));
+}
+
+static ssize_t bench_encrypt_sectors(struct worker *w)
+{
+	return(bench_sectors(w, true));
+}
+
+static ssize_t bench_decrypt_sectors(struct worker *w)
+{
+	return(bench_sectors(w, false));
+}
+
+static ssize_t bench_generate_iv(struct worker *w)
+{
+	return(crypto_rv(generate_iv(w->iv), IV_LENGTH));
+}
+
+static ssize_t bench_generate_newiv(struct worker *w)
+{
+	return(crypto_rv(generate_newiv(w->iv, w->newiv), IV_LENGTH));
+}
+
+static ssize_t bench_decode_keystream(struct worker *w)
+{
+	return(crypto_rv(decode_keystream(w->iv, w->ks), KS_BLKLEN));
+}
+
+static ssize_t bench_encode_keystream(struct worker *w)
+{
+	w->ks[0]++;
+	return(crypto_rv(encode_keystream(w->ks, w->newiv), KS_BLKLEN));
+}
+
+static ssize_t bench_decode_keystreams(struct worker *w)
+{
+	return(crypto_rv(decode_keystreams(KS_BATCH, w->ivs, w->kss), KS_BATCH*KS_BLKLEN));
+}
+
+static ssize_t bench_encode_keystreams(struct worker *w)
+{
+	w->kss[0]++;
+	return(crypto_rv(encode_keystreams(KS_BATCH, w->kss, w->ivs), KS_BATCH*KS_BLKLEN));
+}
+
+// A random request of len bytes, aligned to align, within file f
+static ssize_t layer_request(struct worker *w, enum onion_file f, bool write, size_t len, size_t align)
+{
+	size_t slots=(layer_size(&layer, f)-len)/align+1;
+	size_t pos=(xorshift(w)%slots)*align;
+	if(write)
+	{
+		w->req[0]++;
+		return(layer_write(&layer, f, w->req, len, pos));
+	}
+	return(layer_read(&layer, f, w->req, len, pos));
+}
+
+static ssize_t bench_read_sector(struct worker *w)
+{
+	return(layer_request(w, ONION_DATA, false, SECTOR_LENGTH, SECTOR_LENGTH));
+}
+
+static ssize_t bench_write_sector(struct worker *w)
+{
+	return(layer_request(w, ONION_DATA, true, SECTOR_LENGTH, SECTOR_LENGTH));
+}
+
+static ssize_t bench_read_4k(struct worker *w)
+{
+	return(layer_request(w, ONION_DATA, false, 4096, 4096));
+}
+
+static ssize_t bench_write_4k(struct worker *w)
+{
+	return(layer_request(w, ONION_DATA, true, 4096, 4096));
+}
+
+static ssize_t bench_read_128k(struct worker *w)
+{
+	return(layer_request(w, ONION_DATA, false, REQUEST_MAX, 4096));
+}
+
+static ssize_t bench_write_128k(struct worker *w)
+{
+	return(layer_request(w, ONION_DATA, true, REQUEST_MAX, 4096));
+}
+
+static ssize_t bench_ks_read_4k(struct worker *w)
+{
+	return(layer_request(w, ONION_KEYSTREAM, false, 4096, 4096));
+}
+
+static ssize_t bench_ks_write_4k(struct worker *w)
+{
+	return(layer_request(w, ONION_KEYSTREAM, true, 4096, 4096));
+}
+
+static const struct bench benches[]=
+{
+	{"derive_key", bench_derive_key, SECTOR_LENGTH, false},
+	{"encrypt_sector", bench_encrypt_sector, SECTOR_LENGTH, false}, // expands the key every time, as the plain API must
+	{"decrypt_sector", bench_decrypt_sector, SECTOR_LENGTH, false},
+	{"encrypt_sectors", bench_encrypt_sectors, SECTOR_LENGTH, false}, // SECTOR_BATCH at a time from the key table, as the layer does
+	{"decrypt_sectors", bench_decrypt_sectors, SECTOR_LENGTH, false},
+	{"decrypt_sector_range", bench_decrypt_sector_range, RANGE_LENGTH, false}, // the tail of a sector, as the end of a read wants
+	{"generate_iv", bench_generate_iv, IV_LENGTH, false},
+	{"generate_newiv", bench_generate_newiv, IV_LENGTH, false},
+	{"decode_keystream", bench_decode_keystream, KS_BLKLEN, false},
+	{"encode_keystream", bench_encode_keystream, KS_BLKLEN, false},
+	{"decode_keystreams", bench_decode_keystreams, KS_BLKLEN, false}, // KS_BATCH at a time, as the layer does
+	{"encode_keystreams", bench_encode_keystreams, KS_BLKLEN, false},
+	{"read_sector", bench_read_sector, SECTOR_LENGTH, true}, // the whole per-sector read: IV, decrypt
+	{"write_sector", bench_write_sector, SECTOR_LENGTH, true}, // the whole per-sector write: IV, generate_newiv, encrypt, store
+	{"read_4k", bench_read_4k, SECTOR_LENGTH, true},
+	{"write_4k", bench_write_4k, SECTOR_LENGTH, true}, // partial sectors at both ends, so this goes through the dirty sector cache
+	{"read_128k", bench_read_128k, SECTOR_LENGTH, true},
+	{"write_128k", bench_write_128k, SECTOR_LENGTH, true},
+	{"ks_read_4k", bench_ks_read_4k, KS_BLKLEN, true},
+	{"ks_write_4k", bench_ks_write_4k, KS_BLKLEN, true},
+};
+#define NBENCHES	(sizeof(benches)/sizeof(*benches))
+
+static void *bench_thread(void *arg)
+{
+	struct worker *w=arg;
+	pthread_mutex_lock(&start_mx);
+	while(!go)
+		pthread_cond_wait(&start_cond, &start_mx);
+	pthread_mutex_unlock(&start_mx);
+	while(!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+	{
+		ssize_t n=w->b->fn(w);
+		if(n<0)
+		{
+			w->err=n;
+			break;
+		}
+		w->bytes+=n;
+	}
+	return(NULL);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec+ts.tv_nsec*1e-9);
+}
+
+// Runs b on nthreads threads for ms milliseconds and prints its line.  Returns 0 or -errno
+static int run_bench(const struct bench *b, unsigned int nthreads, unsigned int ms, struct worker *workers)
+{
+	int e=0;
+	go=false;
+	__atomic_store_n(&stop, false, __ATOMIC_RELAXED);
+	unsigned int started;
+	for(started=0;started<nthreads;started++)
+	{
+		struct worker *w=workers+started;
+		w->b=b;
+		w->rnd=0x9E3779B97F4A7C15ULL*(started+1);
+		w->index=started*(size_t)SECTOR_KEY_LENGTH/nthreads;
+		w->bytes=0;
+		w->err=0;
+		if((e=pthread_create(&w->thread, NULL, bench_thread, w)))
+		{
+			errno=e;
+			perror("pthread_create");
+			__atomic_store_n(&stop, true, __ATOMIC_RELAXED); // let the ones we did start go straight out again
+			break;
+		}
+	}
+	pthread_mutex_lock(&start_mx);
+	go=true;
+	pthread_cond_broadcast(&start_cond);
+	pthread_mutex_unlock(&start_mx);
+	double t0=now();
+	if(!e)
+		usleep(ms*1000);
+	__atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+	size_t bytes=0;
+	int err=0;
+	for(unsigned int i=0;i<started;i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+		bytes+=workers[i].bytes;
+		if(workers[i].err)
+			err=workers[i].err;
+	}
+	if(b->layer&&!err&&(err=layer_flush(&layer, 0))>0)
+		err=0;
+	double t=now()-t0;
+	if(e)
+		return(-e);
+	if(err)
+	{
+		errno=-err;
+		perror(b->name);
+		return(err);
+	}
+	double sectors=bytes/(double)b->unit;
+	printf("%s\t%u\t%.0f\t%.1f\t%.1f\n", b->name, nthreads, sectors, sectors?t*1e9*nthreads/sectors:0, bytes/t/1e6);
+	fflush(stdout);
+	return(0);
+}
+
+// Builds a "fast" image (as mkonion -f would) in memory: an encrypted header and random bytes everywhere else
+static unsigned char *make_image(size_t sz, unsigned int format, const unsigned char *passphrase)
+{
+	unsigned char *image=malloc(sz);
+	if(!image)
+	{
+		perror("malloc");
+		return(NULL);
+	}
+	unsigned char headersector[SECTOR_LENGTH];
+	int e;
+	if((e=random_bytes(sz, image))||(e=random_bytes(SECTOR_LENGTH, headersector)))
+	{
+		if(e<0) perror("random_bytes");
+		else fprintf(stderr, "random_bytes failed with code %d\n", e);
+		free(image);
+		return(NULL);
+	}
+	write32be(format<<16|BLOCK_LENGTH, headersector);
+	write32be(KEY_LENGTH_HIGH, headersector+0x4);
+	write32be(SECTOR_KEY_LENGTH, headersector+0x8);
+	write32be(SECTOR_KEY_STRIDE, headersector+0xC);
+	memcpy(sectorkey, headersector+0x10, SECTOR_KEY_LENGTH);
+	unsigned char key[KEY_LENGTH_HIGH];
+	memcpy(key, passphrase, KEY_LENGTH_HIGH);
+	if((e=generate_iv(image))||(e=encrypt_sector(KEY_LENGTH_HIGH, key, image, headersector, image+IV_LENGTH)))
+	{
+		if(e<0) perror("make_image");
+		else fprintf(stderr, "make_image failed with code %d\n", e);
+		free(image);
+		return(NULL);
+	}
+	return(image);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t sz=64<<20;
+	long ncpu=sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int maxthreads=ncpu>0?ncpu:1, ms=500;
+	unsigned int format=FORMAT_INTERLEAVED;
+	bool only[NBENCHES], any=false;
+	memset(only, 0, sizeof(only));
+	for(int arg=1;arg<argc;arg++)
+	{
+		if(strncmp(argv[arg], "-Ms", 3)==0)
+		{
+			size_t Msz;
+			if(sscanf(argv[arg]+3, "%zu", &Msz)!=1||!Msz)
+			{
+				fprintf(stderr, "Bad -Ms, `%s' not a positive number\n", argv[arg]+3);
+				return(1);
+			}
+			sz=Msz<<20;
+		}
+		else if(strncmp(argv[arg], "-j", 2)==0)
+		{
+			if(sscanf(argv[arg]+2, "%u", &maxthreads)!=1||!maxthreads||maxthreads>MAX_THREADS)
+			{
+				fprintf(stderr, "Bad -j, `%s' not a number from 1 to %u\n", argv[arg]+2, MAX_THREADS);
+				return(1);
+			}
+		}
+		else if(strncmp(argv[arg], "-t", 2)==0)
+		{
+			if(sscanf(argv[arg]+2, "%u", &ms)!=1||!ms)
+			{
+				fprintf(stderr, "Bad -t, `%s' not a positive number of milliseconds\n", argv[arg]+2);
+				return(1);
+			}
+		}
+		else if(strcmp(argv[arg], "-c")==0)
+			format=FORMAT_CLUSTERED;
+		else
+		{
+			size_t i;
+			for(i=0;i<NBENCHES;i++)
+				if(strcmp(argv[arg], benches[i].name)==0)
+					break;
+			if(i==NBENCHES)
+			{
+				fprintf(stderr, "Unrecognised argument `%s'.  Benches are:", argv[arg]);
+				for(i=0;i<NBENCHES;i++)
+					fprintf(stderr, " %s", benches[i].name);
+				fputc('\n', stderr);
+				return(1);
+			}
+			only[i]=any=true;
+		}
+	}
+	unsigned char passphrase[KEY_LENGTH_HIGH]="onionbench";
+	unsigned char *image=make_image(sz, format, passphrase);
+	if(!image)
+		return(1);
+	struct backing *store=backing_map(image, sz);
+	if(!store)
+	{
+		perror("backing_map");
+		return(1);
+	}
+	int e;
+	if((e=layer_open(&layer, store, passphrase)))
+	{
+		if(e<0) perror("layer_open");
+		else fprintf(stderr, "layer_open failed with code %d\n", e);
+		return(1);
+	}
+	struct worker *workers=calloc(maxthreads, sizeof(*workers));
+	if(!workers)
+	{
+		perror("calloc");
+		return(1);
+	}
+	for(unsigned int i=0;i<maxthreads;i++)
+	{
+		if(!(workers[i].req=malloc(REQUEST_MAX)))
+		{
+			perror("malloc");
+			return(1);
+		}
+		if((e=random_bytes(sizeof(workers[i].key), workers[i].key))||(e=random_bytes(sizeof(workers[i].iv), workers[i].iv))||(e=random_bytes(sizeof(workers[i].in), workers[i].in))||(e=random_bytes(sizeof(workers[i].ivs), workers[i].ivs))||(e=random_bytes(REQUEST_MAX, workers[i].req)))
+		{
+			if(e<0) perror("random_bytes");
+			else fprintf(stderr, "random_bytes failed with code %d\n", e);
+			return(1);
+		}
+	}
+	// Tab-separated, one line per bench per thread count.  ns/sector is the time one thread spends per sector; MB/s is the total across the threads
+	printf("# bench\tthreads\tsectors\tns/sector\tMB/s\n");
+	int rv=0;
+	for(size_t i=0;i<NBENCHES;i++)
+	{
+		if(any&&!only[i])
+			continue;
+		for(unsigned int n=1;;n=n*2>maxthreads?maxthreads:n*2)
+		{
+			if(run_bench(benches+i, n, ms, workers))
+				rv=1;
+			if(n==maxthreads)
+				break;
+		}
+	}
+	for(unsigned int i=0;i<maxthreads;i++)
+		free(workers[i].req);
+	free(workers);
+	layer_close(&layer);
+	store->release(store);
+	free(image);
+	return(rv);
+}
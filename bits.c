@@ -54,6 +54,28 @@ uint32_t read32be(const unsigned char *buf)
 	return(rv);
 }
 
+void write16be(uint16_t val, unsigned char *buf)
+{
+	buf[0]=(val>>8)&0xFF;
+	buf[1]=(val)&0xFF;
+}
+
+uint16_t read16be(const unsigned char *buf)
+{
+	return(((buf[0]&0xFF)<<8)|(buf[1]&0xFF));
+}
+
+void write64be(uint64_t val, unsigned char *buf)
+{
+	write32be(val>>32, buf);
+	write32be(val, buf+4);
+}
+
+uint64_t read64be(const unsigned char *buf)
+{
+	return(((uint64_t)read32be(buf)<<32)|read32be(buf+4));
+}
+
 ssize_t writeall(int fd, const unsigned char *buf, size_t count)
 {
 	size_t i=0;
@@ -77,5 +99,5 @@ ssize_t readall(int fd, unsigned char *buf, size_t count)
 		if(b<=0) return(b);
 		i+=b;
 	}
-	return(b);
+	return(i);
 }
@@ -37,5 +37,9 @@
 
 void write32be(uint32_t val, unsigned char *buf);
 uint32_t read32be(const unsigned char *buf);
+void write16be(uint16_t val, unsigned char *buf);
+uint16_t read16be(const unsigned char *buf);
+void write64be(uint64_t val, unsigned char *buf);
+uint64_t read64be(const unsigned char *buf);
 ssize_t writeall(int fd, const unsigned char *buf, size_t count);
 ssize_t readall(int fd, unsigned char *buf, size_t count);
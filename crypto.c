@@ -34,11 +34,17 @@
 
 #include "crypto.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/random.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include "bits.h"
+#include "aesni.h"
 
 #ifdef INSUFFICIENTLY_PARANOID
 #define STRONG_RAND	"/dev/urandom"
@@ -46,31 +52,147 @@
 #define STRONG_RAND	"/dev/random"
 #endif
 
+// Whether to use AES-NI is decided once, as it determines the form of every sector_key we expand.  Setting DISKONION_NO_AESNI in the environment forces the portable path
+static bool use_aesni;
+static pthread_once_t dispatch_once=PTHREAD_ONCE_INIT;
+
+static void crypto_dispatch(void)
+{
+	use_aesni=aesni_available()&&!getenv("DISKONION_NO_AESNI");
+}
+
+static void ctr_blocks(const sector_key *sk, unsigned char *ctr, unsigned char *out, size_t nblocks)
+{
+	if(use_aesni)
+	{
+		aesni_ctr_blocks(sk, ctr, out, nblocks);
+		return;
+	}
+	for(size_t i=0;i<nblocks;i++)
+	{
+		AES_encrypt(ctr, out+i*AES_BLOCK_SIZE, &sk->sched.akey);
+		for(size_t j=AES_BLOCK_SIZE;j--&&!++ctr[j];); // big-endian increment
+	}
+}
+
+// Per-thread CSPRNG for IVs and nonces: AES-256 in counter mode, seeded from getrandom().
+// After every refill the key is replaced from the fresh output (so a captured state can't recover earlier IVs), and every RNG_RESEED bytes we go back to the kernel for a new seed
+#define RNG_BUFLEN	4096
+#define RNG_SEEDLEN	(KEY_LENGTH_HIGH+AES_BLOCK_SIZE)
+#define RNG_RESEED	(1<<24)
+
+static __thread struct
+{
+	sector_key key;
+	unsigned char ctr[AES_BLOCK_SIZE];
+	unsigned char buf[RNG_BUFLEN];
+	size_t pos; // bytes of buf already used
+	size_t since_seed; // bytes generated under the current seed
+	unsigned int fork_gen; // generation at which we were seeded; a fork() invalidates the state
+	bool seeded;
+}
+rng;
+
+static volatile unsigned int rng_fork_gen=0;
+static pthread_once_t rng_once=PTHREAD_ONCE_INIT;
+
+static void rng_atfork_child(void)
+{
+	rng_fork_gen++; // so the child doesn't hand out the same stream as its parent
+}
+
+static void rng_init(void)
+{
+	pthread_atfork(NULL, NULL, rng_atfork_child);
+}
+
+static int rng_seed(void)
+{
+	unsigned char seed[RNG_SEEDLEN];
+	size_t i=0;
+	while(i<RNG_SEEDLEN)
+	{
+		ssize_t b=getrandom(seed+i, RNG_SEEDLEN-i, 0);
+		if(b<0)
+		{
+			if(errno==EINTR) continue;
+			explicit_bzero(seed, RNG_SEEDLEN);
+			return(-1);
+		}
+		i+=b;
+	}
+	int e=expand_encrypt_key(KEY_LENGTH_HIGH, seed, &rng.key);
+	memcpy(rng.ctr, seed+KEY_LENGTH_HIGH, AES_BLOCK_SIZE);
+	explicit_bzero(seed, RNG_SEEDLEN);
+	if(e) return(e);
+	rng.pos=RNG_BUFLEN;
+	rng.since_seed=0;
+	rng.fork_gen=rng_fork_gen;
+	rng.seeded=true;
+	return(0);
+}
+
+static void rng_refill(void)
+{
+	ctr_blocks(&rng.key, rng.ctr, rng.buf, RNG_BUFLEN/AES_BLOCK_SIZE);
+	expand_encrypt_key(KEY_LENGTH_HIGH, rng.buf, &rng.key);
+	explicit_bzero(rng.buf, KEY_LENGTH_HIGH);
+	rng.pos=KEY_LENGTH_HIGH;
+	rng.since_seed+=RNG_BUFLEN;
+}
+
+int random_bytes(size_t len, unsigned char *buf)
+{
+	if(!buf) return(1);
+	pthread_once(&rng_once, rng_init);
+	if(!rng.seeded||rng.fork_gen!=rng_fork_gen||rng.since_seed>=RNG_RESEED)
+	{
+		int e=rng_seed();
+		if(e) return(e);
+	}
+	if(len>=RNG_BUFLEN) // bulk request: generate straight into buf, then rekey
+	{
+		size_t n=len/AES_BLOCK_SIZE;
+		ctr_blocks(&rng.key, rng.ctr, buf, n);
+		rng.since_seed+=n*AES_BLOCK_SIZE;
+		buf+=n*AES_BLOCK_SIZE;
+		len-=n*AES_BLOCK_SIZE;
+		rng_refill();
+	}
+	while(len)
+	{
+		if(rng.pos>=RNG_BUFLEN)
+			rng_refill();
+		size_t n=RNG_BUFLEN-rng.pos;
+		if(n>len) n=len;
+		memcpy(buf, rng.buf+rng.pos, n);
+		explicit_bzero(rng.buf+rng.pos, n);
+		rng.pos+=n;
+		buf+=n;
+		len-=n;
+	}
+	return(0);
+}
+
 int generate_iv(unsigned char *iv)
 {
 	if(!iv) return(1);
-	int fd=open("/dev/urandom", O_RDONLY);
-	if(fd<0)
-		return(-1);
-	ssize_t b=readall(fd, iv, IV_LENGTH);
-	close(fd);
-	if(b<0) return(-2);
-	if(!b) return(2);
-	return(0);
+	return(random_bytes(IV_LENGTH, iv));
+}
+
+int generate_ivs(size_t n, unsigned char *ivs)
+{
+	if(!ivs) return(1);
+	return(random_bytes(n*IV_LENGTH, ivs));
 }
 
 int generate_newiv(const unsigned char *iv, unsigned char *newiv)
 {
 	if(!iv) return(1);
 	if(!newiv) return(1);
-	int fd=open("/dev/urandom", O_RDONLY);
-	if(fd<0)
-		return(-1);
 	unsigned char hiv[IV_LENGTH/2];
-	ssize_t b=readall(fd, hiv, IV_LENGTH/2);
-	close(fd);
-	if(b<0) return(-2);
-	if(!b) return(2);
+	int e=random_bytes(IV_LENGTH/2, hiv);
+	if(e) return(e);
 	for(size_t i=0;i<IV_LENGTH/2;i++)
 	{
 		newiv[i<<1]=iv[i<<1]^hiv[i];
@@ -108,22 +230,115 @@ int generate_key_data(size_t key_len, unsigned char *key)
 	return(0);
 }
 
-int encrypt_sector(size_t key_len, unsigned char *restrict key, const unsigned char *restrict iv, unsigned char *restrict sector_in, unsigned char *restrict sector_out)
+static int expand_key(size_t key_len, const unsigned char *key, bool decrypt, sector_key *sk)
 {
-	unsigned char siv[IV_LENGTH];
-	memcpy(siv, iv, IV_LENGTH);
-	AES_KEY akey;
-	if(AES_set_encrypt_key(key, key_len<<3, &akey)) return(1);
-	AES_cbc_encrypt(sector_in, sector_out, SECTOR_LENGTH, &akey, siv, AES_ENCRYPT);
+	if(!key) return(1);
+	if(!sk) return(2);
+	if(key_len!=KEY_LENGTH_LOW&&key_len!=KEY_LENGTH_MED&&key_len!=KEY_LENGTH_HIGH) return(3);
+	pthread_once(&dispatch_once, crypto_dispatch);
+	if(use_aesni)
+		return(aesni_expand_key(key_len, key, decrypt, sk->sched.rk, &sk->rounds)?3:0);
+	if(decrypt)
+	{
+		if(AES_set_decrypt_key(key, key_len<<3, &sk->sched.akey)) return(3);
+	}
+	else if(AES_set_encrypt_key(key, key_len<<3, &sk->sched.akey)) return(3);
+	sk->rounds=sk->sched.akey.rounds;
 	return(0);
 }
 
-int decrypt_sector(size_t key_len, unsigned char *restrict key, const unsigned char *restrict iv, unsigned char *restrict sector_in, unsigned char *restrict sector_out)
+int expand_encrypt_key(size_t key_len, const unsigned char *key, sector_key *sk)
+{
+	return(expand_key(key_len, key, false, sk));
+}
+
+int expand_decrypt_key(size_t key_len, const unsigned char *key, sector_key *sk)
+{
+	return(expand_key(key_len, key, true, sk));
+}
+
+int encrypt_sector_sched(const sector_key *sk, const unsigned char *restrict iv, const unsigned char *restrict sector_in, unsigned char *restrict sector_out)
+{
+	struct sector_op op={.key=sk, .iv=iv, .in=sector_in, .out=sector_out};
+	return(encrypt_sectors(1, &op));
+}
+
+int decrypt_sector_sched(const sector_key *sk, const unsigned char *restrict iv, const unsigned char *restrict sector_in, unsigned char *restrict sector_out)
+{
+	struct sector_op op={.key=sk, .iv=iv, .in=sector_in, .out=sector_out};
+	return(decrypt_sectors(1, &op));
+}
+
+int encrypt_sectors(size_t n, const struct sector_op *ops)
+{
+	if(n&&!ops) return(1);
+	if(use_aesni)
+	{
+		for(size_t i=0;i<n;)
+		{
+			// lanes run in lockstep, so they must all have the same number of rounds
+			size_t m=1;
+			while(m<SECTOR_BATCH&&i+m<n&&ops[i+m].key->rounds==ops[i].key->rounds)
+				m++;
+			aesni_encrypt_sectors(m, ops+i);
+			i+=m;
+		}
+		return(0);
+	}
+	for(size_t i=0;i<n;i++)
+	{
+		unsigned char siv[IV_LENGTH];
+		memcpy(siv, ops[i].iv, IV_LENGTH);
+		AES_cbc_encrypt(ops[i].in, ops[i].out, SECTOR_LENGTH, &ops[i].key->sched.akey, siv, AES_ENCRYPT);
+	}
+	return(0);
+}
+
+int decrypt_sectors(size_t n, const struct sector_op *ops)
+{
+	if(n&&!ops) return(1);
+	for(size_t i=0;i<n;i++)
+	{
+		if(use_aesni)
+			aesni_decrypt_sector(ops+i);
+		else
+		{
+			unsigned char siv[IV_LENGTH];
+			memcpy(siv, ops[i].iv, IV_LENGTH);
+			AES_cbc_encrypt(ops[i].in, ops[i].out, SECTOR_LENGTH, &ops[i].key->sched.akey, siv, AES_DECRYPT);
+		}
+	}
+	return(0);
+}
+
+int decrypt_sector_range(const sector_key *sk, const unsigned char *restrict iv, const unsigned char *restrict sector_in, size_t from, size_t len, unsigned char *restrict out)
 {
-	unsigned char siv[IV_LENGTH];
-	memcpy(siv, iv, IV_LENGTH);
-	AES_KEY akey;
-	if(AES_set_decrypt_key(key, key_len<<3, &akey)) return(1);
-	AES_cbc_encrypt(sector_in, sector_out, SECTOR_LENGTH, &akey, siv, AES_DECRYPT);
+	if(!len||from>=SECTOR_LENGTH||len>SECTOR_LENGTH-from) return(1);
+	unsigned char plain[SECTOR_LENGTH];
+	size_t b0=from/AES_BLOCK_SIZE, b1=(from+len-1)/AES_BLOCK_SIZE; // the AES blocks the range touches
+	const unsigned char *prev=b0?sector_in+(b0-1)*AES_BLOCK_SIZE:iv; // and the ciphertext each is chained to
+	if(use_aesni)
+		aesni_decrypt_blocks(sk, prev, sector_in+b0*AES_BLOCK_SIZE, b1+1-b0, plain);
+	else
+	{
+		unsigned char siv[IV_LENGTH];
+		memcpy(siv, prev, IV_LENGTH);
+		AES_cbc_encrypt(sector_in+b0*AES_BLOCK_SIZE, plain, (b1+1-b0)*AES_BLOCK_SIZE, &sk->sched.akey, siv, AES_DECRYPT);
+	}
+	memcpy(out, plain+from%AES_BLOCK_SIZE, len);
 	return(0);
 }
+
+int encrypt_sector(size_t key_len, unsigned char *restrict key, const unsigned char *restrict iv, unsigned char *restrict sector_in, unsigned char *restrict sector_out)
+{
+	sector_key akey;
+	if(expand_encrypt_key(key_len, key, &akey)) return(1);
+	return(encrypt_sector_sched(&akey, iv, sector_in, sector_out));
+}
+
+int decrypt_sector(size_t key_len, unsigned char *restrict key, const unsigned char *restrict iv, unsigned char *restrict sector_in, unsigned char *restrict sector_out)
+{
+	sector_key akey;
+	if(expand_decrypt_key(key_len, key, &akey)) return(1);
+	return(decrypt_sector_sched(&akey, iv, sector_in, sector_out));
+}
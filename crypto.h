@@ -32,6 +32,9 @@
 	crypto.h: crypto functions abstraction layer
 */
 
+#ifndef CRYPTO_H
+#define CRYPTO_H
+
 #include <sys/types.h>
 #include <openssl/aes.h>
 
@@ -44,9 +47,44 @@
 #define KEY_LENGTH_MED	24
 #define KEY_LENGTH_HIGH	32
 
+#define SECTOR_BATCH	8 // how many sectors encrypt_sectors() runs through the AES pipeline together; callers should batch by this
+
+// An expanded key schedule, in whichever form the sector functions will use: AES-NI round keys if the CPU has them, else OpenSSL's AES_KEY
+typedef struct
+{
+	union
+	{
+		AES_KEY akey;
+		unsigned char rk[15][AES_BLOCK_SIZE];
+	}
+	sched;
+	unsigned int rounds;
+}
+__attribute__((aligned(16))) sector_key;
+
+// One sector's worth of work for encrypt_sectors()/decrypt_sectors(); in and out must not overlap
+struct sector_op
+{
+	const sector_key *key;
+	const unsigned char *iv;
+	const unsigned char *in;
+	unsigned char *out;
+};
+
 // For these functions, a return of 0 indicates success, positive indicates failure, and negative indicates failure with errno set
-int generate_iv(unsigned char *iv); // generates a random IV and stores it in iv (whose length should be IV_LENGTH).  Uses /dev/urandom
-int generate_newiv(const unsigned char *iv, unsigned char *newiv); // generates a random new IV with the same keystream as iv and stores it in newiv.  Uses /dev/urandom
+int random_bytes(size_t len, unsigned char *buf); // fills buf with len bytes from the per-thread CSPRNG (seeded from getrandom()).  Not for long-term keys; use generate_key_data for those
+int generate_iv(unsigned char *iv); // generates a random IV and stores it in iv (whose length should be IV_LENGTH).  Uses random_bytes
+int generate_ivs(size_t n, unsigned char *ivs); // generates n random IVs and stores them consecutively in ivs (whose length should be n*IV_LENGTH).  Uses random_bytes
+int generate_newiv(const unsigned char *iv, unsigned char *newiv); // generates a random new IV with the same keystream as iv and stores it in newiv.  Uses random_bytes
 int generate_key_data(size_t key_len, unsigned char *key); // generates random key data of length key_len bytes and stores it in key.  Uses /dev/random
+int expand_encrypt_key(size_t key_len, const unsigned char *key, sector_key *sk); // expands key (of length key_len BYTES) into an encryption key schedule
+int expand_decrypt_key(size_t key_len, const unsigned char *key, sector_key *sk); // expands key (of length key_len BYTES) into a decryption key schedule
+int encrypt_sector_sched(const sector_key *sk, const unsigned char *restrict iv, const unsigned char *restrict sector_in, unsigned char *restrict sector_out); // as encrypt_sector, but with an already-expanded key schedule
+int decrypt_sector_sched(const sector_key *sk, const unsigned char *restrict iv, const unsigned char *restrict sector_in, unsigned char *restrict sector_out); // as decrypt_sector, but with an already-expanded key schedule
+int encrypt_sectors(size_t n, const struct sector_op *ops); // encrypts n sectors, each with its own schedule and IV.  Uses AES-NI if available, interleaving SECTOR_BATCH sectors at a time
+int decrypt_sectors(size_t n, const struct sector_op *ops); // decrypts n sectors, each with its own schedule and IV.  Uses AES-NI if available, decrypting the blocks of each sector in parallel
+int decrypt_sector_range(const sector_key *sk, const unsigned char *restrict iv, const unsigned char *restrict sector_in, size_t from, size_t len, unsigned char *restrict out); // decrypts only bytes from to from+len of a sector (which must lie within it) into out, which need only be len long.  CBC lets each AES block be decrypted on its own given the one before it, so this costs the AES blocks the range touches rather than the whole sector
 int encrypt_sector(size_t key_len, unsigned char *restrict key, const unsigned char *restrict iv, unsigned char *restrict sector_in, unsigned char *restrict sector_out); // encrypts a sector of length SECTOR_LENGTH using the specified key and IV, storing the result in sector_out (which should also be of length SECTOR_LENGTH, ie. the IV is not prepended).  key_len is in BYTES
 int decrypt_sector(size_t key_len, unsigned char *restrict key, const unsigned char *restrict iv, unsigned char *restrict sector_in, unsigned char *restrict sector_out); // decrypts a sector of length SECTOR_LENGTH using the specified key and IV, storing the result in sector_out.  key_len is in BYTES
+
+#endif // CRYPTO_H
@@ -0,0 +1,673 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	journal.c: write-ahead journal for an onion image
+*/
+
+#define _GNU_SOURCE // for pthread_rwlockattr_setkind_np
+
+#include "journal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+#include "bits.h"
+
+#define UNIT_LENGTH		512 // granularity of the staging overlay, in bytes of home
+#define OVERLAY_BUCKETS	4096
+
+// A record is a header (magic, sequence number, run count, payload length), the runs (each an offset, a length and the bytes), and a SHA-256 of all that prefixed with the image's ID, so a journal can't be replayed onto the wrong image
+#define RECORD_MAGIC	"ONIONJNL"
+#define RECORD_HEADER	24
+#define RUN_HEADER		12
+#define ID_LENGTH		32 // bytes from the start of the image; the header block is encrypted, so they're unique to it
+
+struct unit
+{
+	size_t idx; // offset in home / UNIT_LENGTH
+	struct unit *next; // hash chain
+	struct unit *all; // the generation's list of every unit
+	uint64_t valid[UNIT_LENGTH/64]; // which bytes of data have been written
+	unsigned char data[UNIT_LENGTH];
+};
+
+// Everything written since the previous commit started
+struct gen
+{
+	uint64_t seq;
+	struct unit *bucket[OVERLAY_BUCKETS];
+	struct unit *all;
+	size_t units;
+	struct timespec since; // when it was first written to
+};
+
+struct journal
+{
+	struct backing *home;
+	unsigned char id[ID_LENGTH];
+	int fd;
+	size_t jlen; // bytes of records in the journal file
+	pthread_mutex_t lock;
+	pthread_cond_t kick; // wakes the committer
+	pthread_cond_t done; // broadcast whenever a generation is swapped out or committed
+	pthread_rwlock_t commit; // held shared by journal_hold()ers, and exclusively to swap generations
+	pthread_rwlock_t apply; // held shared by readers (and checkpoints), and exclusively while a committed generation is written to home and dropped, or home is resized
+	struct gen *open, *committing;
+	uint64_t durable; // last sequence number safely in the journal
+	uint64_t want; // last sequence number someone is waiting for
+	int err; // commit error, as -errno; cleared once a generation gets all the way to home (unless it was stopping, as something may have been given up)
+	bool started, stopping;
+	pthread_t thread;
+};
+
+static struct gen *gen_new(uint64_t seq)
+{
+	struct gen *g=calloc(1, sizeof(*g));
+	if(g) g->seq=seq;
+	return(g);
+}
+
+static void gen_free(struct gen *g)
+{
+	if(!g) return;
+	while(g->all)
+	{
+		struct unit *u=g->all;
+		g->all=u->all;
+		free(u);
+	}
+	free(g);
+}
+
+static struct unit *gen_find(struct gen *g, size_t idx, bool create)
+{
+	struct unit **p=g->bucket+idx%OVERLAY_BUCKETS;
+	for(struct unit *u=*p;u;u=u->next)
+		if(u->idx==idx)
+			return(u);
+	if(!create) return(NULL);
+	struct unit *u=calloc(1, sizeof(*u));
+	if(!u) return(NULL);
+	u->idx=idx;
+	u->next=*p;
+	*p=u;
+	u->all=g->all;
+	g->all=u;
+	if(!g->units++)
+		clock_gettime(CLOCK_MONOTONIC, &g->since);
+	return(u);
+}
+
+static bool unit_valid(const struct unit *u, size_t i)
+{
+	return((u->valid[i/64]>>(i%64))&1);
+}
+
+static bool unit_full(const struct unit *u)
+{
+	for(size_t i=0;i<UNIT_LENGTH/64;i++)
+		if(~u->valid[i])
+			return(false);
+	return(true);
+}
+
+static int gen_write(struct gen *g, const struct extent *ext)
+{
+	for(size_t done=0;done<ext->len;)
+	{
+		size_t off=ext->off+done, from=off%UNIT_LENGTH, len=ext->len-done;
+		if(len>UNIT_LENGTH-from) len=UNIT_LENGTH-from;
+		struct unit *u=gen_find(g, off/UNIT_LENGTH, true);
+		if(!u) return(-ENOMEM);
+		memcpy(u->data+from, ext->buf+done, len);
+		if(len==UNIT_LENGTH)
+			memset(u->valid, 0xff, sizeof(u->valid));
+		else
+			for(size_t i=from;i<from+len;i++)
+				u->valid[i/64]|=(uint64_t)1<<(i%64);
+		done+=len;
+	}
+	return(0);
+}
+
+static void gen_overlay(struct gen *g, const struct extent *ext)
+{
+	if(!g->units) return;
+	for(size_t done=0;done<ext->len;)
+	{
+		size_t off=ext->off+done, from=off%UNIT_LENGTH, len=ext->len-done;
+		if(len>UNIT_LENGTH-from) len=UNIT_LENGTH-from;
+		const struct unit *u=gen_find(g, off/UNIT_LENGTH, false);
+		if(u&&unit_full(u))
+		{
+			memcpy(ext->buf+done, u->data+from, len);
+			u=NULL;
+		}
+		for(size_t i=from;u&&i<from+len;)
+		{
+			if(!unit_valid(u, i))
+			{
+				i++;
+				continue;
+			}
+			size_t j=i;
+			while(j<from+len&&unit_valid(u, j)) j++;
+			memcpy(ext->buf+done+(i-from), u->data+i, j-i);
+			i=j;
+		}
+		done+=len;
+	}
+}
+
+// The generation's staged bytes as extents of home, in runs; sets *n, and returns NULL with errno set on failure
+static struct extent *gen_runs(const struct gen *g, size_t *n)
+{
+	size_t cap=g->units*2, count=0;
+	struct extent *ext=malloc(cap*sizeof(*ext));
+	if(!ext) return(NULL);
+	for(struct unit *u=g->all;u;u=u->all)
+		for(size_t i=0;i<UNIT_LENGTH;)
+		{
+			if(!unit_valid(u, i))
+			{
+				i++;
+				continue;
+			}
+			size_t j=i;
+			while(j<UNIT_LENGTH&&unit_valid(u, j)) j++;
+			if(count==cap)
+			{
+				struct extent *more=realloc(ext, (cap*=2)*sizeof(*ext));
+				if(!more)
+				{
+					free(ext);
+					return(NULL);
+				}
+				ext=more;
+			}
+			ext[count++]=(struct extent){.off=u->idx*UNIT_LENGTH+i, .len=j-i, .buf=u->data+i};
+			i=j;
+		}
+	*n=count;
+	return(ext);
+}
+
+static int pwriteall(int fd, const unsigned char *buf, size_t len, size_t off)
+{
+	for(size_t done=0;done<len;)
+	{
+		ssize_t rv=pwrite(fd, buf+done, len-done, off+done);
+		if(rv<0)
+		{
+			if(errno==EINTR) continue;
+			return(-errno);
+		}
+		done+=rv;
+	}
+	return(0);
+}
+
+// Appends a record of the runs to the journal and makes it durable
+static int write_record(struct journal *j, uint64_t seq, size_t n, const struct extent *ext)
+{
+	size_t plen=0;
+	for(size_t i=0;i<n;i++)
+		plen+=RUN_HEADER+ext[i].len;
+	size_t rlen=RECORD_HEADER+plen+SHA256_DIGEST_LENGTH;
+	unsigned char *buf=malloc(ID_LENGTH+rlen), *rec=buf+ID_LENGTH, *p=rec+RECORD_HEADER;
+	if(!buf) return(-ENOMEM);
+	memcpy(buf, j->id, ID_LENGTH);
+	memcpy(rec, RECORD_MAGIC, 8);
+	write64be(seq, rec+8);
+	write32be(n, rec+16);
+	write32be(plen, rec+20);
+	for(size_t i=0;i<n;i++)
+	{
+		write64be(ext[i].off, p);
+		write32be(ext[i].len, p+8);
+		memcpy(p+RUN_HEADER, ext[i].buf, ext[i].len);
+		p+=RUN_HEADER+ext[i].len;
+	}
+	SHA256(buf, ID_LENGTH+RECORD_HEADER+plen, p);
+	int e=pwriteall(j->fd, rec, rlen, j->jlen);
+	free(buf);
+	if(e) return(e);
+	if(fdatasync(j->fd)) return(-errno);
+	j->jlen+=rlen;
+	return(0);
+}
+
+// Once home is durable, the records are no longer needed
+static int checkpoint(struct journal *j)
+{
+	int e;
+	if((e=backing_sync(j->home)))
+		return(e);
+	if(ftruncate(j->fd, 0)||fdatasync(j->fd))
+		return(-errno);
+	j->jlen=0;
+	return(0);
+}
+
+static bool commit_due(const struct journal *j)
+{
+	const struct gen *g=j->open;
+	if(!g->units) return(false);
+	if(j->stopping||j->want>=g->seq||g->units*UNIT_LENGTH>=JOURNAL_BATCH) return(true);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return(now.tv_sec-g->since.tv_sec>=JOURNAL_INTERVAL);
+}
+
+static void *committer(void *arg)
+{
+	struct journal *j=arg;
+	pthread_mutex_lock(&j->lock);
+	for(;;)
+	{
+		struct gen *g=j->committing; // left over from a commit that failed, so try it again before anything newer
+		if(!g)
+		{
+			while(!commit_due(j)&&!(j->stopping&&!j->open->units))
+			{
+				if(j->open->units)
+				{
+					struct timespec deadline=j->open->since;
+					deadline.tv_sec+=JOURNAL_INTERVAL;
+					pthread_cond_timedwait(&j->kick, &j->lock, &deadline);
+				}
+				else
+					pthread_cond_wait(&j->kick, &j->lock);
+			}
+			if(!j->open->units) // so we're stopping
+				break;
+			// swap generations, once no held request is part-way through its writes
+			pthread_mutex_unlock(&j->lock);
+			pthread_rwlock_wrlock(&j->commit);
+			pthread_mutex_lock(&j->lock);
+			struct gen *fresh=gen_new(j->open->seq+1);
+			if(!fresh)
+			{
+				pthread_mutex_unlock(&j->lock);
+				pthread_rwlock_unlock(&j->commit);
+				perror("journal: gen_new");
+				sleep(1);
+				pthread_mutex_lock(&j->lock);
+				continue;
+			}
+			g=j->committing=j->open;
+			j->open=fresh;
+			pthread_cond_broadcast(&j->done);
+			pthread_mutex_unlock(&j->lock);
+			pthread_rwlock_unlock(&j->commit);
+		}
+		else
+			pthread_mutex_unlock(&j->lock);
+		// g can't change now, so it needs no lock
+		bool recorded=g->seq<=j->durable; // and only its apply failed last time
+		size_t n;
+		struct extent *ext=gen_runs(g, &n);
+		int e=ext?recorded?0:write_record(j, g->seq, n, ext):-errno;
+		pthread_mutex_lock(&j->lock);
+		if(e)
+		{
+			errno=-e;
+			perror("journal: commit");
+			if(!j->err) j->err=e;
+			pthread_cond_broadcast(&j->done);
+			bool stopping=j->stopping;
+			pthread_mutex_unlock(&j->lock);
+			free(ext);
+			// g isn't in the journal, so it mustn't reach home either, lest a crash tear it; readers go on seeing it staged
+			if(stopping) // and this is the last chance, so it's lost
+			{
+				pthread_rwlock_wrlock(&j->apply);
+				pthread_mutex_lock(&j->lock);
+				j->committing=NULL;
+				pthread_mutex_unlock(&j->lock);
+				pthread_rwlock_unlock(&j->apply);
+				gen_free(g);
+			}
+			else
+				sleep(1);
+			pthread_mutex_lock(&j->lock);
+			continue;
+		}
+		j->durable=g->seq;
+		pthread_cond_broadcast(&j->done);
+		pthread_mutex_unlock(&j->lock);
+		// now it's safe to let home have it; readers are kept out so they can't miss it on both sides
+		pthread_rwlock_wrlock(&j->apply);
+		e=j->home->writev(j->home, n, ext, HINT_RANDOM);
+		free(ext);
+		pthread_mutex_lock(&j->lock);
+		if(e)
+		{
+			errno=-e;
+			perror("journal: applying to image");
+			if(!j->err) j->err=e;
+			pthread_cond_broadcast(&j->done);
+			bool stopping=j->stopping;
+			pthread_mutex_unlock(&j->lock);
+			// g stays staged for readers, and its record stays in the journal, until home has it
+			if(stopping) // j->err stops the journal being emptied, so the next mount replays it
+			{
+				pthread_mutex_lock(&j->lock);
+				j->committing=NULL;
+				pthread_mutex_unlock(&j->lock);
+				pthread_rwlock_unlock(&j->apply);
+				gen_free(g);
+			}
+			else
+			{
+				pthread_rwlock_unlock(&j->apply);
+				sleep(1);
+			}
+			pthread_mutex_lock(&j->lock);
+			continue;
+		}
+		j->committing=NULL;
+		if(!j->stopping) // everything before g is in home too, so whatever went wrong has been put right; but not if something was given up on stopping
+			j->err=0;
+		bool full=!j->err&&j->jlen>=JOURNAL_CHECKPOINT;
+		pthread_cond_broadcast(&j->done);
+		pthread_mutex_unlock(&j->lock);
+		pthread_rwlock_unlock(&j->apply);
+		gen_free(g);
+		if(full)
+		{
+			pthread_rwlock_rdlock(&j->apply); // only so that journal_resize() can't change home under it
+			if((e=checkpoint(j)))
+			{
+				errno=-e;
+				perror("journal: checkpoint (continuing)");
+			}
+			pthread_rwlock_unlock(&j->apply);
+		}
+		pthread_mutex_lock(&j->lock);
+	}
+	pthread_mutex_unlock(&j->lock);
+	return(NULL);
+}
+
+// The committer is started on first use rather than at creation, as onionmount creates its backings before fuse_main() daemonises, and threads don't survive that.  Call with j->lock held
+static int journal_start(struct journal *j)
+{
+	if(j->started) return(0);
+	int e;
+	if((e=pthread_create(&j->thread, NULL, committer, j)))
+		return(-e);
+	j->started=true;
+	return(0);
+}
+
+static int journal_readv(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint)
+{
+	struct journal *j=b->priv;
+	pthread_rwlock_rdlock(&j->apply);
+	int e=j->home->readv(j->home, n, ext, hint);
+	if(!e)
+	{
+		pthread_mutex_lock(&j->lock);
+		for(size_t i=0;i<n;i++)
+		{
+			if(j->committing)
+				gen_overlay(j->committing, ext+i);
+			gen_overlay(j->open, ext+i);
+		}
+		pthread_mutex_unlock(&j->lock);
+	}
+	pthread_rwlock_unlock(&j->apply);
+	return(e);
+}
+
+static int journal_writev(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint)
+{
+	(void)hint; // it's staged in memory; the committer writes it to home later
+	struct journal *j=b->priv;
+	pthread_mutex_lock(&j->lock);
+	int e=journal_start(j);
+	for(size_t i=0;i<n&&!e;i++)
+		e=gen_write(j->open, ext+i);
+	if(j->open->units*UNIT_LENGTH>=JOURNAL_BATCH)
+		pthread_cond_signal(&j->kick);
+	pthread_mutex_unlock(&j->lock);
+	return(e);
+}
+
+// Group commit: however many callers are waiting, each commit takes everything staged so far with one fdatasync()
+static int journal_sync(struct backing *b)
+{
+	struct journal *j=b->priv;
+	pthread_mutex_lock(&j->lock);
+	uint64_t target=j->open->units?j->open->seq:j->open->seq-1;
+	int e=0;
+	if(target>j->durable&&!j->err&&!(e=journal_start(j)))
+	{
+		if(target>j->want) j->want=target;
+		pthread_cond_signal(&j->kick);
+		while(j->durable<target&&!j->err)
+			pthread_cond_wait(&j->done, &j->lock);
+	}
+	if(!e) e=j->err;
+	pthread_mutex_unlock(&j->lock);
+	return(e);
+}
+
+// Holding apply keeps the committer's writes and syncs to home out too
+static int journal_resize(struct backing *b, size_t size)
+{
+	struct journal *j=b->priv;
+	pthread_rwlock_wrlock(&j->apply);
+	int e=backing_resize(j->home, size);
+	if(!e) b->size=size;
+	pthread_rwlock_unlock(&j->apply);
+	return(e);
+}
+
+int journal_hold(struct backing *b)
+{
+	struct journal *j=b->priv;
+	// if too much is staged, wait for a commit to take it, before taking our share of the lock (which would hold the committer up)
+	pthread_mutex_lock(&j->lock);
+	int e=journal_start(j);
+	while(!e&&j->open->units*UNIT_LENGTH>=JOURNAL_DIRTY_MAX)
+	{
+		if(j->err) // commits are failing, so there's no telling when one will take it; better to fail than to stage without bound
+			e=j->err;
+		else
+		{
+			pthread_cond_signal(&j->kick);
+			pthread_cond_wait(&j->done, &j->lock);
+		}
+	}
+	pthread_mutex_unlock(&j->lock);
+	if(!e)
+		pthread_rwlock_rdlock(&j->commit);
+	return(e);
+}
+
+void journal_unhold(struct backing *b)
+{
+	struct journal *j=b->priv;
+	pthread_rwlock_unlock(&j->commit);
+}
+
+int journal_error(struct backing *b)
+{
+	struct journal *j=b->priv;
+	pthread_mutex_lock(&j->lock);
+	int e=j->err;
+	pthread_mutex_unlock(&j->lock);
+	return(e);
+}
+
+static void journal_release(struct backing *b)
+{
+	struct journal *j=b->priv;
+	pthread_mutex_lock(&j->lock);
+	bool started=j->started;
+	j->stopping=true;
+	pthread_cond_signal(&j->kick);
+	pthread_mutex_unlock(&j->lock);
+	if(started)
+		pthread_join(j->thread, NULL); // it commits whatever is left before it stops
+	int e;
+	if(!j->err&&(e=checkpoint(j)))
+	{
+		errno=-e;
+		perror("journal: checkpoint");
+	}
+	gen_free(j->open);
+	pthread_rwlock_destroy(&j->apply);
+	pthread_rwlock_destroy(&j->commit);
+	pthread_cond_destroy(&j->done);
+	pthread_cond_destroy(&j->kick);
+	pthread_mutex_destroy(&j->lock);
+	free(j);
+	free(b);
+}
+
+// Applies the complete records in the journal file, in order, stopping at the first torn or corrupt one (which was never acknowledged)
+static int replay(struct backing *home, const unsigned char *id, int fd)
+{
+	size_t nrec=0;
+	uint64_t last=0;
+	int e=0;
+	if(lseek(fd, 0, SEEK_SET)<0) return(-errno);
+	for(;;)
+	{
+		unsigned char hdr[RECORD_HEADER];
+		if(readall(fd, hdr, RECORD_HEADER)!=RECORD_HEADER||memcmp(hdr, RECORD_MAGIC, 8))
+			break;
+		uint64_t seq=read64be(hdr+8);
+		size_t n=read32be(hdr+16), plen=read32be(hdr+20);
+		if(seq<=last||n>plen/RUN_HEADER)
+			break;
+		unsigned char *buf=malloc(ID_LENGTH+RECORD_HEADER+plen+SHA256_DIGEST_LENGTH), *rec=buf+ID_LENGTH, md[SHA256_DIGEST_LENGTH];
+		struct extent *ext=malloc(n*sizeof(*ext));
+		if(!buf||!ext)
+		{
+			free(buf);
+			free(ext);
+			return(-ENOMEM);
+		}
+		memcpy(buf, id, ID_LENGTH);
+		memcpy(rec, hdr, RECORD_HEADER);
+		bool ok=readall(fd, rec+RECORD_HEADER, plen+SHA256_DIGEST_LENGTH)==(ssize_t)(plen+SHA256_DIGEST_LENGTH);
+		if(ok)
+		{
+			SHA256(buf, ID_LENGTH+RECORD_HEADER+plen, md);
+			ok=!memcmp(md, rec+RECORD_HEADER+plen, SHA256_DIGEST_LENGTH);
+		}
+		unsigned char *p=rec+RECORD_HEADER, *end=p+plen;
+		for(size_t i=0;ok&&i<n;i++)
+		{
+			if(end-p<RUN_HEADER)
+			{
+				ok=false;
+				break;
+			}
+			ext[i]=(struct extent){.off=read64be(p), .len=read32be(p+8), .buf=p+RUN_HEADER};
+			p+=RUN_HEADER;
+			if((size_t)(end-p)<ext[i].len||ext[i].off>home->size||ext[i].len>home->size-ext[i].off)
+				ok=false;
+			p+=ext[i].len;
+		}
+		if(ok)
+			e=home->writev(home, n, ext, HINT_RANDOM);
+		free(buf);
+		free(ext);
+		if(!ok)
+		{
+			if(!nrec)
+				fprintf(stderr, "journal: discarding records that don't match this image\n");
+			break;
+		}
+		if(e) return(e);
+		last=seq;
+		nrec++;
+	}
+	if(nrec)
+	{
+		fprintf(stderr, "journal: replayed %zu records\n", nrec);
+		if((e=backing_sync(home)))
+			return(e);
+	}
+	if(ftruncate(fd, 0)||fdatasync(fd))
+		return(-errno);
+	return(0);
+}
+
+struct backing *backing_journal(struct backing *home, int jfd)
+{
+	struct backing *b=malloc(sizeof(*b));
+	struct journal *j=calloc(1, sizeof(*j));
+	if(!b||!j||!(j->open=gen_new(1)))
+	{
+		free(b);
+		free(j);
+		errno=ENOMEM;
+		return(NULL);
+	}
+	int e=home->size<ID_LENGTH?-EINVAL:home->readv(home, 1, &(struct extent){.off=0, .len=ID_LENGTH, .buf=j->id}, HINT_RANDOM);
+	if(e||(e=replay(home, j->id, jfd)))
+	{
+		gen_free(j->open);
+		free(j);
+		free(b);
+		errno=-e;
+		return(NULL);
+	}
+	j->home=home;
+	j->fd=jfd;
+	pthread_condattr_t ca;
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_rwlockattr_t ra;
+	pthread_rwlockattr_init(&ra);
+	pthread_rwlockattr_setkind_np(&ra, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP); // or a steady stream of writers could starve the committer
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_cond_init(&j->kick, &ca);
+	pthread_cond_init(&j->done, NULL);
+	pthread_rwlock_init(&j->commit, &ra);
+	pthread_rwlock_init(&j->apply, NULL);
+	pthread_condattr_destroy(&ca);
+	pthread_rwlockattr_destroy(&ra);
+	*b=(struct backing){.size=home->size, .readv=journal_readv, .writev=journal_writev, .sync=journal_sync, .resize=journal_resize, .release=journal_release, .priv=j};
+	return(b);
+}
@@ -0,0 +1,53 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	journal.h: write-ahead journal for an onion image
+*/
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "backing.h"
+
+#define JOURNAL_BATCH		(4<<20) // staged bytes that trigger a commit without waiting for the interval
+#define JOURNAL_INTERVAL	1 // seconds a staged write may wait for a commit
+#define JOURNAL_DIRTY_MAX	(64<<20) // staged bytes beyond which new writers wait for a commit
+#define JOURNAL_CHECKPOINT	(64<<20) // journal length beyond which the image is synced and the journal emptied
+
+/* A journalled backing stages writes to home in memory (where reads see them) and commits them in batches: each batch goes to the journal file as one record, checksummed with SHA-256, and is fdatasync()ed before any of it is written to home.  So a crash can lose recent writes, but never tear them.
+	Returns NULL with errno set on failure.  Complete records already in jfd (from a crash) are replayed onto home first.  Doesn't take ownership of home or jfd; release it before home */
+struct backing *backing_journal(struct backing *home, int jfd);
+// Writes made between journal_hold() and journal_unhold() are committed together or not at all.  Holds don't nest.  journal_hold() waits while too much is staged, and returns -errno (without holding) if commits are failing meanwhile
+int journal_hold(struct backing *j);
+void journal_unhold(struct backing *j);
+int journal_error(struct backing *j); // the error (as -errno) that commits are failing with, or 0 once one has got through
+
+#endif // JOURNAL_H
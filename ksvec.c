@@ -0,0 +1,163 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	ksvec.c: SSE2 and AVX2 batch keystream kernels
+*/
+
+#include "crypto.h"
+#include "ksvec.h"
+
+/* An IV's keystream block is the XOR of its even and odd bytes.  Viewed as eight 16-bit lanes, that's the low byte of lane^(lane>>8), so two IVs' worth of lanes pack into one register of keystream.
+	Encoding is the reverse: interleave ks^hiv with hiv.  Any blocks left over after the last whole register are done by the plain C versions */
+
+void ksvec_scalar_decode(size_t n, const unsigned char *ivs, unsigned char *ks)
+{
+	for(size_t i=0;i<n*KS_BLKLEN;i++)
+		ks[i]=ivs[i<<1]^ivs[(i<<1)|1];
+}
+
+void ksvec_scalar_encode(size_t n, const unsigned char *ks, const unsigned char *hiv, unsigned char *ivs)
+{
+	for(size_t i=0;i<n*KS_BLKLEN;i++)
+	{
+		ivs[i<<1]=ks[i]^hiv[i];
+		ivs[(i<<1)|1]=hiv[i];
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#define SSE2	__attribute__((target("sse2")))
+#define AVX2	__attribute__((target("avx2")))
+
+int ksvec_sse2_available(void)
+{
+	__builtin_cpu_init();
+	return(__builtin_cpu_supports("sse2"));
+}
+
+int ksvec_avx2_available(void)
+{
+	__builtin_cpu_init();
+	return(__builtin_cpu_supports("avx2"));
+}
+
+SSE2 void ksvec_sse2_decode(size_t n, const unsigned char *ivs, unsigned char *ks)
+{
+	const __m128i low=_mm_set1_epi16(0xFF);
+	size_t i;
+	for(i=0;i+2<=n;i+=2)
+	{
+		__m128i a=_mm_loadu_si128((const __m128i *)(ivs+i*IV_LENGTH)), b=_mm_loadu_si128((const __m128i *)(ivs+(i+1)*IV_LENGTH));
+		a=_mm_and_si128(_mm_xor_si128(a, _mm_srli_epi16(a, 8)), low);
+		b=_mm_and_si128(_mm_xor_si128(b, _mm_srli_epi16(b, 8)), low);
+		_mm_storeu_si128((__m128i *)(ks+i*KS_BLKLEN), _mm_packus_epi16(a, b));
+	}
+	ksvec_scalar_decode(n-i, ivs+i*IV_LENGTH, ks+i*KS_BLKLEN);
+}
+
+AVX2 void ksvec_avx2_decode(size_t n, const unsigned char *ivs, unsigned char *ks)
+{
+	const __m256i low=_mm256_set1_epi16(0xFF);
+	size_t i;
+	for(i=0;i+4<=n;i+=4)
+	{
+		__m256i a=_mm256_loadu_si256((const __m256i *)(ivs+i*IV_LENGTH)), b=_mm256_loadu_si256((const __m256i *)(ivs+(i+2)*IV_LENGTH));
+		a=_mm256_and_si256(_mm256_xor_si256(a, _mm256_srli_epi16(a, 8)), low);
+		b=_mm256_and_si256(_mm256_xor_si256(b, _mm256_srli_epi16(b, 8)), low);
+		// packus works within 128-bit lanes, giving blocks 0,2,1,3
+		_mm256_storeu_si256((__m256i *)(ks+i*KS_BLKLEN), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8));
+	}
+	ksvec_sse2_decode(n-i, ivs+i*IV_LENGTH, ks+i*KS_BLKLEN);
+}
+
+SSE2 void ksvec_sse2_encode(size_t n, const unsigned char *ks, const unsigned char *hiv, unsigned char *ivs)
+{
+	size_t i;
+	for(i=0;i+2<=n;i+=2)
+	{
+		__m128i h=_mm_loadu_si128((const __m128i *)(hiv+i*KS_BLKLEN));
+		__m128i x=_mm_xor_si128(_mm_loadu_si128((const __m128i *)(ks+i*KS_BLKLEN)), h);
+		_mm_storeu_si128((__m128i *)(ivs+i*IV_LENGTH), _mm_unpacklo_epi8(x, h));
+		_mm_storeu_si128((__m128i *)(ivs+(i+1)*IV_LENGTH), _mm_unpackhi_epi8(x, h));
+	}
+	ksvec_scalar_encode(n-i, ks+i*KS_BLKLEN, hiv+i*KS_BLKLEN, ivs+i*IV_LENGTH);
+}
+
+AVX2 void ksvec_avx2_encode(size_t n, const unsigned char *ks, const unsigned char *hiv, unsigned char *ivs)
+{
+	size_t i;
+	for(i=0;i+4<=n;i+=4)
+	{
+		// unpack works within 128-bit lanes too, so put blocks 0,2 in the low lane and 1,3 in the high one first
+		__m256i h=_mm256_permute4x64_epi64(_mm256_loadu_si256((const __m256i *)(hiv+i*KS_BLKLEN)), 0xD8);
+		__m256i x=_mm256_xor_si256(_mm256_permute4x64_epi64(_mm256_loadu_si256((const __m256i *)(ks+i*KS_BLKLEN)), 0xD8), h);
+		_mm256_storeu_si256((__m256i *)(ivs+i*IV_LENGTH), _mm256_unpacklo_epi8(x, h));
+		_mm256_storeu_si256((__m256i *)(ivs+(i+2)*IV_LENGTH), _mm256_unpackhi_epi8(x, h));
+	}
+	ksvec_sse2_encode(n-i, ks+i*KS_BLKLEN, hiv+i*KS_BLKLEN, ivs+i*IV_LENGTH);
+}
+
+#else // !x86
+
+int ksvec_sse2_available(void)
+{
+	return(0);
+}
+
+int ksvec_avx2_available(void)
+{
+	return(0);
+}
+
+void ksvec_sse2_decode(size_t n, const unsigned char *ivs, unsigned char *ks)
+{
+	ksvec_scalar_decode(n, ivs, ks);
+}
+
+void ksvec_avx2_decode(size_t n, const unsigned char *ivs, unsigned char *ks)
+{
+	ksvec_scalar_decode(n, ivs, ks);
+}
+
+void ksvec_sse2_encode(size_t n, const unsigned char *ks, const unsigned char *hiv, unsigned char *ivs)
+{
+	ksvec_scalar_encode(n, ks, hiv, ivs);
+}
+
+void ksvec_avx2_encode(size_t n, const unsigned char *ks, const unsigned char *hiv, unsigned char *ivs)
+{
+	ksvec_scalar_encode(n, ks, hiv, ivs);
+}
+
+#endif // x86
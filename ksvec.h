@@ -0,0 +1,45 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	ksvec.h: SSE2 and AVX2 batch keystream kernels
+*/
+
+#include <stddef.h>
+
+// These are only ever called through onion.c, which decides at startup which of them this CPU can run.  ivs holds n consecutive IV_LENGTH-byte IVs, ks n consecutive KS_BLKLEN-byte keystream blocks
+void ksvec_scalar_decode(size_t n, const unsigned char *ivs, unsigned char *ks); // plain C, for any CPU
+void ksvec_scalar_encode(size_t n, const unsigned char *ks, const unsigned char *hiv, unsigned char *ivs);
+int ksvec_sse2_available(void);
+int ksvec_avx2_available(void);
+void ksvec_sse2_decode(size_t n, const unsigned char *ivs, unsigned char *ks); // ks[i]=iv[2i]^iv[2i+1]
+void ksvec_avx2_decode(size_t n, const unsigned char *ivs, unsigned char *ks);
+void ksvec_sse2_encode(size_t n, const unsigned char *ks, const unsigned char *hiv, unsigned char *ivs); // iv[2i]=ks[i]^hiv[i], iv[2i+1]=hiv[i], where hiv is n*KS_BLKLEN random bytes
+void ksvec_avx2_encode(size_t n, const unsigned char *ks, const unsigned char *hiv, unsigned char *ivs);
@@ -0,0 +1,1049 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	layer.c: the onion layer block engine
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "layer.h"
+#include "bits.h"
+
+static void stripes_for(size_t first, size_t last, bool *stripes)
+{
+	memset(stripes, 0, LOCK_STRIPES*sizeof(bool));
+	if(last/LOCK_SPAN-first/LOCK_SPAN>=LOCK_STRIPES)
+		memset(stripes, 1, LOCK_STRIPES*sizeof(bool));
+	else
+		for(size_t s=first/LOCK_SPAN;s<=last/LOCK_SPAN;s++)
+			stripes[s%LOCK_STRIPES]=true;
+}
+
+// Takes lk, counting the time in l's stats if it has to wait
+static void timed_lock(struct layer *l, pthread_rwlock_t *lk, bool write)
+{
+	if(!(write?pthread_rwlock_trywrlock(lk):pthread_rwlock_tryrdlock(lk)))
+		return;
+	uint64_t t0=stats_now();
+	if(write)
+		pthread_rwlock_wrlock(lk);
+	else
+		pthread_rwlock_rdlock(lk);
+	stats_add(l->stats, STAT_LOCK_WAITS, 1);
+	stats_add(l->stats, STAT_LOCK_WAIT_NS, stats_now()-t0);
+}
+
+static void lock_blocks(struct layer *l, size_t first, size_t last, bool write)
+{
+	// stripes are always taken in index order, so two requests can't deadlock however their ranges overlap.  Across layers, locks are only ever taken top-down
+	bool stripes[LOCK_STRIPES];
+	stripes_for(first, last, stripes);
+	for(size_t s=0;s<LOCK_STRIPES;s++)
+		if(stripes[s])
+			timed_lock(l, l->blk_locks+s, write);
+}
+
+static void unlock_blocks(struct layer *l, size_t first, size_t last)
+{
+	bool stripes[LOCK_STRIPES];
+	stripes_for(first, last, stripes);
+	for(size_t s=LOCK_STRIPES;s--;)
+		if(stripes[s])
+			pthread_rwlock_unlock(l->blk_locks+s);
+}
+
+// A chunk's blocks in memory, with the IVs kept apart from the sectors so that either format maps onto a few runs of the image
+struct chunk
+{
+	unsigned char iv[CHUNK_BLOCKS][IV_LENGTH];
+	unsigned char sector[CHUNK_BLOCKS][SECTOR_LENGTH];
+};
+
+static void add_extent(struct extent *ext, size_t *n, size_t off, size_t len, unsigned char *buf)
+{
+	if(*n&&ext[*n-1].off+ext[*n-1].len==off&&ext[*n-1].buf+ext[*n-1].len==buf)
+		ext[*n-1].len+=len;
+	else
+		ext[(*n)++]=(struct extent){.off=off, .len=len, .buf=buf};
+}
+
+// Extents for blocks b0 to b1 inclusive (at most CHUNK_BLOCKS of them) of c, which holds the blocks from base on, in image order as far as possible.  Returns how many were needed, at most 2*CHUNK_BLOCKS
+static size_t chunk_extents(const struct layer *l, size_t base, size_t b0, size_t b1, struct chunk *c, bool ivs_only, struct extent *ext)
+{
+	size_t n=0;
+	if(l->format==FORMAT_CLUSTERED||ivs_only)
+	{
+		for(size_t b=b0;b<=b1;b++)
+			add_extent(ext, &n, iv_offset(l->format, b), IV_LENGTH, c->iv[b-base]);
+		if(!ivs_only)
+			for(size_t b=b0;b<=b1;b++)
+				add_extent(ext, &n, sector_offset(l->format, b), SECTOR_LENGTH, c->sector[b-base]);
+	}
+	else
+	{
+		for(size_t b=b0;b<=b1;b++)
+		{
+			add_extent(ext, &n, iv_offset(l->format, b), IV_LENGTH, c->iv[b-base]);
+			add_extent(ext, &n, sector_offset(l->format, b), SECTOR_LENGTH, c->sector[b-base]);
+		}
+	}
+	return(n);
+}
+
+static int write_blocks(struct layer *l, size_t base, size_t b0, size_t b1, struct chunk *c, enum access_hint hint)
+{
+	struct extent ext[2*CHUNK_BLOCKS];
+	size_t n=chunk_extents(l, base, b0, b1, c, false, ext);
+	return(l->store->writev(l->store, n, ext, hint));
+}
+
+// One read or write, clamped to the file and with its blocks locked, which io_run() splits into chunks of at most CHUNK_BLOCKS.  Each chunk is loaded from the store and then handed to fn, which for writes stores it back
+struct io_req
+{
+	struct layer *l;
+	unsigned char *rbuf;
+	const unsigned char *wbuf;
+	size_t pos, size; // byte range within the file
+	size_t first, last; // blocks it touches
+	int (*fn)(const struct io_req *r, size_t b0, size_t b1, struct chunk *c); // handles blocks b0 to b1 inclusive, once they've been loaded into c; returns 0 or -errno
+	bool ivs_only; // fn only needs the IVs loaded
+	enum access_hint hint;
+	int err; // first error from any chunk
+};
+
+static struct dirty_stripe *dirty_for(const struct layer *l, size_t blk)
+{
+	return(l->dirty+(blk/LOCK_SPAN)%LOCK_STRIPES);
+}
+
+static struct dirty_sector *dirty_find(struct dirty_stripe *ds, size_t blk)
+{
+	if(!ds->live) return(NULL);
+	for(size_t i=0;i<DIRTY_SLOTS;i++)
+		if(ds->slot[i].live&&ds->slot[i].blk==blk)
+			return(ds->slot+i);
+	return(NULL);
+}
+
+static void dirty_forget(struct dirty_stripe *ds, struct dirty_sector *d)
+{
+	explicit_bzero(d->data, SECTOR_LENGTH);
+	d->live=false;
+	__atomic_sub_fetch(&ds->live, 1, __ATOMIC_RELEASE); // atomic only for layer_flush()'s unlocked peek
+}
+
+// Encrypts d back to the store, under a new IV with the same keystream, and frees its slot
+static int dirty_flush(struct layer *l, struct dirty_stripe *ds, struct dirty_sector *d)
+{
+	unsigned char block[BLOCK_LENGTH], *iv=block, *sector=block+IV_LENGTH; // contiguous, so an interleaved block is one extent
+	struct extent ext[2];
+	size_t n=0;
+	int e;
+	add_extent(ext, &n, iv_offset(l->format, d->blk), IV_LENGTH, iv);
+	if((e=l->store->readv(l->store, n, ext, HINT_RANDOM)))
+		return(e);
+	if((e=generate_newiv(iv, iv)))
+	{
+		fprintf(stderr, "Error on block %zu:\n", d->blk);
+		if(e<0) perror("generate_newiv");
+		else fprintf(stderr, "generate_newiv failed with code %d\n", e);
+		return(-EIO);
+	}
+	struct sector_op op={.key=key_table_enc(&l->keys, d->blk), .iv=iv, .in=d->data, .out=sector};
+	if((e=encrypt_sectors(1, &op)))
+	{
+		fprintf(stderr, "Error on block %zu:\n", d->blk);
+		if(e<0) perror("encrypt_sectors");
+		else fprintf(stderr, "encrypt_sectors failed with code %d\n", e);
+		return(-EIO);
+	}
+	add_extent(ext, &n, sector_offset(l->format, d->blk), SECTOR_LENGTH, sector);
+	if((e=l->store->writev(l->store, n, ext, HINT_RANDOM)))
+		return(e);
+	dirty_forget(ds, d);
+	stats_add(l->stats, STAT_DIRTY_FLUSHES, 1);
+	stats_add(l->stats, STAT_SECTORS_ENCRYPTED, 1);
+	stats_add(l->stats, STAT_IV_REGENERATIONS, 1);
+	return(0);
+}
+
+// Forgets any dirty sectors among blocks b0 to b1, which are about to be overwritten in full
+static void dirty_drop(struct layer *l, size_t b0, size_t b1)
+{
+	for(size_t s=b0/LOCK_SPAN;s<=b1/LOCK_SPAN;s++)
+	{
+		struct dirty_stripe *ds=l->dirty+s%LOCK_STRIPES;
+		pthread_mutex_lock(&ds->mx);
+		for(size_t i=0;i<DIRTY_SLOTS&&ds->live;i++)
+			if(ds->slot[i].live&&ds->slot[i].blk>=b0&&ds->slot[i].blk<=b1)
+				dirty_forget(ds, ds->slot+i);
+		pthread_mutex_unlock(&ds->mx);
+	}
+}
+
+/* Takes r's partial write to blk into the dirty cache, decrypting the sector from iv and sector (as loaded) if it isn't cached already.  Returns 0 if it did, 1 if there was no slot for it, or -errno.
+	Sectors of r itself are never evicted to make room: another of its chunks may have loaded one before it was flushed, and would then be working on stale ciphertext */
+static int dirty_write(const struct io_req *r, size_t blk, const unsigned char *iv, const unsigned char *sector)
+{
+	struct layer *l=r->l;
+	struct dirty_stripe *ds=dirty_for(l, blk);
+	int e=0;
+	pthread_mutex_lock(&ds->mx);
+	struct dirty_sector *d=dirty_find(ds, blk);
+	if(!d)
+	{
+		struct dirty_sector *victim=NULL;
+		for(size_t i=0;i<DIRTY_SLOTS;i++)
+		{
+			struct dirty_sector *v=ds->slot+i;
+			if(!v->live)
+			{
+				victim=v;
+				break;
+			}
+			if(v->blk>=r->first&&v->blk<=r->last)
+				continue;
+			if(!victim||v->use<victim->use)
+				victim=v;
+		}
+		if(!victim)
+			e=1;
+		else if(!victim->live||!(e=dirty_flush(l, ds, victim)))
+		{
+			struct sector_op op={.key=key_table_dec(&l->keys, blk), .iv=iv, .in=sector, .out=victim->data};
+			if((e=decrypt_sectors(1, &op)))
+			{
+				fprintf(stderr, "Error on block %zu:\n", blk);
+				if(e<0) perror("decrypt_sectors");
+				else fprintf(stderr, "decrypt_sectors failed with code %d\n", e);
+				e=-EIO;
+			}
+			else
+			{
+				stats_add(l->stats, STAT_SECTORS_DECRYPTED, 1);
+				struct timespec now;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				d=victim;
+				d->blk=blk;
+				d->since=now.tv_sec;
+				d->live=true;
+				__atomic_add_fetch(&ds->live, 1, __ATOMIC_RELEASE);
+			}
+		}
+	}
+	if(d)
+	{
+		size_t start=blk*SECTOR_LENGTH;
+		size_t from=start<r->pos?r->pos:start, to=start+SECTOR_LENGTH>r->pos+r->size?r->pos+r->size:start+SECTOR_LENGTH;
+		memcpy(d->data+(from-start), r->wbuf+(from-r->pos), to-from);
+		d->use=++ds->use;
+	}
+	pthread_mutex_unlock(&ds->mx);
+	return(e);
+}
+
+static struct cache_stripe *cache_for(const struct layer *l, size_t blk)
+{
+	return(l->cache+(blk/LOCK_SPAN)%LOCK_STRIPES);
+}
+
+// The blocks of a stripe are numbered densely within it, so consecutive ones land in consecutive buckets
+static uint32_t *cache_bucket(struct cache_stripe *cs, size_t blk)
+{
+	return(cs->bucket+(blk/(LOCK_SPAN*LOCK_STRIPES)*LOCK_SPAN+blk%LOCK_SPAN)%cs->nslots);
+}
+
+// Returns the link pointing at blk's slot (which is CACHE_NONE if it isn't cached).  Under cs->mx
+static uint32_t *cache_link(struct cache_stripe *cs, size_t blk)
+{
+	uint32_t *p=cache_bucket(cs, blk);
+	while(*p!=CACHE_NONE&&cs->slot[*p].blk!=blk)
+		p=&cs->slot[*p].next;
+	return(p);
+}
+
+// Copies len bytes from offset from of blk's sector into out, if it's cached
+static bool cache_get(const struct layer *l, size_t blk, unsigned char *out, size_t from, size_t len)
+{
+	struct cache_stripe *cs=cache_for(l, blk);
+	pthread_mutex_lock(&cs->mx);
+	uint32_t i=*cache_link(cs, blk);
+	if(i!=CACHE_NONE)
+	{
+		memcpy(out, cs->data[i]+from, len);
+		cs->slot[i].ref=true;
+	}
+	pthread_mutex_unlock(&cs->mx);
+	return(i!=CACHE_NONE);
+}
+
+static void cache_unlink(struct cache_stripe *cs, uint32_t i)
+{
+	uint32_t *p=cache_link(cs, cs->slot[i].blk);
+	*p=cs->slot[i].next;
+	cs->slot[i].live=false;
+	explicit_bzero(cs->data[i], SECTOR_LENGTH);
+}
+
+// Caches the decrypted sector of blk, which the caller has locked for reading and which has no dirty sector
+static void cache_put(const struct layer *l, size_t blk, const unsigned char *sector)
+{
+	struct cache_stripe *cs=cache_for(l, blk);
+	pthread_mutex_lock(&cs->mx);
+	uint32_t *p=cache_link(cs, blk);
+	if(*p==CACHE_NONE) // another reader may have beaten us to it
+	{
+		// CLOCK: a slot read since the hand last passed gets another go round.  New ones start without, so a scan only evicts itself
+		uint32_t i;
+		for(;;)
+		{
+			i=cs->hand;
+			cs->hand=(cs->hand+1)%cs->nslots;
+			if(!cs->slot[i].live||!cs->slot[i].ref)
+				break;
+			cs->slot[i].ref=false;
+		}
+		if(cs->slot[i].live)
+		{
+			cache_unlink(cs, i);
+			p=cache_link(cs, blk); // the chain may have changed under it
+		}
+		memcpy(cs->data[i], sector, SECTOR_LENGTH);
+		cs->slot[i]=(struct cache_slot){.blk=blk, .next=CACHE_NONE, .live=true};
+		*p=i;
+	}
+	pthread_mutex_unlock(&cs->mx);
+}
+
+// Forgets any cached copies of blocks b0 to b1, which are being written (under their stripes' write locks)
+static void cache_drop(struct layer *l, size_t b0, size_t b1)
+{
+	if(!l->cache)
+		return;
+	for(size_t s=b0/LOCK_SPAN;s<=b1/LOCK_SPAN;s++)
+	{
+		struct cache_stripe *cs=l->cache+s%LOCK_STRIPES;
+		size_t lo=s*LOCK_SPAN<b0?b0:s*LOCK_SPAN, hi=s*LOCK_SPAN+LOCK_SPAN-1>b1?b1:s*LOCK_SPAN+LOCK_SPAN-1;
+		pthread_mutex_lock(&cs->mx);
+		for(size_t blk=lo;blk<=hi;blk++)
+		{
+			uint32_t i=*cache_link(cs, blk);
+			if(i!=CACHE_NONE)
+				cache_unlink(cs, i);
+		}
+		pthread_mutex_unlock(&cs->mx);
+	}
+}
+
+// Whole sectors are decrypted straight into buf; of a partial one only the AES blocks the read wants are, unless it's going into the clean cache
+static int data_read_range(const struct io_req *r, size_t b0, size_t b1, struct chunk *c)
+{
+	struct layer *l=r->l;
+	unsigned char partial[2][SECTOR_LENGTH]; // the first and last sectors, if only part of them is wanted and they're to be cached
+	struct sector_op ops[SECTOR_BATCH];
+	size_t blks[SECTOR_BATCH]; // of ops
+	bool fill=l->cache&&r->size<=CACHE_FILL_MAX;
+	int e;
+	for(size_t blk=b0;blk<=b1;blk+=SECTOR_BATCH)
+	{
+		size_t n=b1+1-blk, m=0, hits=0, ranges=0;
+		if(n>SECTOR_BATCH) n=SECTOR_BATCH;
+		for(size_t k=0;k<n;k++)
+		{
+			size_t start=(blk+k)*SECTOR_LENGTH;
+			size_t from=start<r->pos?r->pos:start, to=start+SECTOR_LENGTH>r->pos+r->size?r->pos+r->size:start+SECTOR_LENGTH;
+			const struct dirty_sector *d=dirty_find(dirty_for(l, blk+k), blk+k); // newer than what's in the store
+			if(d)
+			{
+				memcpy(r->rbuf+(from-r->pos), d->data+(from-start), to-from);
+				continue;
+			}
+			if(l->cache&&cache_get(l, blk+k, r->rbuf+(from-r->pos), from-start, to-from))
+			{
+				hits++;
+				continue;
+			}
+			bool part=from!=start||to!=start+SECTOR_LENGTH;
+			if(part&&!fill)
+			{
+				if((e=decrypt_sector_range(key_table_dec(&l->keys, blk+k), c->iv[blk+k-b0], c->sector[blk+k-b0], from-start, to-from, r->rbuf+(from-r->pos))))
+				{
+					fprintf(stderr, "Error on block %zu:\n", blk+k);
+					if(e<0) perror("decrypt_sector_range");
+					else fprintf(stderr, "decrypt_sector_range failed with code %d\n", e);
+					return(-EIO);
+				}
+				ranges++;
+				continue;
+			}
+			ops[m].key=key_table_dec(&l->keys, blk+k);
+			ops[m].iv=c->iv[blk+k-b0];
+			ops[m].in=c->sector[blk+k-b0];
+			ops[m].out=part?partial[blk+k!=r->first]:r->rbuf+(start-r->pos); // a whole sector goes straight into buf
+			blks[m++]=blk+k;
+		}
+		if(l->cache)
+		{
+			stats_add(l->stats, STAT_CACHE_HITS, hits);
+			stats_add(l->stats, STAT_CACHE_MISSES, m+ranges);
+		}
+		if(ranges)
+			stats_add(l->stats, STAT_RANGE_DECRYPTS, ranges);
+		if(!m)
+			continue;
+		if((e=decrypt_sectors(m, ops)))
+		{
+			fprintf(stderr, "Error on blocks %zu-%zu:\n", blk, blk+n-1);
+			if(e<0) perror("decrypt_sectors");
+			else fprintf(stderr, "decrypt_sectors failed with code %d\n", e);
+			return(-EIO);
+		}
+		stats_add(l->stats, STAT_SECTORS_DECRYPTED, m);
+		for(size_t k=0;k<m;k++)
+		{
+			if(fill)
+				cache_put(l, blks[k], ops[k].out);
+			if(ops[k].out!=partial[0]&&ops[k].out!=partial[1])
+				continue;
+			size_t start=blks[k]*SECTOR_LENGTH;
+			size_t from=start<r->pos?r->pos:start, to=start+SECTOR_LENGTH>r->pos+r->size?r->pos+r->size:start+SECTOR_LENGTH;
+			memcpy(r->rbuf+(from-r->pos), ops[k].out+(from-start), to-from);
+		}
+	}
+	return(0);
+}
+
+static bool partial_sector(const struct io_req *r, size_t blk)
+{
+	size_t start=blk*SECTOR_LENGTH;
+	return(start<r->pos||start+SECTOR_LENGTH>r->pos+r->size);
+}
+
+// The whole chunk is loaded even for whole-sector writes, as the old IVs are needed to carry the keystream over.  Partial sectors go to the dirty cache if they can
+static int data_write_range(const struct io_req *r, size_t b0, size_t b1, struct chunk *c)
+{
+	struct layer *l=r->l;
+	unsigned char decodedblk[SECTOR_BATCH][SECTOR_LENGTH];
+	struct sector_op ops[SECTOR_BATCH], dops[2]; // only the first and last sectors can be partial writes
+	size_t w0=b0, w1=b1; // the blocks to encrypt and write now
+	int e;
+	cache_drop(l, b0, b1);
+	if(partial_sector(r, b0))
+	{
+		if((e=dirty_write(r, b0, c->iv[0], c->sector[0]))<0)
+			return(e);
+		if(!e)
+		{
+			w0++;
+			stats_add(l->stats, STAT_DIRTY_ABSORBED, 1);
+			stats_add(l->stats, STAT_PARTIAL_WRITES, 1);
+		}
+	}
+	if(b1>b0&&partial_sector(r, b1))
+	{
+		if((e=dirty_write(r, b1, c->iv[b1-b0], c->sector[b1-b0]))<0)
+			return(e);
+		if(!e)
+		{
+			w1--;
+			stats_add(l->stats, STAT_DIRTY_ABSORBED, 1);
+			stats_add(l->stats, STAT_PARTIAL_WRITES, 1);
+		}
+	}
+	if(w0>w1) // all in the cache
+		return(0);
+	dirty_drop(l, w0, w1);
+	for(size_t blk=w0;blk<=w1;blk+=SECTOR_BATCH)
+	{
+		size_t n=w1+1-blk, nd=0;
+		if(n>SECTOR_BATCH) n=SECTOR_BATCH;
+		for(size_t k=0;k<n;k++)
+		{
+			size_t start=(blk+k)*SECTOR_LENGTH;
+			ops[k].key=key_table_enc(&l->keys, blk+k);
+			ops[k].iv=c->iv[blk+k-b0];
+			ops[k].out=c->sector[blk+k-b0];
+			if(partial_sector(r, blk+k)) // and the cache couldn't take it, so we need the old contents
+			{
+				dops[nd++]=(struct sector_op){.key=key_table_dec(&l->keys, blk+k), .iv=c->iv[blk+k-b0], .in=c->sector[blk+k-b0], .out=decodedblk[k]};
+				ops[k].in=decodedblk[k];
+			}
+			else
+				ops[k].in=r->wbuf+(start-r->pos);
+		}
+		if((e=decrypt_sectors(nd, dops)))
+		{
+			fprintf(stderr, "Error on blocks %zu-%zu:\n", blk, blk+n-1);
+			if(e<0) perror("decrypt_sectors");
+			else fprintf(stderr, "decrypt_sectors failed with code %d\n", e);
+			return(-EIO);
+		}
+		for(size_t k=0;k<n;k++)
+		{
+			if(ops[k].in==decodedblk[k])
+			{
+				size_t start=(blk+k)*SECTOR_LENGTH;
+				size_t from=start<r->pos?r->pos:start, to=start+SECTOR_LENGTH>r->pos+r->size?r->pos+r->size:start+SECTOR_LENGTH;
+				memcpy(decodedblk[k]+(from-start), r->wbuf+(from-r->pos), to-from);
+			}
+			if((e=generate_newiv(c->iv[blk+k-b0], c->iv[blk+k-b0])))
+			{
+				fprintf(stderr, "Error on block %zu:\n", blk+k);
+				if(e<0) perror("generate_newiv");
+				else fprintf(stderr, "generate_newiv failed with code %d\n", e);
+				return(-EIO);
+			}
+		}
+		if((e=encrypt_sectors(n, ops)))
+		{
+			fprintf(stderr, "Error on blocks %zu-%zu:\n", blk, blk+n-1);
+			if(e<0) perror("encrypt_sectors");
+			else fprintf(stderr, "encrypt_sectors failed with code %d\n", e);
+			return(-EIO);
+		}
+		stats_add(l->stats, STAT_SECTORS_DECRYPTED, nd);
+		stats_add(l->stats, STAT_PARTIAL_WRITES, nd);
+		stats_add(l->stats, STAT_FULL_WRITES, n-nd);
+		stats_add(l->stats, STAT_SECTORS_ENCRYPTED, n);
+		stats_add(l->stats, STAT_IV_REGENERATIONS, n);
+	}
+	return(write_blocks(l, b0, w0, w1, c, r->hint));
+}
+
+// The blocks lying wholly inside the request are decoded in one go straight into the caller's buffer; only the partial ones at either end go through ks
+static int keystream_read_range(const struct io_req *r, size_t b0, size_t b1, struct chunk *c)
+{
+	unsigned char ks[KS_BLKLEN];
+	size_t f0=(r->pos+KS_BLKLEN-1)/KS_BLKLEN, f1=(r->pos+r->size)/KS_BLKLEN; // whole blocks are [f0,f1)
+	if(f0<b0) f0=b0;
+	if(f1>b1+1) f1=b1+1;
+	int e;
+	if(f0<f1&&(e=decode_keystreams(f1-f0, c->iv[f0-b0], r->rbuf+(f0*KS_BLKLEN-r->pos))))
+	{
+		fprintf(stderr, "Error on blocks %zu-%zu:\n", f0, f1-1);
+		if(e<0) perror("decode_keystreams");
+		else fprintf(stderr, "decode_keystreams failed with code %d\n", e);
+		return(-EIO);
+	}
+	for(size_t blk=b0;blk<=b1;blk++)
+	{
+		if(blk>=f0&&blk<f1)
+			continue;
+		if((e=decode_keystream(c->iv[blk-b0], ks)))
+		{
+			fprintf(stderr, "Error on block %zu:\n", blk);
+			if(e<0) perror("decode_keystream");
+			else fprintf(stderr, "decode_keystream failed with code %d\n", e);
+			return(-EIO);
+		}
+		size_t start=blk*KS_BLKLEN;
+		size_t from=start<r->pos?r->pos:start, to=start+KS_BLKLEN>r->pos+r->size?r->pos+r->size:start+KS_BLKLEN;
+		memcpy(r->rbuf+(from-r->pos), ks+(from-start), to-from);
+	}
+	return(0);
+}
+
+static int keystream_write_range(const struct io_req *r, size_t b0, size_t b1, struct chunk *c)
+{
+	struct layer *l=r->l;
+	unsigned char decodedblk[SECTOR_BATCH][SECTOR_LENGTH];
+	unsigned char keyblk[SECTOR_BATCH*KS_BLKLEN];
+	struct sector_op ops[SECTOR_BATCH], dops[SECTOR_BATCH];
+	int e;
+	for(size_t blk=b0;blk<=b1;blk+=SECTOR_BATCH)
+	{
+		size_t n=b1+1-blk;
+		if(n>SECTOR_BATCH) n=SECTOR_BATCH;
+		for(size_t k=0;k<n;k++)
+		{
+			unsigned char *iv=c->iv[blk+k-b0], *sector=c->sector[blk+k-b0];
+			dops[k]=(struct sector_op){.key=key_table_dec(&l->keys, blk+k), .iv=iv, .in=sector, .out=decodedblk[k]};
+			ops[k]=(struct sector_op){.key=key_table_enc(&l->keys, blk+k), .iv=iv, .in=decodedblk[k], .out=sector};
+		}
+		if((e=decrypt_sectors(n, dops)))
+		{
+			fprintf(stderr, "Error on blocks %zu-%zu:\n", blk, blk+n-1);
+			if(e<0) perror("decrypt_sectors");
+			else fprintf(stderr, "decrypt_sectors failed with code %d\n", e);
+			return(-EIO);
+		}
+		// the old keystream of the batch, with the request's bytes laid over it, becomes its new IVs
+		if((e=decode_keystreams(n, c->iv[blk-b0], keyblk)))
+		{
+			fprintf(stderr, "Error on blocks %zu-%zu:\n", blk, blk+n-1);
+			if(e<0) perror("decode_keystreams");
+			else fprintf(stderr, "decode_keystreams failed with code %d\n", e);
+			return(-EIO);
+		}
+		size_t start=blk*KS_BLKLEN;
+		size_t from=start<r->pos?r->pos:start, to=start+n*KS_BLKLEN>r->pos+r->size?r->pos+r->size:start+n*KS_BLKLEN;
+		memcpy(keyblk+(from-start), r->wbuf+(from-r->pos), to-from);
+		if((e=encode_keystreams(n, keyblk, c->iv[blk-b0])))
+		{
+			fprintf(stderr, "Error on blocks %zu-%zu:\n", blk, blk+n-1);
+			if(e<0) perror("encode_keystreams");
+			else fprintf(stderr, "encode_keystreams failed with code %d\n", e);
+			return(-EIO);
+		}
+		if((e=encrypt_sectors(n, ops)))
+		{
+			fprintf(stderr, "Error on blocks %zu-%zu:\n", blk, blk+n-1);
+			if(e<0) perror("encrypt_sectors");
+			else fprintf(stderr, "encrypt_sectors failed with code %d\n", e);
+			return(-EIO);
+		}
+		stats_add(l->stats, STAT_SECTORS_DECRYPTED, n);
+		stats_add(l->stats, STAT_SECTORS_ENCRYPTED, n);
+		stats_add(l->stats, STAT_IV_REGENERATIONS, n);
+	}
+	return(write_blocks(l, b0, b0, b1, c, r->hint));
+}
+
+static void chunk_range(const struct io_req *r, size_t i, size_t *b0, size_t *b1)
+{
+	*b0=r->first+i*CHUNK_BLOCKS;
+	*b1=*b0+CHUNK_BLOCKS-1;
+	if(*b1>r->last) *b1=r->last;
+}
+
+// Starts loading chunk i into c; *ticket is then for backing_wait()
+static int load_chunk(const struct io_req *r, size_t i, struct chunk *c, int *ticket)
+{
+	struct extent ext[2*CHUNK_BLOCKS];
+	size_t b0, b1;
+	chunk_range(r, i, &b0, &b1);
+	size_t n=chunk_extents(r->l, b0, b0, b1, c, r->ivs_only, ext);
+	return(backing_start_readv(r->l->store, n, ext, r->hint, ticket));
+}
+
+static int work_chunk(const struct io_req *r, size_t i, struct chunk *c)
+{
+	size_t b0, b1;
+	chunk_range(r, i, &b0, &b1);
+	return(r->fn(r, b0, b1, c));
+}
+
+static void io_chunk(void *arg, size_t i)
+{
+	struct io_req *r=arg;
+	struct chunk c;
+	int ticket, e;
+	if(!(e=load_chunk(r, i, &c, &ticket))&&!(e=backing_wait(r->l->store, ticket)))
+		e=work_chunk(r, i, &c);
+	if(e) __sync_bool_compare_and_swap(&r->err, 0, e);
+}
+
+// In this thread, the next chunk is loading while the current one is worked on, so the store's latency hides behind the crypto
+static int io_inline(struct io_req *r, size_t nchunks)
+{
+	struct chunk c[2];
+	int ticket[2], e;
+	if((e=load_chunk(r, 0, c, ticket)))
+		return(e);
+	for(size_t i=0;i<nchunks;i++)
+	{
+		int next=0;
+		if(i+1<nchunks)
+			next=load_chunk(r, i+1, c+(i+1)%2, ticket+(i+1)%2);
+		if(!(e=backing_wait(r->l->store, ticket[i%2])))
+			e=work_chunk(r, i, c+i%2);
+		if(e||next)
+		{
+			if(i+1<nchunks&&!next) // don't leave a load running into a buffer we're about to abandon
+				backing_wait(r->l->store, ticket[(i+1)%2]);
+			return(e?e:next);
+		}
+	}
+	return(0);
+}
+
+static int io_run(struct io_req *r, bool crypto)
+{
+	// small requests (and the cheap keystream reads) stay in this thread, to keep their latency down
+	size_t nb=r->last+1-r->first, nchunks=(nb+CHUNK_BLOCKS-1)/CHUNK_BLOCKS;
+	r->err=0;
+	if(!r->l->workers||!crypto||nb*SECTOR_LENGTH<=r->l->inline_max||nchunks<2)
+		return(io_inline(r, nchunks));
+	// a worker can itself land here for a lower layer; that's fine, as pool_run() has the caller work through its own items
+	pool_run(r->l->workers, nchunks, io_chunk, r);
+	return(r->err);
+}
+
+static ssize_t layer_io(struct layer *l, enum onion_file f, unsigned char *rbuf, const unsigned char *wbuf, size_t size, size_t pos)
+{
+	// keystream scans of an interleaved image touch every page, so they may as well read ahead; a clustered image's IV blocks are only one page in four
+	struct io_req r={.l=l, .rbuf=rbuf, .wbuf=wbuf, .pos=pos, .size=size, .hint=f==ONION_KEYSTREAM&&l->format==FORMAT_INTERLEAVED?HINT_SEQUENTIAL:HINT_RANDOM};
+	uint64_t t0=stats_now();
+	size_t unit;
+	switch(f)
+	{
+		case ONION_DATA:
+			unit=SECTOR_LENGTH;
+			r.fn=wbuf?data_write_range:data_read_range;
+		break;
+		case ONION_KEYSTREAM:
+			unit=KS_BLKLEN;
+			r.fn=wbuf?keystream_write_range:keystream_read_range;
+			r.ivs_only=!wbuf;
+		break;
+		default:
+			return(-EBADF);
+	}
+	timed_lock(l, &l->mx, false);
+	size_t end=l->nblk*unit;
+	if(pos>=end||!size)
+	{
+		pthread_rwlock_unlock(&l->mx);
+		return(0);
+	}
+	if(r.size>end-pos) r.size=end-pos;
+	r.first=pos/unit;
+	r.last=(pos+r.size-1)/unit;
+	lock_blocks(l, r.first, r.last, wbuf);
+	int e=io_run(&r, wbuf||f==ONION_DATA);
+	unlock_blocks(l, r.first, r.last);
+	pthread_rwlock_unlock(&l->mx);
+	stats_time(l->stats, f==ONION_DATA?(wbuf?STAT_DATA_WRITE:STAT_DATA_READ):(wbuf?STAT_KS_WRITE:STAT_KS_READ), t0);
+	return(e?e:(ssize_t)r.size);
+}
+
+ssize_t layer_read(struct layer *l, enum onion_file f, unsigned char *buf, size_t size, size_t pos)
+{
+	return(layer_io(l, f, buf, NULL, size, pos));
+}
+
+ssize_t layer_write(struct layer *l, enum onion_file f, const unsigned char *buf, size_t size, size_t pos)
+{
+	return(layer_io(l, f, NULL, buf, size, pos));
+}
+
+size_t layer_size(const struct layer *l, enum onion_file f)
+{
+	return(l->nblk*(f==ONION_DATA?SECTOR_LENGTH:KS_BLKLEN));
+}
+
+int layer_open(struct layer *l, struct backing *store, const unsigned char *passphrase)
+{
+	if(store->size<BLOCK_LENGTH)
+	{
+		fprintf(stderr, "Bad image: only %zu bytes long\n", store->size);
+		return(1);
+	}
+	l->store=store;
+	l->workers=NULL;
+	l->inline_max=0;
+	l->cache=NULL;
+	unsigned char headerblock[BLOCK_LENGTH], headersector[SECTOR_LENGTH];
+	struct extent ext={.off=0, .len=BLOCK_LENGTH, .buf=headerblock};
+	sector_key pk;
+	int e, rv=1;
+	if((e=store->readv(store, 1, &ext, HINT_RANDOM)))
+	{
+		errno=-e;
+		perror("layer_open: reading header");
+		return(-1);
+	}
+	if((e=expand_decrypt_key(KEY_LENGTH_HIGH, passphrase, &pk)))
+	{
+		if(e<0) perror("expand_decrypt_key");
+		else fprintf(stderr, "expand_decrypt_key failed with code %d\n", e);
+		return(e);
+	}
+	e=decrypt_sector_sched(&pk, headerblock, headerblock+IV_LENGTH, headersector);
+	explicit_bzero(&pk, sizeof(pk));
+	if(e)
+	{
+		if(e<0) perror("decrypt_sector_sched");
+		else fprintf(stderr, "decrypt_sector_sched failed with code %d\n", e);
+		rv=e;
+		goto out;
+	}
+	size_t blocklength=read32be(headersector)&0xFFFF;
+	l->format=read32be(headersector)>>16;
+	if(blocklength!=BLOCK_LENGTH)
+	{
+		fprintf(stderr, "Bad image: blocklength is %zu, expected %zu\n", blocklength, (size_t)BLOCK_LENGTH);
+		goto out;
+	}
+	if(l->format>FORMAT_MAX)
+	{
+		fprintf(stderr, "Bad image: unknown format %u\n", l->format);
+		goto out;
+	}
+	if(!(l->nblk=format_blocks(l->format, store->size)))
+	{
+		fprintf(stderr, "Bad image: no room for any blocks in %zu bytes\n", store->size);
+		goto out;
+	}
+	size_t key_size=read32be(headersector+0x4), key_len=read32be(headersector+0x8), key_stride=read32be(headersector+0xC);
+	if(key_size!=KEY_LENGTH_LOW&&key_size!=KEY_LENGTH_MED&&key_size!=KEY_LENGTH_HIGH)
+	{
+		fprintf(stderr, "Bad image: sector key size is %zu\n", key_size);
+		goto out;
+	}
+	if(!key_len||key_len>SECTOR_LENGTH-0x10)
+	{
+		fprintf(stderr, "Bad image: sector key length is %zu\n", key_len);
+		goto out;
+	}
+	if(pthread_rwlock_init(&l->mx, NULL))
+	{
+		perror("layer_open: pthread_rwlock_init");
+		rv=-1;
+		goto out;
+	}
+	size_t s;
+	for(s=0;s<LOCK_STRIPES;s++)
+		if(pthread_rwlock_init(l->blk_locks+s, NULL))
+			break;
+	if(s<LOCK_STRIPES)
+	{
+		perror("layer_open: pthread_rwlock_init");
+		while(s--)
+			pthread_rwlock_destroy(l->blk_locks+s);
+		pthread_rwlock_destroy(&l->mx);
+		rv=-1;
+		goto out;
+	}
+	if((e=build_key_table(key_len, headersector+0x10, key_size, key_stride, &l->keys)))
+	{
+		if(e<0) perror("build_key_table");
+		else fprintf(stderr, "build_key_table failed with code %d\n", e);
+		for(s=0;s<LOCK_STRIPES;s++)
+			pthread_rwlock_destroy(l->blk_locks+s);
+		pthread_rwlock_destroy(&l->mx);
+		rv=e;
+		goto out;
+	}
+	if(!(l->dirty=calloc(LOCK_STRIPES, sizeof(*l->dirty)))||!(l->stats=stats_new()))
+	{
+		perror("layer_open: calloc");
+		free(l->dirty);
+		free_key_table(&l->keys);
+		for(s=0;s<LOCK_STRIPES;s++)
+			pthread_rwlock_destroy(l->blk_locks+s);
+		pthread_rwlock_destroy(&l->mx);
+		rv=-1;
+		goto out;
+	}
+	for(s=0;s<LOCK_STRIPES;s++)
+		pthread_mutex_init(&l->dirty[s].mx, NULL);
+	rv=0;
+	out:
+	explicit_bzero(headersector, SECTOR_LENGTH);
+	return(rv);
+}
+
+void layer_close(struct layer *l)
+{
+	int e=layer_flush(l, 0);
+	if(e<0)
+	{
+		errno=-e;
+		perror("layer_close: layer_flush");
+	}
+	pthread_rwlock_wrlock(&l->mx);
+	free_key_table(&l->keys);
+	pthread_rwlock_unlock(&l->mx);
+	for(size_t s=0;s<LOCK_STRIPES;s++)
+	{
+		pthread_rwlock_destroy(l->blk_locks+s);
+		pthread_mutex_destroy(&l->dirty[s].mx);
+	}
+	explicit_bzero(l->dirty, LOCK_STRIPES*sizeof(*l->dirty)); // anything the flush failed on
+	layer_cache(l, 0);
+	free(l->dirty);
+	free(l->stats);
+	l->stats=NULL;
+	pthread_rwlock_destroy(&l->mx);
+}
+
+int layer_cache(struct layer *l, size_t bytes)
+{
+	if(l->cache)
+	{
+		for(size_t s=0;s<LOCK_STRIPES;s++)
+			pthread_mutex_destroy(&l->cache[s].mx);
+		explicit_bzero(l->cache_arena, l->cache_len);
+		munlock(l->cache_arena, l->cache_len);
+		munmap(l->cache_arena, l->cache_len);
+		l->cache=NULL;
+	}
+	if(bytes>l->nblk*SECTOR_LENGTH)
+		bytes=l->nblk*SECTOR_LENGTH;
+	size_t nslots=bytes/SECTOR_LENGTH/LOCK_STRIPES;
+	if(!nslots)
+		return(0);
+	if(nslots>CACHE_NONE) nslots=CACHE_NONE;
+	// the stripes, then each stripe's slots, buckets and sectors, all in one arena
+	size_t bucket_len=(nslots*sizeof(uint32_t)+7)&~(size_t)7; // keeping the next stripe's slots aligned
+	size_t per=nslots*(sizeof(struct cache_slot)+SECTOR_LENGTH)+bucket_len;
+	l->cache_len=LOCK_STRIPES*(sizeof(struct cache_stripe)+per);
+	unsigned char *arena=mmap(NULL, l->cache_len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(arena==MAP_FAILED)
+		return(-1);
+	if(madvise(arena, l->cache_len, MADV_DONTDUMP)||mlock(arena, l->cache_len))
+	{
+		int e=errno;
+		munmap(arena, l->cache_len);
+		errno=e;
+		return(-1);
+	}
+	struct cache_stripe *cs=(struct cache_stripe *)arena;
+	unsigned char *p=arena+LOCK_STRIPES*sizeof(struct cache_stripe);
+	for(size_t s=0;s<LOCK_STRIPES;s++)
+	{
+		pthread_mutex_init(&cs[s].mx, NULL);
+		cs[s].nslots=nslots;
+		cs[s].hand=0;
+		cs[s].slot=(struct cache_slot *)p; // mmap()ed memory is zeroed, so they're not live
+		p+=nslots*sizeof(struct cache_slot);
+		cs[s].bucket=(uint32_t *)p;
+		memset(cs[s].bucket, 0xff, nslots*sizeof(uint32_t)); // CACHE_NONE
+		p+=bucket_len;
+		cs[s].data=(unsigned char (*)[SECTOR_LENGTH])p;
+		p+=nslots*SECTOR_LENGTH;
+	}
+	l->cache_arena=arena;
+	l->cache=cs;
+	return(0);
+}
+
+int layer_flush(struct layer *l, unsigned int age)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int rv=0, e, n=0;
+	pthread_rwlock_rdlock(&l->mx);
+	for(size_t s=0;s<LOCK_STRIPES;s++)
+	{
+		struct dirty_stripe *ds=l->dirty+s;
+		if(!__atomic_load_n(&ds->live, __ATOMIC_ACQUIRE)) // don't hold up the stripe's readers for nothing
+			continue;
+		pthread_rwlock_wrlock(l->blk_locks+s);
+		for(size_t i=0;i<DIRTY_SLOTS&&ds->live;i++)
+			if(ds->slot[i].live&&now.tv_sec-ds->slot[i].since>=(time_t)age)
+			{
+				if((e=dirty_flush(l, ds, ds->slot+i))&&!rv)
+					rv=e;
+				n++;
+			}
+		pthread_rwlock_unlock(l->blk_locks+s);
+	}
+	pthread_rwlock_unlock(&l->mx);
+	return(rv?rv:n);
+}
+
+int layer_grow(struct layer *l, size_t size)
+{
+	pthread_rwlock_wrlock(&l->mx); // waits for the I/O in flight, as the store can't resize under it
+	int e=backing_resize(l->store, size);
+	if(!e)
+		l->nblk=format_blocks(l->format, size);
+	pthread_rwlock_unlock(&l->mx);
+	return(e);
+}
+
+// Extents that are contiguous in the lower keystream (as a whole chunk of an interleaved image is) are gathered into one call, through a bounce buffer
+#define BOUNCE_LENGTH	(CHUNK_BLOCKS*BLOCK_LENGTH)
+
+static size_t gather_run(size_t n, const struct extent *ext, size_t i, size_t *len)
+{
+	size_t j=i+1;
+	*len=ext[i].len;
+	while(j<n&&ext[j].off==ext[i].off+*len&&*len+ext[j].len<=BOUNCE_LENGTH)
+		*len+=ext[j++].len;
+	return(j);
+}
+
+static int keystream_readv(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint)
+{
+	(void)hint; // the lower layer hints for its own keystream
+	struct layer *lower=b->priv;
+	unsigned char bounce[BOUNCE_LENGTH];
+	for(size_t i=0,j,len;i<n;i=j)
+	{
+		j=gather_run(n, ext, i, &len);
+		unsigned char *buf=j>i+1?bounce:ext[i].buf;
+		ssize_t got=layer_read(lower, ONION_KEYSTREAM, buf, len, ext[i].off);
+		if(got<0) return(got);
+		if((size_t)got!=len) return(-EIO);
+		if(buf==bounce)
+			for(size_t k=i;k<j;buf+=ext[k++].len)
+				memcpy(ext[k].buf, buf, ext[k].len);
+	}
+	return(0);
+}
+
+static int keystream_writev(struct backing *b, size_t n, const struct extent *ext, enum access_hint hint)
+{
+	(void)hint; // the lower layer hints for its own keystream
+	struct layer *lower=b->priv;
+	unsigned char bounce[BOUNCE_LENGTH];
+	for(size_t i=0,j,len;i<n;i=j)
+	{
+		j=gather_run(n, ext, i, &len);
+		const unsigned char *buf=ext[i].buf;
+		if(j>i+1)
+		{
+			unsigned char *p=bounce;
+			for(size_t k=i;k<j;p+=ext[k++].len)
+				memcpy(p, ext[k].buf, ext[k].len);
+			buf=bounce;
+		}
+		ssize_t put=layer_write(lower, ONION_KEYSTREAM, buf, len, ext[i].off);
+		if(put<0) return(put);
+		if((size_t)put!=len) return(-EIO);
+	}
+	return(0);
+}
+
+static int keystream_sync(struct backing *b)
+{
+	struct layer *lower=b->priv;
+	return(backing_sync(lower->store));
+}
+
+static void keystream_release(struct backing *b)
+{
+	free(b);
+}
+
+struct backing *backing_keystream(struct layer *lower)
+{
+	struct backing *b=malloc(sizeof(*b));
+	if(!b) return(NULL);
+	*b=(struct backing){.size=layer_size(lower, ONION_KEYSTREAM), .readv=keystream_readv, .writev=keystream_writev, .sync=keystream_sync, .release=keystream_release, .priv=lower};
+	return(b);
+}
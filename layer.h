@@ -0,0 +1,128 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	layer.h: the onion layer block engine
+*/
+
+#ifndef LAYER_H
+#define LAYER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+#include "onion.h"
+#include "pool.h"
+#include "backing.h"
+#include "stats.h"
+
+enum onion_file {ONION_DATA, ONION_KEYSTREAM};
+
+// Locking: every I/O holds mx for reading, plus the stripes of blk_locks covering the blocks it touches (for writing if it modifies them).  mx is only taken for writing by layer_close and layer_grow
+#define LOCK_STRIPES	64
+#define LOCK_SPAN		32 // consecutive blocks covered by one stripe
+
+#define CHUNK_BLOCKS	(4*SECTOR_BATCH) // blocks per job when a request is fanned out to the workers
+
+#define DIRTY_SLOTS		8 // partly-written sectors cached per stripe
+#define DIRTY_AGE		1 // seconds a cached sector waits for neighbouring writes before layer_flush() takes it
+
+// A data sector that has been partly written, kept decrypted so that the writes on either side of it (which the kernel's 4k pages split it between) only re-encrypt it once, when it's flushed.  Until then its block's IV and ciphertext in the store are stale
+struct dirty_sector
+{
+	size_t blk;
+	unsigned long use; // for LRU eviction
+	time_t since; // when it was first dirtied, CLOCK_MONOTONIC
+	bool live;
+	unsigned char data[SECTOR_LENGTH];
+};
+
+#define CACHE_FILL_MAX	(64<<10) // reads longer than this are taken for scans, and are served from the clean cache but don't fill it
+
+// The clean cache's slots for the blocks covered by one stripe of blk_locks: decrypted copies of sectors as they are in the store, found by block through chains hanging off bucket, and evicted by CLOCK.  Only ever changed under mx, and a block's slot only while its stripe is held (a writer drops it, a reader adds it), so what's cached is never older than the store
+struct cache_slot
+{
+	size_t blk;
+	uint32_t next; // in its chain; CACHE_NONE ends it
+	bool live, ref;
+};
+#define CACHE_NONE	UINT32_MAX
+
+struct cache_stripe
+{
+	pthread_mutex_t mx;
+	size_t nslots, hand;
+	struct cache_slot *slot; // [nslots]
+	uint32_t *bucket; // [nslots]
+	unsigned char (*data)[SECTOR_LENGTH]; // [nslots]
+};
+
+// The dirty sectors of the blocks covered by one stripe of blk_locks.  They're only changed with that stripe held for writing (and mx too, as one request's chunks can share a stripe), so holding it for reading is enough to look at them
+struct dirty_stripe
+{
+	pthread_mutex_t mx;
+	unsigned int live;
+	unsigned long use;
+	struct dirty_sector slot[DIRTY_SLOTS];
+};
+
+struct layer
+{
+	struct backing *store;
+	unsigned int format; // FORMAT_*, from the header
+	size_t nblk; // number of blocks (excl. header)
+	struct key_table keys; // expanded derived sector keys, built once at unlock
+	pthread_rwlock_t mx;
+	pthread_rwlock_t blk_locks[LOCK_STRIPES]; // block b is covered by blk_locks[(b/LOCK_SPAN)%LOCK_STRIPES]
+	struct dirty_stripe *dirty; // [LOCK_STRIPES], likewise
+	struct cache_stripe *cache; // [LOCK_STRIPES], likewise, at the start of cache_arena; NULL if there's no clean cache
+	unsigned char *cache_arena; // mlock()ed and left out of core dumps, as it holds plaintext
+	size_t cache_len; // of cache_arena
+	struct stats *stats; // counters and latencies of this layer's I/O
+	struct pool *workers; // crypto worker pool, shared between layers; NULL means everything is done in the calling thread
+	size_t inline_max; // requests covering at most this many bytes of sectors aren't fanned out
+};
+
+// For these functions, a return of 0 indicates success, positive indicates failure, and negative indicates failure with errno set
+int layer_open(struct layer *l, struct backing *store, const unsigned char *passphrase); // decrypts and checks the header (passphrase is KEY_LENGTH_HIGH bytes) and expands the sector keys.  A positive return most likely means a wrong passphrase
+void layer_close(struct layer *l); // waits for I/O to finish, flushes the dirty sectors and wipes the keys.  Doesn't release the store
+int layer_cache(struct layer *l, size_t bytes); // replaces l's clean cache with one of about bytes of decrypted sectors (0 for none; no more than the data file).  Not with I/O in flight, nor across a fork(), as mlock()s aren't inherited
+int layer_flush(struct layer *l, unsigned int age); // encrypts the dirty sectors at least age seconds old back to the store (0 for all of them).  Returns how many it took, or -errno
+int layer_grow(struct layer *l, size_t size); // takes in the store having grown to size bytes, once the blocks added are initialised (see onionresize).  Returns 0 or -errno
+size_t layer_size(const struct layer *l, enum onion_file f); // length of the layer's data or keystream file
+// These return the number of bytes transferred (short only at the end of the file), or -errno
+ssize_t layer_read(struct layer *l, enum onion_file f, unsigned char *buf, size_t size, size_t pos);
+ssize_t layer_write(struct layer *l, enum onion_file f, const unsigned char *buf, size_t size, size_t pos);
+
+struct backing *backing_keystream(struct layer *lower); // the keystream of lower, as the image of the layer above it
+
+#endif // LAYER_H
@@ -0,0 +1,459 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	libonion.c: opening, unlocking and doing I/O on an onion image and its stack of layers
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "libonion.h"
+#include "journal.h"
+
+int image_open(struct onion_image *im, const char *path, enum image_io io, const char *journal_path)
+{
+	return(image_open_striped(im, 1, &path, 0, io, journal_path));
+}
+
+// Opens, locks and makes a backing for one member of the image
+static int member_open(struct image_member *mb, const char *path, enum image_io io)
+{
+	mb->map=NULL;
+	mb->b=NULL;
+	if((mb->fd=open(path, O_RDWR))<0)
+	{
+		fprintf(stderr, "image_open: Failed to open '%s'\n", path);
+		perror("\topen");
+		return(-1);
+	}
+	struct stat st;
+	if(fstat(mb->fd, &st))
+	{
+		perror("image_open: fstat");
+		close(mb->fd);
+		return(-1);
+	}
+	mb->size=st.st_size;
+	if(flock(mb->fd, LOCK_EX|LOCK_NB))
+	{
+		if(errno==EWOULDBLOCK)
+			fprintf(stderr, "image_open: '%s' is locked by another process (flock: EWOULDBLOCK)\n", path);
+		else
+			perror("image_open: flock");
+		close(mb->fd);
+		return(-1);
+	}
+	switch(io)
+	{
+		case IO_MMAP:
+			mb->map=mmap(NULL, mb->size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, mb->fd, 0);
+			if(mb->map==MAP_FAILED)
+			{
+				perror("image_open: mmap");
+				mb->map=NULL;
+				break;
+			}
+			mb->b=backing_map(mb->map, mb->size);
+		break;
+		case IO_PREAD:
+			mb->b=backing_pread(mb->fd, mb->size);
+		break;
+		case IO_URING:
+			mb->b=backing_uring(mb->fd, mb->size);
+		break;
+		case IO_WINDOW:
+		default:
+			mb->b=backing_window(mb->fd, mb->size);
+		break;
+	}
+	if(!mb->b)
+	{
+		if(io!=IO_MMAP||mb->map) perror("image_open: backing"); // a failed mmap() has said so already
+		if(mb->map) munmap(mb->map, mb->size);
+		flock(mb->fd, LOCK_UN);
+		close(mb->fd);
+		return(-1);
+	}
+	return(0);
+}
+
+static void member_close(struct image_member *mb)
+{
+	mb->b->release(mb->b);
+	if(mb->map) munmap(mb->map, mb->size);
+	flock(mb->fd, LOCK_UN);
+	close(mb->fd);
+}
+
+int image_open_striped(struct onion_image *im, size_t n, const char *const paths[], size_t chunk, enum image_io io, const char *journal_path)
+{
+	memset(im, 0, sizeof(*im));
+	im->jfd=-1;
+	im->inline_max=IMAGE_INLINE_MAX;
+	im->readahead_max=READAHEAD_MAX;
+	im->cache_max=IMAGE_CACHE_MAX;
+	pthread_mutex_init(&im->flusher_mx, NULL);
+	pthread_cond_init(&im->flusher_cond, NULL);
+	if(!n||n>STRIPE_MAX||(n>1&&(!chunk||chunk%BLOCK_LENGTH)))
+	{
+		fprintf(stderr, "image_open: can't stripe across %zu members in chunks of %zu bytes\n", n, chunk);
+		return(1);
+	}
+	for(;im->nmembers<n;im->nmembers++)
+		if(member_open(im->members+im->nmembers, paths[im->nmembers], io))
+			goto fail;
+	if(n==1)
+		im->base=im->members[0].b;
+	else
+	{
+		struct backing *mbs[STRIPE_MAX];
+		for(size_t m=0;m<n;m++)
+			mbs[m]=im->members[m].b;
+		if(!(im->base=backing_stripe(n, mbs, chunk)))
+		{
+			perror("image_open: backing_stripe");
+			goto fail;
+		}
+		im->stripe_chunk=chunk;
+	}
+	im->size=im->base->size;
+	im->stores[0]=im->base;
+	if(journal_path)
+	{
+		if((im->jfd=open(journal_path, O_RDWR|O_CREAT, 0600))<0)
+			perror("image_open: open journal");
+		else if(!(im->journal=backing_journal(im->base, im->jfd)))
+			perror("image_open: backing_journal");
+		if(!im->journal)
+			goto fail;
+		im->stores[0]=im->journal;
+	}
+	return(0);
+	fail:
+	if(im->jfd>=0) close(im->jfd);
+	if(im->base&&n>1) im->base->release(im->base);
+	while(im->nmembers--)
+		member_close(im->members+im->nmembers);
+	im->nmembers=0;
+	return(-1);
+}
+
+int image_unlock(struct onion_image *im, const unsigned char *passphrase)
+{
+	size_t li=im->nlayers;
+	if(li>=IMAGE_MAX_LAYERS)
+	{
+		errno=E2BIG;
+		return(-1);
+	}
+	if(li&&!(im->stores[li]=backing_keystream(im->layers+li-1)))
+		return(-1);
+	int e=layer_open(im->layers+li, im->stores[li], passphrase);
+	if(e)
+	{
+		if(li) im->stores[li]->release(im->stores[li]);
+		return(e);
+	}
+	im->layers[li].inline_max=im->inline_max;
+	im->layers[li].workers=im->workers;
+	im->nlayers++;
+	return(0);
+}
+
+int image_get_passphrase(FILE *fp, const char *prompt, unsigned char *passphrase)
+{
+	fprintf(stderr, "%s (at most %u bytes will be used)\n", prompt, KEY_LENGTH_HIGH);
+	memset(passphrase, 0, KEY_LENGTH_HIGH+1); // make sure it's initialised to all 0s
+	if(!fgets((char *)passphrase, KEY_LENGTH_HIGH+1, fp))
+	{
+		if(!ferror(fp)) errno=ENODATA;
+		return(-1);
+	}
+	return(0);
+}
+
+/* After a write to layer li, or (with self false) after layer li's dirty sectors are flushed into the layers below it, tells the streams of the layers that changed.
+	With up, the write was to li's keystream, which the layers above are stored in, so they changed too */
+static void image_changed(struct onion_image *im, size_t li, bool self, bool up)
+{
+	for(size_t i=0;i<(up?im->nlayers:li+self);i++)
+		__atomic_add_fetch(im->gen+i, 1, __ATOMIC_RELEASE);
+}
+
+// As in image_io(), a flushed sector and its new IV must land in the same commit; above layer 1 they are several writes to the layer below
+static int flush_layer(struct onion_image *im, size_t li, unsigned int age)
+{
+	int e;
+	if(im->journal&&(e=journal_hold(im->journal)))
+		return(e);
+	e=layer_flush(im->layers+li, age);
+	if(im->journal) journal_unhold(im->journal);
+	return(e);
+}
+
+static void *flush_loop(void *arg)
+{
+	struct onion_image *im=arg;
+	pthread_mutex_lock(&im->flusher_mx);
+	while(!im->flusher_stop)
+	{
+		struct timespec next={.tv_sec=time(NULL)+DIRTY_AGE};
+		pthread_cond_timedwait(&im->flusher_cond, &im->flusher_mx, &next);
+		pthread_mutex_unlock(&im->flusher_mx);
+		for(size_t i=im->nlayers;i--;)
+		{
+			int e=flush_layer(im, i, DIRTY_AGE);
+			if(e>0)
+				image_changed(im, i, false, false);
+			else if(e)
+			{
+				errno=-e;
+				perror("flush_loop: flush_layer");
+			}
+		}
+		pthread_mutex_lock(&im->flusher_mx);
+	}
+	pthread_mutex_unlock(&im->flusher_mx);
+	return(NULL);
+}
+
+int image_start(struct onion_image *im, unsigned int nworkers)
+{
+	if(nworkers&&!(im->workers=pool_create(nworkers)))
+		perror("image_start: pool_create (continuing without workers)");
+	for(size_t i=0;i<im->nlayers;i++)
+	{
+		im->layers[i].workers=im->workers;
+		if(layer_cache(im->layers+i, im->cache_max))
+		{
+			fprintf(stderr, "image_start: no clean cache for layer %zu (is ulimit -l big enough?)\n", i+1);
+			perror("\tlayer_cache");
+		}
+	}
+	im->flusher_stop=false;
+	int e=pthread_create(&im->flusher, NULL, flush_loop, im);
+	if(e)
+	{
+		errno=e;
+		perror("image_start: pthread_create (continuing without the flusher; dirty sectors will wait for a sync or eviction)");
+		return(-1);
+	}
+	im->flusher_running=true;
+	if(im->readahead_max&&!(im->readahead=readahead_create(READAHEAD_THREADS)))
+		perror("image_start: readahead_create (continuing without readahead)");
+	return(0);
+}
+
+void image_stop(struct onion_image *im)
+{
+	if(im->readahead) // its fills may be using the workers
+	{
+		readahead_destroy(im->readahead);
+		im->readahead=NULL;
+	}
+	if(im->flusher_running)
+	{
+		pthread_mutex_lock(&im->flusher_mx);
+		im->flusher_stop=true;
+		pthread_cond_signal(&im->flusher_cond);
+		pthread_mutex_unlock(&im->flusher_mx);
+		pthread_join(im->flusher, NULL);
+		im->flusher_running=false;
+	}
+	for(size_t i=0;i<im->nlayers;i++)
+	{
+		im->layers[i].workers=NULL;
+		layer_cache(im->layers+i, 0);
+	}
+	if(im->workers)
+	{
+		pool_destroy(im->workers);
+		im->workers=NULL;
+	}
+}
+
+// Every layer is ultimately stored in the image, so syncing that covers them all, once their dirty sectors are in it
+int image_sync(struct onion_image *im)
+{
+	int e;
+	for(size_t i=im->nlayers;i--;) // top-down, as an upper layer's flush writes to the one below
+	{
+		if((e=flush_layer(im, i, 0))<0)
+			return(e);
+		if(e)
+			image_changed(im, i, false, false);
+	}
+	return(backing_sync(im->stores[0]));
+}
+
+int image_error(struct onion_image *im)
+{
+	return(im->journal?journal_error(im->journal):0);
+}
+
+// Only layer 1 grows: each layer above has its size fixed in the keystream it was created in
+int image_grow(struct onion_image *im)
+{
+	struct image_member *mb=im->members;
+	if(im->nmembers>1) // onionresize only grows single files
+		return(-EOPNOTSUPP);
+	struct stat st;
+	if(fstat(mb->fd, &st))
+		return(-errno);
+	size_t size=st.st_size;
+	if(size<=im->size) // nothing new; shrinking would take the blocks away from under the layers
+		return(0);
+	int e=im->nlayers?layer_grow(im->layers, size):backing_resize(im->stores[0], size);
+	if(e)
+		return(e);
+	if(mb->map) // mremap()ed, so it may have moved
+		mb->map=mb->b->priv;
+	im->size=mb->size=size;
+	return(0);
+}
+
+void image_close(struct onion_image *im)
+{
+	image_stop(im);
+	while(im->nlayers--) // top-down, so no layer is closed while one above it can still reach it
+	{
+		layer_close(im->layers+im->nlayers);
+		if(im->nlayers) im->stores[im->nlayers]->release(im->stores[im->nlayers]);
+	}
+	im->nlayers=0;
+	if(im->journal)
+	{
+		im->journal->release(im->journal); // commits anything still staged
+		close(im->jfd);
+	}
+	if(im->nmembers>1)
+		im->base->release(im->base);
+	while(im->nmembers--)
+		member_close(im->members+im->nmembers);
+	im->nmembers=0;
+	pthread_mutex_destroy(&im->flusher_mx);
+	pthread_cond_destroy(&im->flusher_cond);
+}
+
+size_t image_file_size(const struct onion_image *im, size_t li, enum onion_file f)
+{
+	return(layer_size(im->layers+li, f));
+}
+
+bool image_file_writable(const struct onion_image *im, size_t li, enum onion_file f)
+{
+	return(li<im->nlayers&&!(f==ONION_KEYSTREAM&&li+1<im->nlayers));
+}
+
+static void image_trace(struct onion_image *im, size_t li, enum onion_file f, size_t pos, size_t size, bool write)
+{
+	trace_record(im->trace, li+1, (write?TRACE_WRITE:0)|(f==ONION_KEYSTREAM?TRACE_KEYSTREAM:0), pos, size>UINT32_MAX?UINT32_MAX:size);
+}
+
+static ssize_t image_io(struct onion_image *im, size_t li, enum onion_file f, const struct iovec *iov, int iovcnt, size_t pos, bool write)
+{
+	if(li>=im->nlayers||iovcnt<0)
+		return(-EINVAL);
+	if(write&&!image_file_writable(im, li, f))
+		return(-EPERM);
+	if(im->trace)
+	{
+		size_t size=0;
+		for(int i=0;i<iovcnt;i++)
+			size+=iov[i].iov_len;
+		image_trace(im, li, f, pos, size, write);
+	}
+	ssize_t done=0, rv=0;
+	if(write&&im->journal&&(rv=journal_hold(im->journal))) // a write's sectors and their new IVs must land in the same commit
+		return(rv);
+	for(int i=0;i<iovcnt;i++)
+	{
+		if(!iov[i].iov_len) continue;
+		if(write)
+			rv=layer_write(im->layers+li, f, iov[i].iov_base, iov[i].iov_len, pos+done);
+		else
+			rv=layer_read(im->layers+li, f, iov[i].iov_base, iov[i].iov_len, pos+done);
+		if(rv<0)
+			break;
+		done+=rv;
+		if((size_t)rv<iov[i].iov_len) // end of the file
+			break;
+	}
+	if(write&&im->journal) journal_unhold(im->journal);
+	if(write) // only now, so that a stream can't fill with what was there before under a generation it thinks is current
+		image_changed(im, li, true, f==ONION_KEYSTREAM);
+	return(rv<0&&!done?rv:done);
+}
+
+ssize_t image_readv(struct onion_image *im, size_t li, enum onion_file f, const struct iovec *iov, int iovcnt, size_t pos)
+{
+	return(image_io(im, li, f, iov, iovcnt, pos, false));
+}
+
+ssize_t image_writev(struct onion_image *im, size_t li, enum onion_file f, const struct iovec *iov, int iovcnt, size_t pos)
+{
+	return(image_io(im, li, f, iov, iovcnt, pos, true));
+}
+
+ssize_t image_read(struct onion_image *im, size_t li, enum onion_file f, void *buf, size_t size, size_t pos)
+{
+	struct iovec iov={.iov_base=buf, .iov_len=size};
+	return(image_readv(im, li, f, &iov, 1, pos));
+}
+
+ssize_t image_write(struct onion_image *im, size_t li, enum onion_file f, const void *buf, size_t size, size_t pos)
+{
+	struct iovec iov={.iov_base=(void *)buf, .iov_len=size};
+	return(image_writev(im, li, f, &iov, 1, pos));
+}
+
+struct ra_stream *image_stream_open(struct onion_image *im, size_t li, enum onion_file f)
+{
+	if(li>=im->nlayers)
+	{
+		errno=EINVAL;
+		return(NULL);
+	}
+	return(ra_stream_open(im->layers+li, f, im->gen+li, im->readahead_max));
+}
+
+ssize_t image_stream_read(struct onion_image *im, struct ra_stream *s, void *buf, size_t size, size_t pos)
+{
+	if(im->trace)
+		image_trace(im, s->l-im->layers, s->f, pos, size, false);
+	return(ra_stream_read(s, im->readahead, buf, size, pos));
+}
@@ -0,0 +1,113 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	libonion.h: opening, unlocking and doing I/O on an onion image and its stack of layers
+*/
+
+#ifndef LIBONION_H
+#define LIBONION_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "layer.h"
+#include "trace.h"
+#include "readahead.h"
+
+#define IMAGE_MAX_LAYERS	16
+#define IMAGE_INLINE_MAX	16384 // default inline_max for the layers; see layer.h
+#define IMAGE_CACHE_MAX		(4<<20) // default cache_max
+
+// How the image file is read and written; see the readme's --io
+enum image_io {IO_WINDOW, IO_MMAP, IO_PREAD, IO_URING};
+
+// One of the files an image is kept in: the image file itself, or one member of a stripe set
+struct image_member
+{
+	int fd;
+	size_t size; // of the file, in bytes
+	unsigned char *map; // with IO_MMAP
+	struct backing *b;
+};
+
+/* An image file (or stripe set of them), locked, and the layers unlocked on it so far: layers[0] is the image itself, and each layer above is backed by the keystream of the one below.
+	The fields are for reading; change them only through these functions */
+struct onion_image
+{
+	int jfd;
+	struct image_member members[STRIPE_MAX];
+	size_t nmembers; // 1 unless the image is striped
+	size_t stripe_chunk; // when striped; see backing_stripe()
+	size_t size; // of the image, in bytes
+	struct backing *base; // the image's own backing: the file's, or the stripe across the members
+	struct backing *journal; // if journalling, it sits between base and layers[0]
+	struct backing *stores[IMAGE_MAX_LAYERS];
+	struct layer layers[IMAGE_MAX_LAYERS];
+	size_t nlayers; // unlocked so far
+	size_t inline_max; // given to each layer as it's unlocked; IMAGE_INLINE_MAX unless changed before image_unlock()
+	size_t cache_max; // bytes of clean cache each layer gets from image_start(); IMAGE_CACHE_MAX unless changed before then
+	struct pool *workers; // shared by all the layers, once image_start() has run
+	struct trace *trace; // if not NULL, every image_readv(), image_writev() and image_stream_read() is recorded to it
+	size_t readahead_max; // ceiling for the streams' readahead windows, READAHEAD_MAX unless changed before image_stream_open(); 0 turns it off
+	struct readahead *readahead; // fills the streams' buffers, once image_start() has run
+	uint64_t gen[IMAGE_MAX_LAYERS]; // bumped after each write to the layer, one above it (which is stored in it) or the keystream of one below it (which it is stored in), and after an upper layer's dirty sectors are flushed into it, for the streams
+	pthread_t flusher;
+	bool flusher_running, flusher_stop;
+	pthread_mutex_t flusher_mx;
+	pthread_cond_t flusher_cond;
+};
+
+// For these functions, a return of 0 indicates success, positive indicates failure, and negative indicates failure with errno set
+int image_open(struct onion_image *im, const char *path, enum image_io io, const char *journal_path); // opens path and takes an exclusive flock() on it; if journal_path isn't NULL, writes go through a journal there (see journal.h)
+int image_open_striped(struct onion_image *im, size_t n, const char *const paths[], size_t chunk, enum image_io io, const char *journal_path); // as image_open(), for an image striped across n files in chunks of chunk bytes (a whole number of blocks), paths[0] holding the header.  They must be given in the order they were created in
+int image_unlock(struct onion_image *im, const unsigned char *passphrase); // unlocks the next layer up with passphrase (KEY_LENGTH_HIGH bytes).  A positive return most likely means a wrong passphrase
+int image_get_passphrase(FILE *fp, const char *prompt, unsigned char *passphrase); // prints prompt on stderr and reads a line of at most KEY_LENGTH_HIGH bytes from fp into passphrase (which must have room for KEY_LENGTH_HIGH+1), zero-padding it
+int image_start(struct onion_image *im, unsigned int nworkers); // starts nworkers crypto workers (0 for none), a thread that flushes dirty sectors once they're DIRTY_AGE old, and the readahead threads, and gives the layers their clean caches.  Not across a fork()
+void image_stop(struct onion_image *im); // stops what image_start() started, and frees the caches
+int image_sync(struct onion_image *im); // writes back every layer's dirty sectors and makes the image durable.  Returns 0 or -errno
+int image_error(struct onion_image *im); // the error the journal's commits are failing with, if journalling, as -errno; else 0.  Cheap, unlike image_sync()
+int image_grow(struct onion_image *im); // takes in the image file having grown (as onionresize does it), giving layer 1 the new blocks.  Returns 0 (also if it hasn't grown) or -errno
+void image_close(struct onion_image *im); // closes the layers top-down, stopping the threads if need be, and releases the image
+
+size_t image_file_size(const struct onion_image *im, size_t li, enum onion_file f); // length of layer li's data or keystream file
+bool image_file_writable(const struct onion_image *im, size_t li, enum onion_file f); // false for the keystream file of a layer with another unlocked above it: that layer is stored in it, and writing it would change its data behind the back of its caches (and garble it).  image_write() refuses those with -EPERM
+// Scatter-gather I/O on byte ranges of layer li's file f, starting at pos.  These return the number of bytes transferred (short only at the end of the file), or -errno.  Each write is journalled as a whole
+ssize_t image_readv(struct onion_image *im, size_t li, enum onion_file f, const struct iovec *iov, int iovcnt, size_t pos);
+ssize_t image_writev(struct onion_image *im, size_t li, enum onion_file f, const struct iovec *iov, int iovcnt, size_t pos);
+ssize_t image_read(struct onion_image *im, size_t li, enum onion_file f, void *buf, size_t size, size_t pos);
+ssize_t image_write(struct onion_image *im, size_t li, enum onion_file f, const void *buf, size_t size, size_t pos);
+// A stream (see readahead.h) is for one reader of layer li's file f: once its reads look sequential, the next ones are decrypted ahead of it.  Close it with ra_stream_close()
+struct ra_stream *image_stream_open(struct onion_image *im, size_t li, enum onion_file f); // NULL with errno set on failure
+ssize_t image_stream_read(struct onion_image *im, struct ra_stream *s, void *buf, size_t size, size_t pos); // as image_read()
+
+#endif // LIBONION_H
@@ -32,8 +32,15 @@
 	mkonion.c: create an empty onion volume (possibly onto an existing "keystream file")
 */
 
+#define _GNU_SOURCE // for fallocate() and O_DIRECT
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -41,14 +48,224 @@
 #include "crypto.h"
 #include "onion.h"
 #include "bits.h"
+#include "backing.h"
 
 #define SECTOR_KEY_LENGTH	(SECTOR_LENGTH-0x10) // should be 480
 #define SECTOR_KEY_STRIDE	13 // coprime to 480
 
+#define CHUNK_BLOCKS	2048 // blocks (including the header) per pipeline buffer, ie. 1MB
+#define BUF_ALIGN		4096 // alignment of pipeline buffers and write offsets, for O_DIRECT
+#define CKPT_CHUNKS		256 // sync and record a checkpoint every this many chunks
+
+// The block pipeline: producer threads fill chunk c into slot c%nslots, and the writer (the main thread) writes the chunks out in order
+enum slot_state {SLOT_FREE, SLOT_BUSY, SLOT_READY};
+
+struct pipeline
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // broadcast whenever a slot changes state
+	size_t nunits; // image length in blocks, including the header
+	size_t nchunks, next_chunk; // chunk count, and the next chunk to be claimed by a producer
+	size_t written; // chunks written so far
+	size_t nslots;
+	unsigned char **buf;
+	enum slot_state *state;
+	bool failed; // if set, everyone gives up
+	bool fast; // fill the blocks from the CSPRNG instead of encrypting blank sectors
+	unsigned int format; // FORMAT_*
+	size_t nblk; // number of blocks (excl. header), according to the format
+	const struct key_table *keys;
+	const unsigned char *header; // the encrypted header block
+};
+
+static const unsigned char blanksector[SECTOR_LENGTH];
+
+// Fills image bytes lo to hi of a clustered image.  Chunks are a whole number of clusters, so only the image's last cluster can be cut short
+static int fill_clusters(const struct pipeline *p, size_t lo, size_t hi, unsigned char *buf)
+{
+	size_t base=lo;
+	int e=0;
+	if(!lo)
+	{
+		// the header, then random padding up to the first cluster
+		memcpy(buf, p->header, BLOCK_LENGTH);
+		lo=hi<CLUSTER_LENGTH?hi:CLUSTER_LENGTH;
+		if((e=random_bytes(lo-BLOCK_LENGTH, buf+BLOCK_LENGTH)))
+		{
+			if(e<0) perror("random_bytes");
+			else fprintf(stderr, "random_bytes failed with code %d\n", e);
+			return(1);
+		}
+	}
+	struct sector_op ops[SECTOR_BATCH];
+	for(size_t off=lo;off<hi;off+=CLUSTER_LENGTH)
+	{
+		unsigned char *cluster=buf+(off-base);
+		size_t b0=(off/CLUSTER_LENGTH-1)*CLUSTER_BLOCKS, n=0;
+		if(p->nblk>b0)
+			n=p->nblk-b0<CLUSTER_BLOCKS?p->nblk-b0:CLUSTER_BLOCKS;
+		size_t end=off+CLUSTER_LENGTH<hi?off+CLUSTER_LENGTH:hi;
+		if((e=generate_ivs(n, cluster)))
+		{
+			fprintf(stderr, "Error on blocks %zu-%zu:\n", b0, b0+n-1);
+			if(e<0) perror("generate_ivs");
+			else fprintf(stderr, "generate_ivs failed with code %d\n", e);
+			return(1);
+		}
+		for(size_t k=0;k<n;k+=SECTOR_BATCH)
+		{
+			size_t m=n-k;
+			if(m>SECTOR_BATCH) m=SECTOR_BATCH;
+			for(size_t j=0;j<m;j++)
+				ops[j]=(struct sector_op){.key=key_table_enc(p->keys, b0+k+j), .iv=cluster+(k+j)*IV_LENGTH, .in=blanksector, .out=cluster+BLOCK_LENGTH+(k+j)*SECTOR_LENGTH};
+			if((e=encrypt_sectors(m, ops)))
+			{
+				fprintf(stderr, "Error on blocks %zu-%zu:\n", b0+k, b0+k+m-1);
+				if(e<0) perror("encrypt_sectors");
+				else fprintf(stderr, "encrypt_sectors failed with code %d\n", e);
+				return(1);
+			}
+		}
+		// in a short last cluster, the unused IV slots and whatever follows the last sector are random too
+		size_t ivend=off+BLOCK_LENGTH<end?off+BLOCK_LENGTH:end, secend=off+BLOCK_LENGTH+n*SECTOR_LENGTH;
+		if(off+n*IV_LENGTH<ivend&&(e=random_bytes(ivend-(off+n*IV_LENGTH), cluster+n*IV_LENGTH)))
+			break;
+		if(secend<end&&(e=random_bytes(end-secend, cluster+(secend-off))))
+			break;
+	}
+	if(e)
+	{
+		if(e<0) perror("random_bytes");
+		else fprintf(stderr, "random_bytes failed with code %d\n", e);
+		return(1);
+	}
+	return(0);
+}
+
+static int fill_chunk(const struct pipeline *p, size_t chunk, unsigned char *buf)
+{
+	size_t u0=chunk*CHUNK_BLOCKS, u1=u0+CHUNK_BLOCKS;
+	if(u1>p->nunits) u1=p->nunits;
+	if(p->format==FORMAT_CLUSTERED&&!p->fast)
+		return(fill_clusters(p, u0*BLOCK_LENGTH, u1*BLOCK_LENGTH, buf));
+	if(!u0)
+	{
+		memcpy(buf, p->header, BLOCK_LENGTH);
+		buf+=BLOCK_LENGTH;
+		u0++;
+	}
+	if(p->fast)
+	{
+		// An encrypted blank sector under a random IV is indistinguishable from random bytes to anyone without the key, so we may as well skip the encryption
+		int e;
+		if((e=random_bytes((u1-u0)*BLOCK_LENGTH, buf)))
+		{
+			fprintf(stderr, "Error on blocks %zu-%zu:\n", u0-1, u1-2);
+			if(e<0) perror("random_bytes");
+			else fprintf(stderr, "random_bytes failed with code %d\n", e);
+			return(1);
+		}
+		return(0);
+	}
+	struct sector_op ops[SECTOR_BATCH];
+	for(size_t u=u0;u<u1;u+=SECTOR_BATCH)
+	{
+		size_t n=u1-u;
+		if(n>SECTOR_BATCH) n=SECTOR_BATCH;
+		int e;
+		for(size_t k=0;k<n;k++)
+		{
+			unsigned char *block=buf+(u-u0+k)*BLOCK_LENGTH;
+			if((e=generate_iv(block)))
+			{
+				fprintf(stderr, "Error on block %zu:\n", u+k-1);
+				if(e<0) perror("generate_iv");
+				else fprintf(stderr, "generate_iv failed with code %d\n", e);
+				return(1);
+			}
+			ops[k]=(struct sector_op){.key=key_table_enc(p->keys, u+k-1), .iv=block, .in=blanksector, .out=block+IV_LENGTH};
+		}
+		if((e=encrypt_sectors(n, ops)))
+		{
+			fprintf(stderr, "Error on blocks %zu-%zu:\n", u-1, u+n-2);
+			if(e<0) perror("encrypt_sectors");
+			else fprintf(stderr, "encrypt_sectors failed with code %d\n", e);
+			return(1);
+		}
+	}
+	return(0);
+}
+
+static void *producer(void *arg)
+{
+	struct pipeline *p=arg;
+	pthread_mutex_lock(&p->lock);
+	while(!p->failed&&p->next_chunk<p->nchunks)
+	{
+		size_t c=p->next_chunk++, s=c%p->nslots;
+		// the slot is ours once the writer has finished with chunk c-nslots
+		while(!p->failed&&(c>=p->written+p->nslots||p->state[s]!=SLOT_FREE))
+			pthread_cond_wait(&p->cond, &p->lock);
+		if(p->failed) break;
+		p->state[s]=SLOT_BUSY;
+		pthread_mutex_unlock(&p->lock);
+		int e=fill_chunk(p, c, p->buf[s]);
+		pthread_mutex_lock(&p->lock);
+		if(e)
+			p->failed=true;
+		else
+			p->state[s]=SLOT_READY;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return(NULL);
+}
+
+// Writes image bytes off to off+len from buf; in a stripe set, chunk c of the image goes to (c/nout)*chunk in member c%nout, as backing_stripe() has it.  Returns the bytes written, or -1 with errno set
+static ssize_t write_image(const int *outfds, size_t nout, size_t chunk, const unsigned char *buf, size_t len, size_t off)
+{
+	for(size_t done=0;done<len;)
+	{
+		size_t o=off+done, c=o/chunk, within=o%chunk, n=len-done;
+		if(n>chunk-within) n=chunk-within;
+		ssize_t rv=pwrite(outfds[c%nout], buf+done, n, (c/nout)*chunk+within);
+		if(rv<0)
+		{
+			if(errno==EINTR) continue;
+			return(-1);
+		}
+		if(!rv) return(done);
+		done+=rv;
+	}
+	return(len);
+}
+
+static int write_checkpoint(const char *ckfile, size_t units, size_t sz)
+{
+	char tmp[strlen(ckfile)+5];
+	sprintf(tmp, "%s.tmp", ckfile);
+	FILE *fp=fopen(tmp, "w");
+	if(!fp) return(-1);
+	fprintf(fp, "%zu %zu\n", units, sz);
+	if(fflush(fp)||fdatasync(fileno(fp)))
+	{
+		fclose(fp);
+		return(-1);
+	}
+	if(fclose(fp)) return(-1);
+	return(rename(tmp, ckfile)?-1:0);
+}
+
 int main(int argc, char *argv[])
 {
 	size_t sz=0;
-	const char *outfile=NULL;
+	const char *outfiles[STRIPE_MAX];
+	size_t nout=0, chunk=STRIPE_CHUNK;
+	long ncpu=sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int nthreads=ncpu>0?ncpu:1;
+	bool prealloc=false, direct=false, fast=false;
+	const char *ckfile=NULL;
+	unsigned int format=FORMAT_INTERLEAVED;
 	for(int arg=1;arg<argc;arg++)
 	{
 		if(strncmp(argv[arg], "-s", 2)==0)
@@ -92,41 +309,118 @@ int main(int argc, char *argv[])
 		else if(strcmp(argv[arg], "+s")==0)
 			sz=0;
 		else if(strncmp(argv[arg], "-o", 2)==0)
-			outfile=argv[arg]+2;
+		{
+			if(nout>=STRIPE_MAX)
+			{
+				fprintf(stderr, "Too many -o, at most %d files in a stripe set\n", STRIPE_MAX);
+				return(1);
+			}
+			outfiles[nout++]=argv[arg]+2;
+		}
+		else if(strncmp(argv[arg], "-S", 2)==0)
+		{
+			if(sscanf(argv[arg]+2, "%zu", &chunk)!=1||!chunk||chunk%BUF_ALIGN)
+			{
+				fprintf(stderr, "Bad -S, `%s' not a multiple of %d\n", argv[arg]+2, BUF_ALIGN);
+				return(1);
+			}
+		}
+		else if(strncmp(argv[arg], "-j", 2)==0)
+		{
+			if(sscanf(argv[arg]+2, "%u", &nthreads)!=1||!nthreads)
+			{
+				fprintf(stderr, "Bad -j, `%s' not a positive number\n", argv[arg]+2);
+				return(1);
+			}
+		}
+		else if(strcmp(argv[arg], "-F")==0)
+			prealloc=true;
+		else if(strcmp(argv[arg], "-D")==0)
+			direct=true;
+		else if(strcmp(argv[arg], "-f")==0)
+			fast=true;
+		else if(strcmp(argv[arg], "-c")==0)
+			format=FORMAT_CLUSTERED;
+		else if(strncmp(argv[arg], "-C", 2)==0&&argv[arg][2])
+			ckfile=argv[arg]+2;
 	}
-	if(!outfile)
+	if(!nout)
 	{
 		fprintf(stderr, "Must supply -o<outfile>\n");
 		return(1);
 	}
-	struct stat st_buf;
-	if(stat(outfile, &st_buf))
+	if(nout==1) // it's all one chunk
+		chunk=SIZE_MAX;
+	/* With -C<ckfile>, an interrupted run leaves ckfile recording how many blocks are safely on disk and the image size.  It's opt-in, and goes where the user says, because in plain text next to the image it would say what the image is.
+		Without it there's no resuming, but nothing is left lying about */
+	size_t done=0, cksz=0;
+	FILE *ckfp=ckfile?fopen(ckfile, "r"):NULL;
+	if(ckfp)
 	{
-		if(!sz)
+		if(fscanf(ckfp, "%zu %zu", &done, &cksz)!=2)
 		{
-			perror("Failed to stat outfile: stat");
+			fprintf(stderr, "Bad checkpoint file `%s'; delete it to start again\n", ckfile);
+			fclose(ckfp);
 			return(1);
 		}
-	}
-	else if(sz)
-	{
-		if(sz!=(size_t)st_buf.st_size)
+		fclose(ckfp);
+		if(sz&&sz!=cksz)
 		{
-			fprintf(stderr, "Size mismatch; volume is %zu bytes\n", (size_t)st_buf.st_size);
+			fprintf(stderr, "Size mismatch; interrupted creation was of %zu bytes\n", cksz);
 			return(1);
 		}
+		sz=cksz;
 	}
-	else
-		sz=st_buf.st_size;
-	int outfd=open(outfile, O_WRONLY | O_CREAT, S_IRUSR|S_IWUSR);
-	if(outfd<0)
+	// Each member of a stripe set holds sz/nout bytes, a whole number of chunks
+	struct stat st_buf;
+	bool missing=false;
+	size_t have=SIZE_MAX; // the shortest existing member
+	for(size_t i=0;i<nout;i++)
 	{
-		perror("Failed to open outfile: open");
-		return(1);
+		if(stat(outfiles[i], &st_buf))
+		{
+			if(!sz)
+			{
+				fprintf(stderr, "Failed to stat outfile '%s'\n", outfiles[i]);
+				perror("\tstat");
+				return(1);
+			}
+			missing=true;
+		}
+		else if((size_t)st_buf.st_size<have)
+			have=st_buf.st_size;
 	}
-	fprintf(stderr, "Image size is %zu bytes\n", sz);
-	size_t nblk=sz/BLOCK_LENGTH-1;
-	fprintf(stderr, "Image has %zu blocks\n", nblk);
+	if(missing)
+		done=0;
+	else if(!sz)
+		sz=have*nout;
+	if(nout>1)
+		sz=nout*(sz/nout/chunk*chunk);
+	size_t msz=sz/nout;
+	for(size_t i=0;i<nout;i++)
+		if(!stat(outfiles[i], &st_buf)&&msz!=(size_t)st_buf.st_size&&!(cksz&&(size_t)st_buf.st_size<msz))
+		{
+			fprintf(stderr, "Size mismatch; volume '%s' is %zu bytes\n", outfiles[i], (size_t)st_buf.st_size);
+			return(1);
+		}
+	int outfds[nout];
+	for(size_t i=0;i<nout;i++)
+		if((outfds[i]=open(outfiles[i], O_RDWR | O_CREAT, S_IRUSR|S_IWUSR))<0)
+		{
+			fprintf(stderr, "Failed to open outfile '%s'\n", outfiles[i]);
+			perror("\topen");
+			return(1);
+		}
+	if(nout>1)
+		fprintf(stderr, "Image size is %zu bytes, striped across %zu files in chunks of %zu bytes\n", sz, nout, chunk);
+	else
+		fprintf(stderr, "Image size is %zu bytes\n", sz);
+	for(size_t i=0;i<nout;i++)
+		if(prealloc&&fallocate(outfds[i], 0, 0, msz))
+		{
+			perror("fallocate (continuing without)");
+			break;
+		}
 	fprintf(stderr, "Enter your layer master passphrase (at most %u bytes will be used)\n", KEY_LENGTH_HIGH);
 	unsigned char passphrase[KEY_LENGTH_HIGH+1];
 	memset(passphrase, 0, KEY_LENGTH_HIGH); // make sure it's initialised to all 0s
@@ -135,85 +429,187 @@ int main(int argc, char *argv[])
 		perror("Failed to read passphrase: fgets");
 		return(1);
 	}
-	unsigned char sectorkey[SECTOR_KEY_LENGTH];
-	fprintf(stderr, "Generating sector key, you may need to supply some entropy to the system\n");
-	int e=generate_key_data(SECTOR_KEY_LENGTH, sectorkey);
-	if(e)
-	{
-		if(e<0) perror("generate_key_data");
-		else fprintf(stderr, "generate_key_data failed with code %d\n", e);
-		return(1);
-	}
-	fprintf(stderr, "Preparing header sector\n");
+	int e;
 	unsigned char headersector[SECTOR_LENGTH];
-	write32be(BLOCK_LENGTH, headersector);
-	write32be(KEY_LENGTH_HIGH, headersector+0x4);
-	write32be(SECTOR_KEY_LENGTH, headersector+0x8);
-	write32be(SECTOR_KEY_STRIDE, headersector+0xC);
-	memcpy(headersector+0x10, sectorkey, SECTOR_KEY_LENGTH);
-	fprintf(stderr, "Writing header sector\n");
-	unsigned char iv[IV_LENGTH];
-	if((e=generate_iv(iv)))
-	{
-		if(e<0) perror("generate_iv");
-		else fprintf(stderr, "generate_iv failed with code %d\n", e);
-		return(1);
-	}
 	unsigned char block[BLOCK_LENGTH];
-	memcpy(block, iv, IV_LENGTH);
-	if((e=encrypt_sector(KEY_LENGTH_HIGH, passphrase, iv, headersector, block+IV_LENGTH)))
+	unsigned char *sectorkey=headersector+0x10;
+	if(done)
 	{
-		if(e<0) perror("encrypt_sector");
-		else fprintf(stderr, "encrypt_sector failed with code %d\n", e);
-		return(1);
-	}
-	if((e=writeall(outfd, block, BLOCK_LENGTH))!=BLOCK_LENGTH)
-	{
-		if(e<0) perror("writeall");
-		else fprintf(stderr, "writeall failed, returned %d\n", e);
-		return(1);
+		fprintf(stderr, "Resuming interrupted creation after %zu blocks\n", done);
+		if(pread(outfds[0], block, BLOCK_LENGTH, 0)!=BLOCK_LENGTH)
+		{
+			perror("Failed to read header block: pread");
+			return(1);
+		}
+		if((e=decrypt_sector(KEY_LENGTH_HIGH, passphrase, block, block+IV_LENGTH, headersector)))
+		{
+			if(e<0) perror("decrypt_sector");
+			else fprintf(stderr, "decrypt_sector failed with code %d\n", e);
+			return(1);
+		}
+		format=read32be(headersector)>>16;
+		if((read32be(headersector)&0xFFFF)!=BLOCK_LENGTH||format>FORMAT_MAX||read32be(headersector+0x4)!=KEY_LENGTH_HIGH||read32be(headersector+0x8)!=SECTOR_KEY_LENGTH||read32be(headersector+0xC)!=SECTOR_KEY_STRIDE)
+		{
+			fprintf(stderr, "Header doesn't match; wrong passphrase?\n");
+			return(1);
+		}
 	}
-	fprintf(stderr, "Writing sector blocks\n");
-	unsigned char blanksector[SECTOR_LENGTH];
-	memset(blanksector, 0, SECTOR_LENGTH);
-	unsigned char derivedkey[KEY_LENGTH_HIGH];
-	for(size_t blk=0;blk<nblk;blk++)
+	else
 	{
-		if((blk&1023)==1023)
+		fprintf(stderr, "Generating sector key, you may need to supply some entropy to the system\n");
+		if((e=generate_key_data(SECTOR_KEY_LENGTH, sectorkey)))
 		{
-			fputc('.', stderr);
-			fflush(stderr);
+			if(e<0) perror("generate_key_data");
+			else fprintf(stderr, "generate_key_data failed with code %d\n", e);
+			return(1);
 		}
+		fprintf(stderr, "Preparing header sector\n");
+		write32be(format<<16|BLOCK_LENGTH, headersector);
+		write32be(KEY_LENGTH_HIGH, headersector+0x4);
+		write32be(SECTOR_KEY_LENGTH, headersector+0x8);
+		write32be(SECTOR_KEY_STRIDE, headersector+0xC);
+		unsigned char iv[IV_LENGTH];
 		if((e=generate_iv(iv)))
 		{
-			fprintf(stderr, "Error on block %zu:\n", blk);
 			if(e<0) perror("generate_iv");
 			else fprintf(stderr, "generate_iv failed with code %d\n", e);
 			return(1);
 		}
 		memcpy(block, iv, IV_LENGTH);
-		if((e=derive_key(SECTOR_KEY_LENGTH, sectorkey, KEY_LENGTH_HIGH, derivedkey, SECTOR_KEY_STRIDE, blk)))
+		if((e=encrypt_sector(KEY_LENGTH_HIGH, passphrase, iv, headersector, block+IV_LENGTH)))
 		{
-			fprintf(stderr, "Error on block %zu:\n", blk);
-			if(e<0) perror("derive_key");
-			else fprintf(stderr, "derive_key failed with code %d\n", e);
+			if(e<0) perror("encrypt_sector");
+			else fprintf(stderr, "encrypt_sector failed with code %d\n", e);
 			return(1);
 		}
-		if((e=encrypt_sector(KEY_LENGTH_HIGH, derivedkey, iv, blanksector, block+IV_LENGTH)))
+	}
+	explicit_bzero(passphrase, sizeof(passphrase));
+	struct key_table keys;
+	if((e=build_key_table(SECTOR_KEY_LENGTH, sectorkey, KEY_LENGTH_HIGH, SECTOR_KEY_STRIDE, &keys)))
+	{
+		if(e<0) perror("build_key_table");
+		else fprintf(stderr, "build_key_table failed with code %d\n", e);
+		return(1);
+	}
+	explicit_bzero(headersector, SECTOR_LENGTH);
+	size_t nblk=format_blocks(format, sz);
+	if(!nblk)
+	{
+		fprintf(stderr, "Image too small to hold any blocks\n");
+		return(1);
+	}
+	fprintf(stderr, "Image has %zu blocks%s\n", nblk, format==FORMAT_CLUSTERED?", in clusters":"");
+	struct pipeline p={.nunits=sz/BLOCK_LENGTH, .keys=&keys, .header=block, .failed=false, .fast=fast, .format=format, .nblk=nblk};
+	p.nchunks=(p.nunits+CHUNK_BLOCKS-1)/CHUNK_BLOCKS;
+	p.next_chunk=p.written=done/CHUNK_BLOCKS;
+	p.nslots=nthreads*2;
+	p.buf=calloc(p.nslots, sizeof(unsigned char *));
+	p.state=calloc(p.nslots, sizeof(enum slot_state));
+	if(!p.buf||!p.state)
+	{
+		perror("calloc");
+		return(1);
+	}
+	for(size_t s=0;s<p.nslots;s++)
+		if((e=posix_memalign((void **)&p.buf[s], BUF_ALIGN, CHUNK_BLOCKS*BLOCK_LENGTH)))
 		{
-			fprintf(stderr, "Error on block %zu:\n", blk);
-			if(e<0) perror("encrypt_sector");
-			else fprintf(stderr, "encrypt_sector failed with code %d\n", e);
+			errno=e;
+			perror("posix_memalign");
 			return(1);
 		}
-		if((e=writeall(outfd, block, BLOCK_LENGTH))!=BLOCK_LENGTH)
+	for(size_t i=0;direct&&i<nout;i++)
+		if(fcntl(outfds[i], F_SETFL, fcntl(outfds[i], F_GETFL)|O_DIRECT))
+		{
+			perror("fcntl(O_DIRECT) (continuing without)");
+			while(i--)
+				fcntl(outfds[i], F_SETFL, fcntl(outfds[i], F_GETFL)&~O_DIRECT);
+			direct=false;
+		}
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_cond_init(&p.cond, NULL);
+	if(fast)
+		fprintf(stderr, "Writing header and random blocks with %u threads\n", nthreads);
+	else
+		fprintf(stderr, "Writing header and sector blocks with %u threads\n", nthreads);
+	pthread_t threads[nthreads];
+	unsigned int started=0;
+	for(;started<nthreads;started++)
+		if((e=pthread_create(threads+started, NULL, producer, &p)))
+		{
+			errno=e;
+			perror("pthread_create");
+			if(!started) return(1);
+			break;
+		}
+	for(size_t c=p.written;c<p.nchunks;c++)
+	{
+		size_t s=c%p.nslots;
+		pthread_mutex_lock(&p.lock);
+		while(!p.failed&&p.state[s]!=SLOT_READY)
+			pthread_cond_wait(&p.cond, &p.lock);
+		bool failed=p.failed;
+		pthread_mutex_unlock(&p.lock);
+		if(failed) break;
+		size_t n=p.nunits-c*CHUNK_BLOCKS;
+		if(n>CHUNK_BLOCKS) n=CHUNK_BLOCKS;
+		if(direct&&(n*BLOCK_LENGTH)%BUF_ALIGN) // the ragged tail can't go through O_DIRECT
+		{
+			for(size_t i=0;i<nout;i++)
+				fcntl(outfds[i], F_SETFL, fcntl(outfds[i], F_GETFL)&~O_DIRECT);
+			direct=false;
+		}
+		ssize_t b=write_image(outfds, nout, chunk, p.buf[s], n*BLOCK_LENGTH, c*CHUNK_BLOCKS*BLOCK_LENGTH);
+		pthread_mutex_lock(&p.lock);
+		if(b!=(ssize_t)(n*BLOCK_LENGTH))
+		{
+			fprintf(stderr, "Error writing blocks %zu-%zu:\n", c*CHUNK_BLOCKS, c*CHUNK_BLOCKS+n-1);
+			if(b<0) perror("pwrite");
+			else fprintf(stderr, "pwrite failed, returned %zd\n", b);
+			p.failed=true;
+		}
+		p.state[s]=SLOT_FREE;
+		p.written++;
+		failed=p.failed;
+		pthread_cond_broadcast(&p.cond);
+		pthread_mutex_unlock(&p.lock);
+		if(failed) break;
+		fputc('.', stderr);
+		fflush(stderr);
+		if(ckfile&&!(p.written%CKPT_CHUNKS)&&p.written<p.nchunks)
+		{
+			bool synced=true;
+			for(size_t i=0;i<nout&&synced;i++)
+				synced=!fdatasync(outfds[i]);
+			if(!synced||write_checkpoint(ckfile, p.written*CHUNK_BLOCKS, sz))
+				perror("Failed to record checkpoint (continuing)");
+		}
+	}
+	for(unsigned int t=0;t<started;t++)
+		pthread_join(threads[t], NULL);
+	free_key_table(&keys);
+	for(size_t s=0;s<p.nslots;s++)
+		free(p.buf[s]);
+	free(p.buf);
+	free(p.state);
+	if(p.failed)
+	{
+		if(ckfile)
+			fprintf(stderr, "\nCreation failed after %zu blocks; run again with the same -C to resume\n", p.written*CHUNK_BLOCKS);
+		else
+			fprintf(stderr, "\nCreation failed after %zu blocks\n", p.written*CHUNK_BLOCKS);
+		return(1);
+	}
+	for(size_t i=0;i<nout;i++)
+	{
+		if(fdatasync(outfds[i]))
 		{
-			fprintf(stderr, "Error on block %zu:\n", blk);
-			if(e<0) perror("writeall");
-			else fprintf(stderr, "writeall failed, returned %d\n", e);
+			perror("fdatasync");
 			return(1);
 		}
+		close(outfds[i]);
 	}
-	fprintf(stderr, "Finished creating the image, all OK\n");
+	if(ckfile&&unlink(ckfile)&&errno!=ENOENT)
+		perror("Failed to remove checkpoint: unlink");
+	fprintf(stderr, "\nFinished creating the image, all OK\n");
 	return(0);
 }
@@ -0,0 +1,552 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	nbd.c: NBD server for onion layers
+*/
+
+#include "nbd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "bits.h"
+
+// Protocol constants, from the NBD protocol spec
+#define NBD_MAGIC			"NBDMAGIC"
+#define NBD_IHAVEOPT		0x49484156454F5054ULL
+#define NBD_REP_MAGIC		0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC	0x25609513
+#define NBD_REPLY_MAGIC		0x67446698
+
+#define NBD_FLAG_FIXED_NEWSTYLE	1 // handshake flags
+#define NBD_FLAG_NO_ZEROES		2
+#define NBD_FLAG_HAS_FLAGS		1 // transmission flags
+#define NBD_FLAG_READ_ONLY		2
+#define NBD_FLAG_SEND_FLUSH		4
+#define NBD_FLAG_SEND_FUA		8
+#define NBD_FLAG_CAN_MULTI_CONN	256
+
+#define NBD_OPT_EXPORT_NAME	1
+#define NBD_OPT_ABORT		2
+#define NBD_OPT_LIST		3
+#define NBD_OPT_INFO		6
+#define NBD_OPT_GO			7
+
+#define NBD_REP_ACK			1
+#define NBD_REP_SERVER		2
+#define NBD_REP_INFO		3
+#define NBD_REP_ERR_UNSUP	0x80000001
+#define NBD_REP_ERR_INVALID	0x80000003
+#define NBD_REP_ERR_UNKNOWN	0x80000006
+
+#define NBD_INFO_EXPORT		0
+#define NBD_INFO_BLOCK_SIZE	3
+
+#define NBD_CMD_READ		0
+#define NBD_CMD_WRITE		1
+#define NBD_CMD_DISC		2
+#define NBD_CMD_FLUSH		3
+#define NBD_CMD_FLAG_FUA	1
+
+#define NBD_OPTION_MAX		4096 // longest option data we'll read
+
+struct export
+{
+	size_t li;
+	enum onion_file f;
+};
+
+struct server
+{
+	struct onion_image *im;
+	bool keystream;
+	pthread_mutex_t mx; // protects the connection list
+	pthread_cond_t idle; // signalled when the last connection goes
+	struct conn *conns;
+};
+
+// A connection, once the handshake is done, is served by NBD_THREADS threads in turn: each takes the next request off the socket, and the next thread can read the one after while it works on that
+struct conn
+{
+	struct server *srv;
+	int fd;
+	struct export ex;
+	struct ra_stream *stream; // for the export's reads; NULL if it couldn't be had
+	pthread_mutex_t rx, tx; // one thread at a time reads a request (with any data), or writes a reply (ditto)
+	bool done; // DISC received, or the socket failed; under rx
+	unsigned int threads; // still running; under srv->mx
+	struct conn *next;
+};
+
+static volatile sig_atomic_t stopping=0;
+static int wake[2]; // the signal handler pokes this, as it may run on any thread, not just the one in poll()
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stopping=1;
+	if(write(wake[1], "", 1)) {} // nothing to be done if it fails, and the pipe's only ever full if we're already awake
+}
+
+static void conn_remove(struct server *s, struct conn *c)
+{
+	pthread_mutex_lock(&s->mx);
+	for(struct conn **p=&s->conns;*p;p=&(*p)->next)
+		if(*p==c)
+		{
+			*p=c->next;
+			break;
+		}
+	if(!s->conns)
+		pthread_cond_signal(&s->idle);
+	pthread_mutex_unlock(&s->mx);
+}
+
+static bool recvall(int fd, void *buf, size_t len)
+{
+	return(readall(fd, buf, len)==(ssize_t)len);
+}
+
+static bool sendall(int fd, const void *buf, size_t len)
+{
+	return(writeall(fd, buf, len)==(ssize_t)len);
+}
+
+static const char *file_name(enum onion_file f)
+{
+	return(f==ONION_DATA?"data":"keystream");
+}
+
+// Matches the paths onionmount uses in its FUSE tree
+static bool find_export(const struct server *s, const char *name, struct export *ex)
+{
+	size_t li=s->im->nlayers-1;
+	const char *file=name;
+	if(!*name)
+	{
+		*ex=(struct export){.li=li, .f=ONION_DATA};
+		return(true);
+	}
+	if(s->im->nlayers>1)
+	{
+		char *end;
+		unsigned long n=strtoul(name, &end, 10);
+		if(end==name||*end!='/'||!n||n>s->im->nlayers)
+			return(false);
+		li=n-1;
+		file=end+1;
+	}
+	if(!strcmp(file, "data"))
+		*ex=(struct export){.li=li, .f=ONION_DATA};
+	else if(s->keystream&&!strcmp(file, "keystream"))
+		*ex=(struct export){.li=li, .f=ONION_KEYSTREAM};
+	else
+		return(false);
+	return(true);
+}
+
+static bool opt_reply(int fd, uint32_t opt, uint32_t type, const unsigned char *data, uint32_t len)
+{
+	unsigned char hdr[20];
+	write64be(NBD_REP_MAGIC, hdr);
+	write32be(opt, hdr+8);
+	write32be(type, hdr+12);
+	write32be(len, hdr+16);
+	return(sendall(fd, hdr, sizeof(hdr))&&(!len||sendall(fd, data, len)));
+}
+
+static bool list_exports(const struct server *s, int fd, uint32_t opt)
+{
+	char name[32];
+	unsigned char rep[4+sizeof(name)];
+	for(size_t li=0;li<s->im->nlayers;li++)
+		for(enum onion_file f=ONION_DATA;f<=(s->keystream?ONION_KEYSTREAM:ONION_DATA);f++)
+		{
+			if(s->im->nlayers>1)
+				snprintf(name, sizeof(name), "%zu/%s", li+1, file_name(f));
+			else
+				snprintf(name, sizeof(name), "%s", file_name(f));
+			size_t len=strlen(name);
+			write32be(len, rep);
+			memcpy(rep+4, name, len);
+			if(!opt_reply(fd, opt, NBD_REP_SERVER, rep, 4+len))
+				return(false);
+		}
+	return(opt_reply(fd, opt, NBD_REP_ACK, NULL, 0));
+}
+
+static uint16_t transmission_flags(const struct server *s, const struct export *ex)
+{
+	// a flush on any connection syncs the whole image, so clients may spread their writes over several
+	uint16_t flags=NBD_FLAG_HAS_FLAGS|NBD_FLAG_SEND_FLUSH|NBD_FLAG_SEND_FUA|NBD_FLAG_CAN_MULTI_CONN;
+	if(!image_file_writable(s->im, ex->li, ex->f))
+		flags|=NBD_FLAG_READ_ONLY;
+	return(flags);
+}
+
+// NBD_OPT_INFO and NBD_OPT_GO.  Returns 1 to go into transmission, 0 to keep haggling, or -1 to drop the connection
+static int info_or_go(const struct server *s, int fd, uint32_t opt, unsigned char *data, uint32_t len, struct export *ex)
+{
+	if(len<6||read32be(data)>len-6)
+		return(opt_reply(fd, opt, NBD_REP_ERR_INVALID, NULL, 0)?0:-1);
+	uint32_t namelen=read32be(data);
+	char name[NBD_OPTION_MAX+1];
+	memcpy(name, data+4, namelen);
+	name[namelen]=0;
+	if(!find_export(s, name, ex))
+		return(opt_reply(fd, opt, NBD_REP_ERR_UNKNOWN, NULL, 0)?0:-1);
+	unsigned char info[14];
+	write16be(NBD_INFO_EXPORT, info);
+	write64be(image_file_size(s->im, ex->li, ex->f), info+2);
+	write16be(transmission_flags(s, ex), info+10);
+	if(!opt_reply(fd, opt, NBD_REP_INFO, info, 12))
+		return(-1);
+	// we're happy with any alignment, but whole pages line up best with the image's
+	write16be(NBD_INFO_BLOCK_SIZE, info);
+	write32be(1, info+2);
+	write32be(4096, info+6);
+	write32be(NBD_MAX_REQUEST, info+10);
+	if(!opt_reply(fd, opt, NBD_REP_INFO, info, 14)||!opt_reply(fd, opt, NBD_REP_ACK, NULL, 0))
+		return(-1);
+	return(opt==NBD_OPT_GO);
+}
+
+// Returns true once an export has been chosen
+static bool handshake(const struct server *s, int fd, struct export *ex)
+{
+	unsigned char buf[18];
+	memcpy(buf, NBD_MAGIC, 8);
+	write64be(NBD_IHAVEOPT, buf+8);
+	write16be(NBD_FLAG_FIXED_NEWSTYLE|NBD_FLAG_NO_ZEROES, buf+16);
+	if(!sendall(fd, buf, 18)||!recvall(fd, buf, 4))
+		return(false);
+	uint32_t cflags=read32be(buf);
+	if(!(cflags&NBD_FLAG_FIXED_NEWSTYLE))
+		return(false);
+	unsigned char *data=malloc(NBD_OPTION_MAX);
+	if(!data) return(false);
+	for(;;)
+	{
+		if(!recvall(fd, buf, 16)||read64be(buf)!=NBD_IHAVEOPT)
+			break;
+		uint32_t opt=read32be(buf+8), len=read32be(buf+12);
+		if(len>NBD_OPTION_MAX||!recvall(fd, data, len))
+			break;
+		int go;
+		switch(opt)
+		{
+			case NBD_OPT_EXPORT_NAME:
+			{
+				char name[NBD_OPTION_MAX+1];
+				memcpy(name, data, len);
+				name[len]=0;
+				if(!find_export(s, name, ex)) // this option has no way to say no, but hanging up
+					goto fail;
+				unsigned char rep[10+124];
+				write64be(image_file_size(s->im, ex->li, ex->f), rep);
+				write16be(transmission_flags(s, ex), rep+8);
+				memset(rep+10, 0, 124);
+				if(!sendall(fd, rep, cflags&NBD_FLAG_NO_ZEROES?10:sizeof(rep)))
+					goto fail;
+				free(data);
+				return(true);
+			}
+			case NBD_OPT_ABORT:
+				opt_reply(fd, opt, NBD_REP_ACK, NULL, 0);
+				goto fail;
+			case NBD_OPT_LIST:
+				if(!list_exports(s, fd, opt))
+					goto fail;
+			break;
+			case NBD_OPT_INFO:
+			case NBD_OPT_GO:
+				if((go=info_or_go(s, fd, opt, data, len, ex))<0)
+					goto fail;
+				if(go)
+				{
+					free(data);
+					return(true);
+				}
+			break;
+			default: // including structured replies: the simple ones will do
+				if(!opt_reply(fd, opt, NBD_REP_ERR_UNSUP, NULL, 0))
+					goto fail;
+			break;
+		}
+	}
+	fail:
+	free(data);
+	return(false);
+}
+
+// NBD errors are Linux's errno values, but only a few of them are allowed
+static uint32_t nbd_error(int e)
+{
+	switch(e)
+	{
+		case 0:
+		case EPERM:
+		case EIO:
+		case ENOMEM:
+		case EINVAL:
+		case ENOSPC:
+		case EOVERFLOW:
+			return(e);
+		default:
+			return(EIO);
+	}
+}
+
+// Takes a request off the socket (with its data, if a write) and carries it out.  Returns false once the connection is finished with
+static bool serve_one(struct conn *c)
+{
+	unsigned char req[28], rep[16];
+	unsigned char *buf=NULL;
+	pthread_mutex_lock(&c->rx);
+	if(c->done||!recvall(c->fd, req, 28)||read32be(req)!=NBD_REQUEST_MAGIC)
+	{
+		c->done=true;
+		pthread_mutex_unlock(&c->rx);
+		return(false);
+	}
+	uint16_t flags=read16be(req+4), type=read16be(req+6);
+	uint64_t off=read64be(req+16);
+	uint32_t len=read32be(req+24);
+	int e=0;
+	if(type==NBD_CMD_DISC)
+	{
+		c->done=true;
+		pthread_mutex_unlock(&c->rx);
+		return(false);
+	}
+	if((type==NBD_CMD_READ||type==NBD_CMD_WRITE)&&len>NBD_MAX_REQUEST)
+	{
+		// a write's data can't be skipped safely, so there's no going on from this
+		if(type==NBD_CMD_WRITE) c->done=true;
+		e=EOVERFLOW;
+	}
+	else if((type==NBD_CMD_READ||type==NBD_CMD_WRITE)&&!(buf=malloc(len?len:1)))
+	{
+		if(type==NBD_CMD_WRITE) c->done=true;
+		e=ENOMEM;
+	}
+	else if(type==NBD_CMD_WRITE&&!recvall(c->fd, buf, len))
+	{
+		c->done=true;
+		pthread_mutex_unlock(&c->rx);
+		free(buf);
+		return(false);
+	}
+	pthread_mutex_unlock(&c->rx);
+	size_t end=image_file_size(c->srv->im, c->ex.li, c->ex.f);
+	if(!e&&(type==NBD_CMD_READ||type==NBD_CMD_WRITE)&&(off>end||len>end-off))
+		e=type==NBD_CMD_WRITE?ENOSPC:EINVAL;
+	if(!e)
+	{
+		ssize_t rv=0;
+		switch(type)
+		{
+			case NBD_CMD_READ:
+				rv=c->stream?image_stream_read(c->srv->im, c->stream, buf, len, off):image_read(c->srv->im, c->ex.li, c->ex.f, buf, len, off);
+			break;
+			case NBD_CMD_WRITE:
+				rv=image_write(c->srv->im, c->ex.li, c->ex.f, buf, len, off);
+				if(rv>=0&&(flags&NBD_CMD_FLAG_FUA)&&(e=image_sync(c->srv->im)))
+					rv=e;
+			break;
+			case NBD_CMD_FLUSH:
+				rv=image_sync(c->srv->im);
+			break;
+			default:
+				rv=-EINVAL;
+			break;
+		}
+		if(rv<0) e=nbd_error(-rv);
+		else if(type!=NBD_CMD_FLUSH&&(size_t)rv!=len) e=EIO;
+	}
+	write32be(NBD_REPLY_MAGIC, rep);
+	write32be(e, rep+4);
+	memcpy(rep+8, req+8, 8); // the client's cookie
+	pthread_mutex_lock(&c->tx);
+	bool ok=sendall(c->fd, rep, 16)&&(type!=NBD_CMD_READ||e||sendall(c->fd, buf, len));
+	pthread_mutex_unlock(&c->tx);
+	free(buf);
+	if(!ok)
+	{
+		pthread_mutex_lock(&c->rx);
+		c->done=true;
+		pthread_mutex_unlock(&c->rx);
+	}
+	return(ok);
+}
+
+static void *conn_thread(void *arg)
+{
+	struct conn *c=arg;
+	while(serve_one(c));
+	struct server *s=c->srv;
+	pthread_mutex_lock(&s->mx);
+	bool last=!--c->threads;
+	pthread_mutex_unlock(&s->mx);
+	if(last)
+	{
+		conn_remove(s, c);
+		close(c->fd);
+		if(c->stream) ra_stream_close(c->stream);
+		pthread_mutex_destroy(&c->tx);
+		pthread_mutex_destroy(&c->rx);
+		free(c);
+	}
+	return(NULL);
+}
+
+// Handshakes, then hands the connection over to its threads
+static void *conn_start(void *arg)
+{
+	struct conn *c=arg;
+	struct server *s=c->srv;
+	pthread_detach(pthread_self());
+	if(!handshake(s, c->fd, &c->ex))
+	{
+		conn_remove(s, c);
+		close(c->fd);
+		free(c);
+		return(NULL);
+	}
+	pthread_mutex_init(&c->rx, NULL);
+	pthread_mutex_init(&c->tx, NULL);
+	c->stream=image_stream_open(s->im, c->ex.li, c->ex.f); // without it, reads just aren't read ahead
+	c->threads=1;
+	for(unsigned int i=1;i<NBD_THREADS;i++)
+	{
+		pthread_t t;
+		pthread_mutex_lock(&s->mx);
+		if(!pthread_create(&t, NULL, conn_thread, c))
+		{
+			pthread_detach(t);
+			c->threads++;
+		}
+		pthread_mutex_unlock(&s->mx);
+	}
+	return(conn_thread(c)); // this thread is one of them
+}
+
+int nbd_serve(const char *path, struct onion_image *im, bool keystream)
+{
+	struct sockaddr_un addr={.sun_family=AF_UNIX};
+	if(strlen(path)>=sizeof(addr.sun_path))
+	{
+		errno=ENAMETOOLONG;
+		return(-1);
+	}
+	strcpy(addr.sun_path, path);
+	int lfd=socket(AF_UNIX, SOCK_STREAM, 0);
+	if(lfd<0) return(-1);
+	unlink(path);
+	if(bind(lfd, (struct sockaddr *)&addr, sizeof(addr))||listen(lfd, 16))
+	{
+		int e=errno;
+		close(lfd);
+		errno=e;
+		return(-1);
+	}
+	struct server s={.im=im, .keystream=keystream};
+	pthread_mutex_init(&s.mx, NULL);
+	pthread_cond_init(&s.idle, NULL);
+	if(pipe(wake))
+	{
+		int e=errno;
+		close(lfd);
+		unlink(path);
+		errno=e;
+		return(-1);
+	}
+	struct sigaction sa={.sa_handler=on_signal}, old_int, old_term;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, &old_int);
+	sigaction(SIGTERM, &sa, &old_term);
+	signal(SIGPIPE, SIG_IGN); // a client hanging up shows as a failed write instead
+	fprintf(stderr, "onionmount: serving NBD on %s\n", path);
+	while(!stopping)
+	{
+		struct pollfd pfd[2]={{.fd=lfd, .events=POLLIN}, {.fd=wake[0], .events=POLLIN}};
+		if(poll(pfd, 2, -1)<0||!(pfd[0].revents&POLLIN))
+			continue;
+		int fd=accept(lfd, NULL, NULL);
+		if(fd<0)
+		{
+			if(errno!=EINTR&&errno!=ECONNABORTED)
+				perror("nbd_serve: accept");
+			continue;
+		}
+		struct conn *c=calloc(1, sizeof(*c));
+		pthread_t t;
+		int e=ENOMEM;
+		if(c)
+		{
+			*c=(struct conn){.srv=&s, .fd=fd};
+			pthread_mutex_lock(&s.mx);
+			c->next=s.conns;
+			s.conns=c;
+			pthread_mutex_unlock(&s.mx);
+			if(!(e=pthread_create(&t, NULL, conn_start, c)))
+				continue;
+			conn_remove(&s, c);
+			free(c);
+		}
+		errno=e;
+		perror("nbd_serve: starting connection");
+		close(fd);
+	}
+	close(lfd);
+	unlink(path);
+	// requests already read are finished and replied to; then the clients see the connection close
+	pthread_mutex_lock(&s.mx);
+	for(struct conn *c=s.conns;c;c=c->next)
+		shutdown(c->fd, SHUT_RD);
+	while(s.conns)
+		pthread_cond_wait(&s.idle, &s.mx);
+	pthread_mutex_unlock(&s.mx);
+	close(wake[0]);
+	close(wake[1]);
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+	pthread_cond_destroy(&s.idle);
+	pthread_mutex_destroy(&s.mx);
+	return(0);
+}
@@ -0,0 +1,48 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	nbd.h: NBD server for onion layers
+*/
+
+#ifndef NBD_H
+#define NBD_H
+
+#include <stdbool.h>
+#include "libonion.h"
+
+#define NBD_THREADS		4 // requests in flight per connection
+#define NBD_MAX_REQUEST	(32<<20) // longest read or write we accept, in bytes
+
+/* Serves the data files of im's unlocked layers (and, if keystream, their keystream files) as NBD exports on a Unix socket at path, speaking the fixed newstyle handshake, until SIGINT or SIGTERM.  With one layer the exports are "data" and "keystream"; with several, "n/data" and "n/keystream".  The default export ("") is the top layer's data.
+	Returns 0, or -1 with errno set if the socket couldn't be set up */
+int nbd_serve(const char *path, struct onion_image *im, bool keystream);
+
+#endif // NBD_H
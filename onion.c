@@ -33,7 +33,36 @@
 */
 
 #include "onion.h"
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
 #include "crypto.h"
+#include "ksvec.h"
+
+#define KS_RANDOM_BATCH	512 // blocks whose random halves encode_keystreams() asks for at once
+
+// The batch keystream kernels are chosen once: AVX2 if the CPU has it, else SSE2, else plain C.  Setting DISKONION_NO_SIMD in the environment forces plain C
+static void (*ks_decode)(size_t n, const unsigned char *ivs, unsigned char *ks);
+static void (*ks_encode)(size_t n, const unsigned char *ks, const unsigned char *hiv, unsigned char *ivs);
+static pthread_once_t ks_dispatch_once=PTHREAD_ONCE_INIT;
+
+static void ks_dispatch(void)
+{
+	ks_decode=ksvec_scalar_decode;
+	ks_encode=ksvec_scalar_encode;
+	if(getenv("DISKONION_NO_SIMD"))
+		return;
+	if(ksvec_avx2_available())
+	{
+		ks_decode=ksvec_avx2_decode;
+		ks_encode=ksvec_avx2_encode;
+	}
+	else if(ksvec_sse2_available())
+	{
+		ks_decode=ksvec_sse2_decode;
+		ks_encode=ksvec_sse2_encode;
+	}
+}
 
 int derive_key(size_t data_len, const unsigned char *restrict data, size_t key_len, unsigned char *restrict key, size_t stride, size_t index)
 {
@@ -65,3 +94,112 @@ int encode_keystream(const unsigned char *restrict ks, unsigned char *restrict i
 	}
 	return(generate_newiv(iv, iv));
 }
+
+int decode_keystreams(size_t n, const unsigned char *restrict ivs, unsigned char *restrict ks)
+{
+	if(!ivs) return(1);
+	if(!ks) return(2);
+	pthread_once(&ks_dispatch_once, ks_dispatch);
+	ks_decode(n, ivs, ks);
+	return(0);
+}
+
+int encode_keystreams(size_t n, const unsigned char *restrict ks, unsigned char *restrict ivs)
+{
+	if(!ivs) return(3);
+	if(!ks) return(4);
+	pthread_once(&ks_dispatch_once, ks_dispatch);
+	unsigned char hiv[KS_RANDOM_BATCH*KS_BLKLEN];
+	while(n)
+	{
+		size_t m=n<KS_RANDOM_BATCH?n:KS_RANDOM_BATCH;
+		int e=random_bytes(m*KS_BLKLEN, hiv);
+		if(e) return(e);
+		ks_encode(m, ks, hiv, ivs);
+		ks+=m*KS_BLKLEN;
+		ivs+=m*IV_LENGTH;
+		n-=m;
+	}
+	return(0);
+}
+
+int build_key_table(size_t data_len, const unsigned char *data, size_t key_len, size_t stride, struct key_table *kt)
+{
+	if(!data) return(1);
+	if(!kt) return(2);
+	if(!data_len) return(3);
+	if(key_len>KEY_LENGTH_HIGH) return(4);
+	kt->nkeys=data_len;
+	kt->enc=malloc(data_len*sizeof(sector_key));
+	kt->dec=malloc(data_len*sizeof(sector_key));
+	if(!kt->enc||!kt->dec)
+	{
+		free(kt->enc);
+		free(kt->dec);
+		kt->enc=kt->dec=NULL;
+		return(-1);
+	}
+	unsigned char derivedkey[KEY_LENGTH_HIGH];
+	for(size_t i=0;i<data_len;i++)
+	{
+		int e;
+		if((e=derive_key(data_len, data, key_len, derivedkey, stride, i))||(e=expand_encrypt_key(key_len, derivedkey, kt->enc+i))||(e=expand_decrypt_key(key_len, derivedkey, kt->dec+i)))
+		{
+			explicit_bzero(derivedkey, sizeof(derivedkey));
+			free_key_table(kt);
+			return(5);
+		}
+	}
+	explicit_bzero(derivedkey, sizeof(derivedkey));
+	return(0);
+}
+
+void free_key_table(struct key_table *kt)
+{
+	if(!kt) return;
+	if(kt->enc)
+		explicit_bzero(kt->enc, kt->nkeys*sizeof(sector_key));
+	if(kt->dec)
+		explicit_bzero(kt->dec, kt->nkeys*sizeof(sector_key));
+	free(kt->enc);
+	free(kt->dec);
+	kt->enc=kt->dec=NULL;
+	kt->nkeys=0;
+}
+
+const sector_key *key_table_enc(const struct key_table *kt, size_t index)
+{
+	return(kt->enc+index%kt->nkeys);
+}
+
+const sector_key *key_table_dec(const struct key_table *kt, size_t index)
+{
+	return(kt->dec+index%kt->nkeys);
+}
+
+size_t format_blocks(unsigned int format, size_t image_len)
+{
+	image_len-=image_len%BLOCK_LENGTH; // a ragged end is never used
+	if(format==FORMAT_CLUSTERED)
+	{
+		if(image_len<CLUSTER_LENGTH) return(0);
+		size_t tail=(image_len-CLUSTER_LENGTH)%CLUSTER_LENGTH; // a partial last cluster has its IV block and as many whole sectors as fit
+		return((image_len-CLUSTER_LENGTH)/CLUSTER_LENGTH*CLUSTER_BLOCKS+(tail>BLOCK_LENGTH?(tail-BLOCK_LENGTH)/SECTOR_LENGTH:0));
+	}
+	if(image_len<BLOCK_LENGTH) return(0);
+	return(image_len/BLOCK_LENGTH-1);
+}
+
+size_t iv_offset(unsigned int format, size_t index)
+{
+	if(format==FORMAT_CLUSTERED)
+		return((index/CLUSTER_BLOCKS+1)*CLUSTER_LENGTH+(index%CLUSTER_BLOCKS)*IV_LENGTH);
+	return((index+1)*BLOCK_LENGTH);
+}
+
+size_t sector_offset(unsigned int format, size_t index)
+{
+	if(format==FORMAT_CLUSTERED)
+		return((index/CLUSTER_BLOCKS+1)*CLUSTER_LENGTH+BLOCK_LENGTH+(index%CLUSTER_BLOCKS)*SECTOR_LENGTH);
+	return((index+1)*BLOCK_LENGTH+IV_LENGTH);
+}
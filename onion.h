@@ -33,7 +33,31 @@
 */
 
 #include <stdlib.h>
+#include "crypto.h"
+
+// Image formats, recorded in the high 16 bits of the header's block length word
+#define FORMAT_INTERLEAVED	0 // each block is its IV followed by its sector, as in the spec
+#define FORMAT_CLUSTERED	1 // blocks are grouped in clusters, whose IVs are gathered into one IV block at the front, so the keystream can be read contiguously
+#define FORMAT_MAX			FORMAT_CLUSTERED
+#define CLUSTER_BLOCKS		(BLOCK_LENGTH/IV_LENGTH) // blocks per cluster, ie. as many IVs as fill one block
+#define CLUSTER_LENGTH		(CLUSTER_BLOCKS*BLOCK_LENGTH) // bytes per cluster; cluster 0 starts at CLUSTER_LENGTH, after the header and random padding
+
+// Since the derived key for block i depends only on i mod L, there are at most L of them, so we expand them all once at unlock
+struct key_table
+{
+	size_t nkeys; // the sector key length L
+	sector_key *enc, *dec; // nkeys schedules each, indexed by block number mod nkeys
+};
 
 int derive_key(size_t data_len, const unsigned char *restrict data, size_t key_len, unsigned char *restrict key, size_t stride, size_t index); // derives a key according to the "derived sector key" rules
 int decode_keystream(const unsigned char *restrict iv, unsigned char *restrict ks); // decodes the IV_LENGTH/2 byte keystream block from the IV
 int encode_keystream(const unsigned char *restrict ks, unsigned char *restrict iv); // creates a new IV encoding the given keystream block
+int decode_keystreams(size_t n, const unsigned char *restrict ivs, unsigned char *restrict ks); // as decode_keystream, for n consecutive IVs into n consecutive keystream blocks.  Uses SSE2 or AVX2 if available
+int encode_keystreams(size_t n, const unsigned char *restrict ks, unsigned char *restrict ivs); // as encode_keystream, for n consecutive keystream blocks into n consecutive new IVs.  Uses random_bytes, and SSE2 or AVX2 if available
+int build_key_table(size_t data_len, const unsigned char *data, size_t key_len, size_t stride, struct key_table *kt); // derives and expands every sector key, for both directions
+void free_key_table(struct key_table *kt); // wipes and frees the schedules
+const sector_key *key_table_enc(const struct key_table *kt, size_t index); // encryption schedule for block index
+const sector_key *key_table_dec(const struct key_table *kt, size_t index); // decryption schedule for block index
+size_t format_blocks(unsigned int format, size_t image_len); // number of blocks (excl. header) in an image image_len bytes long
+size_t iv_offset(unsigned int format, size_t index); // byte offset within the image of block index's IV
+size_t sector_offset(unsigned int format, size_t index); // byte offset within the image of block index's sector
@@ -0,0 +1,404 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	onioncat.c: stream data into or out of a layer (or its keystream) of an onion image, without mounting it
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "libonion.h"
+
+#define CAT_CHUNK	(SECTOR_LENGTH<<14) // bytes per buffer, about 8MB; a whole number of sectors (and keystream blocks), so that only the first and last can be partly written
+#define CAT_SLOTS	2 // buffers, so that the file side and the layer side can each work on one
+
+/* The file and the layer are connected by a ring of CAT_SLOTS buffers: one side fills them in turn (in a thread of its own), and the other drains them.
+	err is the first error either side hit (-errno), and stops both */
+struct stream
+{
+	pthread_mutex_t mx;
+	pthread_cond_t cond;
+	struct
+	{
+		unsigned char *buf;
+		size_t len, pos; // pos is where in the layer's file buf starts
+		bool full;
+	}
+	slot[CAT_SLOTS];
+	bool eof, overrun;
+	int err;
+	struct onion_image *im;
+	size_t li;
+	enum onion_file f;
+	int fd; // the plain file
+	size_t pos, end; // the range of the layer's file still to be copied
+	bool bounded; // end was given with --length, so input beyond it isn't an error
+};
+
+static void stream_fail(struct stream *s, int e)
+{
+	pthread_mutex_lock(&s->mx);
+	if(!s->err) s->err=e;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->mx);
+}
+
+// Waits for slot i to be empty (if fill) or full; returns false if the other side failed, or (when draining) there's nothing more coming
+static bool stream_wait(struct stream *s, size_t i, bool fill)
+{
+	pthread_mutex_lock(&s->mx);
+	while(!s->err&&s->slot[i].full==fill&&(fill||!s->eof))
+		pthread_cond_wait(&s->cond, &s->mx);
+	bool ok=!s->err&&s->slot[i].full!=fill;
+	pthread_mutex_unlock(&s->mx);
+	return(ok);
+}
+
+static void stream_done(struct stream *s, size_t i, bool fill)
+{
+	pthread_mutex_lock(&s->mx);
+	s->slot[i].full=fill;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->mx);
+}
+
+static void stream_eof(struct stream *s)
+{
+	pthread_mutex_lock(&s->mx);
+	s->eof=true;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->mx);
+}
+
+// Import, file side: read()s the file into the slots
+static void *fill_from_file(void *arg)
+{
+	struct stream *s=arg;
+	for(size_t i=0;;i=(i+1)%CAT_SLOTS)
+	{
+		if(!stream_wait(s, i, true))
+			return(NULL);
+		size_t want=s->end-s->pos<CAT_CHUNK?s->end-s->pos:CAT_CHUNK, len=0;
+		while(len<want)
+		{
+			ssize_t n=read(s->fd, s->slot[i].buf+len, want-len);
+			if(n<0&&errno==EINTR)
+				continue;
+			if(n<0)
+			{
+				stream_fail(s, -errno);
+				return(NULL);
+			}
+			if(!n) break;
+			len+=n;
+		}
+		if(len)
+		{
+			s->slot[i].len=len;
+			s->slot[i].pos=s->pos;
+			s->pos+=len;
+			stream_done(s, i, true);
+		}
+		if(len<want||s->pos==s->end)
+		{
+			if(len==want&&!s->bounded) // the layer is full; is there more?
+			{
+				unsigned char c;
+				ssize_t n;
+				while((n=read(s->fd, &c, 1))<0&&errno==EINTR);
+				s->overrun=n>0;
+			}
+			stream_eof(s);
+			return(NULL);
+		}
+	}
+}
+
+// Import, layer side: writes the slots to the layer.  Returns the bytes written
+static size_t drain_to_layer(struct stream *s)
+{
+	size_t done=0;
+	for(size_t i=0;stream_wait(s, i, false);i=(i+1)%CAT_SLOTS)
+	{
+		ssize_t n=image_write(s->im, s->li, s->f, s->slot[i].buf, s->slot[i].len, s->slot[i].pos);
+		if(n<0||(size_t)n<s->slot[i].len)
+		{
+			stream_fail(s, n<0?n:-ENOSPC);
+			break;
+		}
+		done+=n;
+		stream_done(s, i, false);
+	}
+	return(done);
+}
+
+// Export, layer side: reads the layer into the slots
+static void fill_from_layer(struct stream *s)
+{
+	for(size_t i=0;s->pos<s->end;i=(i+1)%CAT_SLOTS)
+	{
+		if(!stream_wait(s, i, true))
+			return;
+		size_t want=s->end-s->pos<CAT_CHUNK?s->end-s->pos:CAT_CHUNK;
+		ssize_t n=image_read(s->im, s->li, s->f, s->slot[i].buf, want, s->pos);
+		if(n<=0)
+		{
+			stream_fail(s, n<0?n:-EIO);
+			return;
+		}
+		s->slot[i].len=n;
+		s->slot[i].pos=s->pos;
+		s->pos+=n;
+		stream_done(s, i, true);
+	}
+	stream_eof(s);
+}
+
+// Export, file side: write()s the slots to the file
+static void *drain_to_file(void *arg)
+{
+	struct stream *s=arg;
+	for(size_t i=0;stream_wait(s, i, false);i=(i+1)%CAT_SLOTS)
+	{
+		for(size_t off=0;off<s->slot[i].len;)
+		{
+			ssize_t n=write(s->fd, s->slot[i].buf+off, s->slot[i].len-off);
+			if(n<0&&errno==EINTR)
+				continue;
+			if(n<0)
+			{
+				stream_fail(s, -errno);
+				return(NULL);
+			}
+			off+=n;
+		}
+		stream_done(s, i, false);
+	}
+	return(NULL);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec+ts.tv_nsec*1e-9);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *img=NULL, *file="-", *journal_path=NULL, *io_mode="window";
+	int import=-1; // --import or --export
+	size_t nlayers=1, offset=0, length=0;
+	bool keystream=false, bounded=false;
+	long ncpu=sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int nworkers=ncpu>0?ncpu:0;
+	for(int arg=1;arg<argc;arg++)
+	{
+		if(strcmp(argv[arg], "--import")==0)
+			import=1;
+		else if(strcmp(argv[arg], "--export")==0)
+			import=0;
+		else if(strcmp(argv[arg], "--keystream")==0)
+			keystream=true;
+		else if(strncmp(argv[arg], "--layer=", 8)==0)
+		{
+			if(sscanf(argv[arg]+8, "%zu", &nlayers)!=1||!nlayers||nlayers>IMAGE_MAX_LAYERS)
+			{
+				fprintf(stderr, "Bad --layer, must be between 1 and %d\n", IMAGE_MAX_LAYERS);
+				return(1);
+			}
+		}
+		else if(strncmp(argv[arg], "--offset=", 9)==0)
+		{
+			if(sscanf(argv[arg]+9, "%zu", &offset)!=1)
+			{
+				fprintf(stderr, "Bad --offset, `%s' not numeric\n", argv[arg]+9);
+				return(1);
+			}
+		}
+		else if(strncmp(argv[arg], "--length=", 9)==0)
+		{
+			if(sscanf(argv[arg]+9, "%zu", &length)!=1)
+			{
+				fprintf(stderr, "Bad --length, `%s' not numeric\n", argv[arg]+9);
+				return(1);
+			}
+			bounded=true;
+		}
+		else if(strncmp(argv[arg], "--io=", 5)==0)
+		{
+			io_mode=argv[arg]+5;
+			if(strcmp(io_mode, "mmap")&&strcmp(io_mode, "window")&&strcmp(io_mode, "pread")&&strcmp(io_mode, "uring"))
+			{
+				fprintf(stderr, "Bad --io, `%s' should be mmap, window, pread or uring\n", io_mode);
+				return(1);
+			}
+		}
+		else if(strncmp(argv[arg], "--journal=", 10)==0)
+			journal_path=argv[arg]+10;
+		else if(strncmp(argv[arg], "--workers=", 10)==0)
+		{
+			if(sscanf(argv[arg]+10, "%u", &nworkers)!=1)
+			{
+				fprintf(stderr, "Bad --workers, `%s' not numeric\n", argv[arg]+10);
+				return(1);
+			}
+		}
+		else if(!img)
+			img=argv[arg];
+		else
+			file=argv[arg];
+	}
+	if(!img||import<0)
+	{
+		fprintf(stderr, "Usage: onioncat <onion-image> --import|--export [--layer=N] [--keystream] [--offset=BYTES] [--length=BYTES] [--io=mmap|window|pread|uring] [--journal=PATH] [--workers=N] [FILE]\n");
+		fprintf(stderr, "FILE defaults to stdin (--import) or stdout (--export)\n");
+		return(1);
+	}
+	bool std=strcmp(file, "-")==0;
+	// stdin may be the data, in which case the passphrases have to come from the terminal
+	FILE *pass=stdin;
+	if(std&&import&&!(pass=fopen("/dev/tty", "r")))
+	{
+		perror("onioncat: /dev/tty (needed for the passphrases when importing from stdin)");
+		return(1);
+	}
+	enum image_io io=IO_WINDOW;
+	if(strcmp(io_mode, "mmap")==0) io=IO_MMAP;
+	else if(strcmp(io_mode, "pread")==0) io=IO_PREAD;
+	else if(strcmp(io_mode, "uring")==0) io=IO_URING;
+	struct onion_image im;
+	int fd=-1, rv=1;
+	if(image_open(&im, img, io, journal_path))
+		return(1);
+	unsigned char passphrase[KEY_LENGTH_HIGH+1];
+	char prompt[64];
+	while(im.nlayers<nlayers)
+	{
+		if(nlayers>1)
+			snprintf(prompt, sizeof(prompt), "Enter the layer %zu master passphrase", im.nlayers+1);
+		else
+			snprintf(prompt, sizeof(prompt), "Enter your layer master passphrase");
+		if(image_get_passphrase(pass, prompt, passphrase))
+		{
+			perror("Failed to read passphrase: fgets");
+			goto out;
+		}
+		int e=image_unlock(&im, passphrase);
+		explicit_bzero(passphrase, sizeof(passphrase));
+		if(e)
+		{
+			fprintf(stderr, "onioncat: failed to unlock layer %zu\n", im.nlayers+1);
+			goto out;
+		}
+	}
+	// opened only now, so that a wrong passphrase doesn't truncate the output
+	fd=std?(import?STDIN_FILENO:STDOUT_FILENO):open(file, import?O_RDONLY:O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if(fd<0)
+	{
+		fprintf(stderr, "onioncat: Failed to open '%s'\n", file);
+		perror("\topen");
+		goto out;
+	}
+	enum onion_file f=keystream?ONION_KEYSTREAM:ONION_DATA;
+	size_t size=image_file_size(&im, nlayers-1, f);
+	if(offset>size)
+	{
+		fprintf(stderr, "onioncat: --offset=%zu is beyond the end of the file (%zu bytes)\n", offset, size);
+		goto out;
+	}
+	if(!bounded||length>size-offset)
+	{
+		if(bounded)
+			fprintf(stderr, "onioncat: --length=%zu runs past the end of the file; copying %zu bytes\n", length, size-offset);
+		length=size-offset;
+	}
+	struct stream s={.mx=PTHREAD_MUTEX_INITIALIZER, .cond=PTHREAD_COND_INITIALIZER, .im=&im, .li=nlayers-1, .f=f, .fd=fd, .pos=offset, .end=offset+length, .bounded=bounded};
+	size_t i;
+	for(i=0;i<CAT_SLOTS;i++)
+		if(!(s.slot[i].buf=malloc(CAT_CHUNK)))
+			break;
+	if(i<CAT_SLOTS)
+	{
+		perror("onioncat: malloc");
+		while(i--) free(s.slot[i].buf);
+		goto out;
+	}
+	image_start(&im, nworkers);
+	double t0=now();
+	pthread_t thread;
+	int e=pthread_create(&thread, NULL, import?fill_from_file:drain_to_file, &s);
+	if(e)
+	{
+		errno=e;
+		perror("onioncat: pthread_create");
+	}
+	else
+	{
+		size_t done=length;
+		if(import)
+			done=drain_to_layer(&s);
+		else
+			fill_from_layer(&s);
+		pthread_join(thread, NULL);
+		if(import&&!s.err&&(e=image_sync(&im)))
+			s.err=e;
+		double t=now()-t0;
+		if(s.err)
+		{
+			errno=-s.err;
+			perror(import?"onioncat: import":"onioncat: export");
+		}
+		else if(s.overrun)
+			fprintf(stderr, "onioncat: the input is longer than the layer's file; only the first %zu bytes were copied\n", done);
+		else
+			rv=0;
+		if(!s.err)
+			fprintf(stderr, "%zu bytes in %.2fs (%.1f MB/s)\n", done, t, t>0?done/t/1e6:0);
+	}
+	for(i=0;i<CAT_SLOTS;i++)
+		free(s.slot[i].buf);
+	out:
+	image_close(&im);
+	if(pass!=stdin) fclose(pass);
+	if(!std&&fd>=0&&close(fd)&&!rv)
+	{
+		perror("onioncat: close");
+		rv=1;
+	}
+	return(rv);
+}
@@ -29,498 +29,642 @@
 	version.  If you delete this exception statement from all source
 	files in the program, then also delete it here.
 	
-	onionmount.c: mount an onion image with FUSE, presenting data and keystream
+	onionmount.c: mount an onion image with FUSE, presenting data and keystream of one or more stacked layers
 */
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 31
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
-#include <sys/file.h>
-#include <sys/mman.h>
-#include <pthread.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
-#include "crypto.h"
-#include "onion.h"
-#include "bits.h"
-
-pthread_rwlock_t mx; // image mutex
-unsigned char *im=NULL; // image map
-size_t i_sz; // image size
-size_t nblk; // number of blocks (excl. header)
+#include <signal.h>
+#include "libonion.h"
+#include "nbd.h"
+
+#define MAX_WRITE		(1<<20) // the most we ask the kernel to send in one write; it may allow less
+#define ONION_BLKSIZE	(1<<17) // st_blksize for the files
+#define ATTR_TIMEOUT	1.0 // seconds the kernel may cache attributes and lookups for, as the high-level API had it; the sizes change when onionresize grows the image (and with the writeback cache the kernel needs telling besides, see announce_size())
+
+const char *io_mode="window"; // --io=mmap|window|pread|uring
+const char *journal_path=NULL; // --journal=PATH
+const char *members[STRIPE_MAX]; // the image, then each --stripe=PATH in turn
+size_t nmembers=1;
+size_t stripe_chunk=STRIPE_CHUNK; // --stripe-chunk=BYTES
+const char *nbd_path=NULL; // --nbd=SOCKET; serve NBD there instead of mounting
+bool nbd_keystream=false; // --nbd-keystream; export the keystream files too
+int trace_fd=-1; // --trace=PATH, opened in main() but only recorded to once the threads are started
 uid_t uid;
 gid_t gid;
 
-struct
+struct onion_image image; // with the layers stacked on it, layer n being image.layers[n-1]
+struct fuse_session *session; // NULL when serving NBD
+size_t nlayers=1; // --layers=N
+unsigned int nworkers; // --workers=N; defaults to one per CPU; the pool is shared by all the layers
+size_t inline_max=IMAGE_INLINE_MAX; // --inline-max=BYTES; requests covering at most this many bytes of sectors aren't fanned out
+size_t readahead_max=READAHEAD_MAX; // --readahead=BYTES; 0 turns readahead off
+size_t cache_max=IMAGE_CACHE_MAX; // --cache=BYTES of decrypted sectors per layer; 0 turns the cache off
+
+/* Inodes: the root is FUSE_ROOT_ID, and layer li has a directory (only used when there are several layers), data, keystream and stats at ino_of(li, ...).  With one layer its files are in the root; with several, layer n's are in /n/.
+	A data or keystream file's handle points to its stream, and a stats file's to the snapshot taken when it was opened */
+#define INO_DIR		0
+#define INO_DATA	1
+#define INO_KEYSTREAM	2
+#define INO_STATS	3
+#define INO_KINDS	4
+#define STATS_SLACK	1024 // bytes of room left in a stats snapshot for the counters to have grown
+
+// What a reader of a stats file sees, fixed at open so that it reads consistently
+struct stats_snapshot
 {
-	size_t key_size, key_len, key_stride;
-	unsigned char *key_data; // this is a pointer into im, so reads must acquire rdlock on mx
+	size_t len;
+	char text[];
+};
+
+static fuse_ino_t ino_of(size_t li, int kind)
+{
+	return(FUSE_ROOT_ID+1+li*INO_KINDS+kind);
 }
-header;
 
-static int onion_getattr(const char *path, struct stat *st)
+// Returns INO_*, or -1 if there's no such inode
+static int ino_kind(fuse_ino_t ino, size_t *li)
 {
+	if(ino<=FUSE_ROOT_ID) return(-1);
+	*li=(ino-FUSE_ROOT_ID-1)/INO_KINDS;
+	int kind=(ino-FUSE_ROOT_ID-1)%INO_KINDS;
+	if(*li>=nlayers||(kind==INO_DIR&&nlayers==1)) return(-1);
+	return(kind);
+}
+
+static bool ino_dir(fuse_ino_t ino)
+{
+	size_t li;
+	return(ino==FUSE_ROOT_ID||ino_kind(ino, &li)==INO_DIR);
+}
+
+static int ino_stat(fuse_ino_t ino, struct stat *st)
+{
+	size_t li;
+	int kind=ino==FUSE_ROOT_ID?INO_DIR:ino_kind(ino, &li);
+	if(kind<0) return(ENOENT);
 	memset(st, 0, sizeof(struct stat));
+	st->st_ino=ino;
 	st->st_uid=uid;
 	st->st_gid=gid;
-	if(strcmp(path, "/")==0)
+	if(kind==INO_DIR)
 	{
-		pthread_rwlock_rdlock(&mx);
 		st->st_mode=S_IFDIR | S_IRWXU;
 		st->st_nlink=2;
 		st->st_size=SECTOR_LENGTH;
-		pthread_rwlock_unlock(&mx);
 		return(0);
 	}
-	if(strcmp(path, "/data")==0)
+	if(kind==INO_STATS)
 	{
-		pthread_rwlock_rdlock(&mx);
-		st->st_mode=S_IFREG | S_IRUSR | S_IWUSR;
+		st->st_mode=S_IFREG | S_IRUSR;
 		st->st_nlink=1;
-		st->st_size=nblk*SECTOR_LENGTH;
-		st->st_blocks=(st->st_size+511)/512;
-		st->st_blksize=SECTOR_LENGTH;
-		pthread_rwlock_unlock(&mx);
+		st->st_size=0; // it's direct_io, so readers go on until they get a short read
 		return(0);
 	}
-	if(strcmp(path, "/keystream")==0)
+	enum onion_file f=kind==INO_DATA?ONION_DATA:ONION_KEYSTREAM;
+	st->st_mode=S_IFREG | S_IRUSR | (image_file_writable(&image, li, f)?S_IWUSR:0);
+	st->st_nlink=1;
+	st->st_size=image_file_size(&image, li, f);
+	st->st_blocks=(st->st_size+511)/512;
+	st->st_blksize=ONION_BLKSIZE; // not the sector size, or stdio would write 496 bytes at a time
+	return(0);
+}
+
+static void onion_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	size_t li=0;
+	fuse_ino_t ino=0;
+	if(parent==FUSE_ROOT_ID&&nlayers>1)
+	{
+		char *end;
+		unsigned long n=strtoul(name, &end, 10);
+		if(end!=name&&!*end&&n&&n<=nlayers)
+			ino=ino_of(n-1, INO_DIR);
+	}
+	else if(parent==FUSE_ROOT_ID||ino_kind(parent, &li)==INO_DIR)
 	{
-		pthread_rwlock_rdlock(&mx);
-		st->st_mode=S_IFREG | S_IRUSR | S_IWUSR;
-		st->st_nlink=1;
-		st->st_size=nblk*KS_BLKLEN;
-		st->st_blocks=(st->st_size+511)/512;
-		st->st_blksize=KS_BLKLEN;
-		pthread_rwlock_unlock(&mx);
-		return(0);
+		if(strcmp(name, "data")==0)
+			ino=ino_of(li, INO_DATA);
+		else if(strcmp(name, "keystream")==0)
+			ino=ino_of(li, INO_KEYSTREAM);
+		else if(strcmp(name, "stats")==0)
+			ino=ino_of(li, INO_STATS);
 	}
-	return(-ENOENT);
+	struct fuse_entry_param e={.ino=ino, .attr_timeout=ATTR_TIMEOUT, .entry_timeout=ATTR_TIMEOUT};
+	if(!ino||ino_stat(ino, &e.attr))
+		fuse_reply_err(req, ENOENT);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void onion_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct stat st;
+	int e=ino_stat(ino, &st);
+	if(e)
+		fuse_reply_err(req, e);
+	else
+		fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+}
+
+static void onion_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+	onion_getattr(req, ino, fi); // do nothing, because you can't truncate either file (nor change its times or mode).  But we lie about it, because otherwise editing the files is impossible
 }
 
-static int onion_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+static void dir_add(fuse_req_t req, char *buf, size_t *len, size_t size, const char *name, fuse_ino_t ino)
 {
-	if(strcmp(path, "/")==0)
+	struct stat st={.st_ino=ino, .st_mode=ino_dir(ino)?S_IFDIR:S_IFREG};
+	size_t need=fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+	if(*len+need<=size)
+		*len+=fuse_add_direntry(req, buf+*len, size-*len, name, &st, *len+need);
+}
+
+static void onion_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	size_t li=0;
+	if(!ino_dir(ino))
 	{
-		filler(buf, ".", NULL, 0);
-		filler(buf, "..", NULL, 0);
-		filler(buf, "data", NULL, 0);
-		filler(buf, "keystream", NULL, 0);
-		return(0);
+		fuse_reply_err(req, ENOTDIR);
+		return;
 	}
-	if(strcmp(path, "/data")==0)
-		return(-ENOTDIR);
-	if(strcmp(path, "/keystream")==0)
-		return(-ENOTDIR);
-	return(-ENOENT);
+	if(ino!=FUSE_ROOT_ID)
+		ino_kind(ino, &li);
+	char buf[1024]; // room for IMAGE_MAX_LAYERS+2 entries
+	size_t len=0;
+	dir_add(req, buf, &len, sizeof(buf), ".", ino);
+	dir_add(req, buf, &len, sizeof(buf), "..", FUSE_ROOT_ID);
+	if(nlayers>1&&ino==FUSE_ROOT_ID)
+	{
+		char name[24];
+		for(size_t i=0;i<nlayers;i++)
+		{
+			snprintf(name, sizeof(name), "%zu", i+1);
+			dir_add(req, buf, &len, sizeof(buf), name, ino_of(i, INO_DIR));
+		}
+	}
+	else
+	{
+		dir_add(req, buf, &len, sizeof(buf), "data", ino_of(li, INO_DATA));
+		dir_add(req, buf, &len, sizeof(buf), "keystream", ino_of(li, INO_KEYSTREAM));
+		dir_add(req, buf, &len, sizeof(buf), "stats", ino_of(li, INO_STATS));
+	}
+	// the whole listing is built each time, and off is a byte offset into it
+	if((size_t)off>=len)
+		fuse_reply_buf(req, NULL, 0);
+	else
+		fuse_reply_buf(req, buf+off, len-off<size?len-off:size);
 }
 
-static int onion_truncate(const char *path, off_t offset)
+static void onion_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	return(0); // do nothing, because you can't truncate either file.  But we lie about it, because otherwise editing the files is impossible
+	if(fi->flags&O_SYNC) { fuse_reply_err(req, ENOSYS); return; }
+	if(fi->flags&O_TRUNC) { fuse_reply_err(req, EACCES); return; }
+	if(fi->flags&O_CREAT) { fuse_reply_err(req, EACCES); return; }
+	size_t li;
+	int kind=ino_kind(ino, &li);
+	if(kind<0) { fuse_reply_err(req, ENOENT); return; }
+	if(kind==INO_DIR) { fuse_reply_err(req, EISDIR); return; }
+	if(kind==INO_STATS)
+	{
+		if((fi->flags&O_ACCMODE)!=O_RDONLY) { fuse_reply_err(req, EACCES); return; }
+		char labels[32];
+		snprintf(labels, sizeof(labels), "layer=\"%zu\"", li+1);
+		size_t len=stats_format(image.layers[li].stats, labels, NULL, 0)+STATS_SLACK; // the counters may gain digits before the real run
+		struct stats_snapshot *snap=malloc(sizeof(*snap)+len);
+		if(!snap) { fuse_reply_err(req, ENOMEM); return; }
+		snap->len=stats_format(image.layers[li].stats, labels, snap->text, len);
+		if(snap->len>=len) snap->len=len-1;
+		fi->fh=(uintptr_t)snap;
+		fi->direct_io=1;
+		fuse_reply_open(req, fi);
+		return;
+	}
+	enum onion_file f=kind==INO_DATA?ONION_DATA:ONION_KEYSTREAM;
+	if((fi->flags&O_ACCMODE)!=O_RDONLY&&!image_file_writable(&image, li, f)) { fuse_reply_err(req, EACCES); return; }
+	struct ra_stream *s=image_stream_open(&image, li, f);
+	if(!s) { fuse_reply_err(req, errno); return; }
+	fi->fh=(uintptr_t)s;
+	// a layer's data only changes through its own file (the keystream it's stored in is read-only while it's unlocked), so the kernel may keep its pages; but writing to the layer above rewrites a keystream behind the kernel's back
+	if(f==ONION_DATA)
+		fi->keep_cache=1;
+	else
+		fi->direct_io=1;
+	fuse_reply_open(req, fi);
 }
 
-static int onion_open(const char *path, struct fuse_file_info *fi)
+static void onion_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-	if(fi->flags&O_SYNC) return(-ENOSYS);
-	if(fi->flags&O_TRUNC) return(-EACCES);
-	if(fi->flags&O_CREAT) return(-EACCES);
-	if(strcmp(path, "/")==0)
-		return(-EISDIR);
-	if(strcmp(path, "/data")==0)
+	if(offset<0) { fuse_reply_err(req, EINVAL); return; }
+	size_t li;
+	int kind=ino_kind(ino, &li);
+	if(kind==INO_STATS)
 	{
-		fi->fh=1;
-		return(0);
+		const struct stats_snapshot *snap=(const struct stats_snapshot *)fi->fh;
+		if((size_t)offset>=snap->len)
+			fuse_reply_buf(req, NULL, 0);
+		else
+			fuse_reply_buf(req, snap->text+offset, snap->len-offset<size?snap->len-offset:size);
+		return;
+	}
+	if((kind!=INO_DATA&&kind!=INO_KEYSTREAM)||!fi->fh) { fuse_reply_err(req, EBADF); return; }
+	unsigned char *buf=malloc(size?size:1);
+	if(!buf) { fuse_reply_err(req, ENOMEM); return; }
+	ssize_t rv=image_stream_read(&image, (struct ra_stream *)fi->fh, buf, size, offset);
+	if(rv<0)
+		fuse_reply_err(req, -rv);
+	else
+		fuse_reply_buf(req, (const char *)buf, rv);
+	free(buf);
+}
+
+static void onion_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in, off_t offset, struct fuse_file_info *fi)
+{
+	if(offset<0) { fuse_reply_err(req, EINVAL); return; }
+	size_t li;
+	int kind=ino_kind(ino, &li);
+	if(kind!=INO_DATA&&kind!=INO_KEYSTREAM) { fuse_reply_err(req, EBADF); return; }
+	size_t size=fuse_buf_size(in);
+	unsigned char *buf=NULL;
+	const unsigned char *data;
+	if(in->count==1&&!(in->buf[0].flags&FUSE_BUF_IS_FD)) // already in memory
+		data=in->buf[0].mem;
+	else // spliced, so still in the pipe
+	{
+		struct fuse_bufvec out=FUSE_BUFVEC_INIT(size);
+		if(!(buf=malloc(size?size:1))) { fuse_reply_err(req, ENOMEM); return; }
+		out.buf[0].mem=buf;
+		ssize_t got=fuse_buf_copy(&out, in, 0);
+		if(got<0) { free(buf); fuse_reply_err(req, -got); return; }
+		size=got;
+		data=buf;
 	}
-	if(strcmp(path, "/keystream")==0)
+	ssize_t rv=image_write(&image, li, kind==INO_DATA?ONION_DATA:ONION_KEYSTREAM, data, size, offset);
+	free(buf);
+	if(rv<0)
+		fuse_reply_err(req, -rv);
+	else
+		fuse_reply_write(req, rv);
+}
+
+static void onion_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	size_t li;
+	if(ino_kind(ino, &li)==INO_STATS)
+		free((struct stats_snapshot *)fi->fh);
+	else if(fi->fh)
+		ra_stream_close((struct ra_stream *)fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static void onion_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, -image_sync(&image));
+}
+
+// Every close() flushes, so this mustn't cost a device flush; durability is what fsync() is for
+static void onion_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, -image_error(&image));
+}
+
+/* The kernel caches a file's size with its attributes, and with the writeback cache trusts its own over ours altogether; storing the file's last byte into its page cache is what moves it on.
+	Its cached page at the old end of the file was zero-filled past it, so that goes first */
+static void announce_size(size_t li, int kind, size_t was)
+{
+	fuse_ino_t ino=ino_of(li, kind);
+	enum onion_file f=kind==INO_DATA?ONION_DATA:ONION_KEYSTREAM;
+	size_t size=image_file_size(&image, li, f);
+	unsigned char last;
+	fuse_lowlevel_notify_inval_inode(session, ino, was, 0); // errors just mean the kernel hasn't looked the file up yet
+	if(image_read(&image, li, f, &last, 1, size-1)==1)
 	{
-		fi->fh=2;
-		return(0);
+		struct fuse_bufvec bv=FUSE_BUFVEC_INIT(1);
+		bv.buf[0].mem=&last;
+		fuse_lowlevel_notify_store(session, ino, size-1, &bv, 0);
 	}
-	return(-ENOENT);
 }
 
-static int onion_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// onionresize sends SIGHUP once the blocks it added to the image are initialised.  It's blocked in every thread (see main()), so this one takes it with sigwait()
+static pthread_t hup_thread;
+static bool hup_running, hup_stop;
+
+static void *hup_loop(void *arg)
 {
-	switch(fi->fh)
+	(void)arg;
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	for(;;)
 	{
-		case 1: // data
+		int sig;
+		if(sigwait(&set, &sig)) continue;
+		if(__atomic_load_n(&hup_stop, __ATOMIC_ACQUIRE)) break;
+		size_t was=image.size, data=image_file_size(&image, 0, ONION_DATA), keystream=image_file_size(&image, 0, ONION_KEYSTREAM);
+		int e=image_grow(&image);
+		if(e)
 		{
-			size_t blk=offset/SECTOR_LENGTH;
-			size_t rb=0;
-			pthread_rwlock_rdlock(&mx);
-			unsigned char derivedkey[header.key_size];
-			unsigned char decodedblk[SECTOR_LENGTH];
-			while(rb<size)
-			{
-				if(blk>=nblk)
-					break;
-				int e;
-				if((e=derive_key(header.key_len, header.key_data, header.key_size, derivedkey, header.key_stride, blk)))
-				{
-					fprintf(stderr, "Error on block %zu:\n", blk);
-					if(e<0) perror("derive_key");
-					else fprintf(stderr, "derive_key failed with code %d\n", e);
-					pthread_rwlock_unlock(&mx);
-					return(-EIO);
-				}
-				unsigned char *block=im+(blk+1)*BLOCK_LENGTH;
-				if((e=decrypt_sector(header.key_size, derivedkey, block, block+IV_LENGTH, decodedblk)))
-				{
-					fprintf(stderr, "Error on block %zu:\n", blk);
-					if(e<0) perror("decrypt_sector");
-					else fprintf(stderr, "decrypt_sector failed with code %d\n", e);
-					pthread_rwlock_unlock(&mx);
-					return(-EIO);
-				}
-				if(rb)
-				{
-					size_t left=size-rb;
-					if(left>SECTOR_LENGTH) left=SECTOR_LENGTH;
-					memcpy(buf+rb, decodedblk, left);
-					rb+=left;
-				}
-				else
-				{
-					size_t off=offset%SECTOR_LENGTH;
-					memcpy(buf, decodedblk+off, SECTOR_LENGTH-off);
-					rb=SECTOR_LENGTH-off;
-				}
-				blk++;
-			}
-			pthread_rwlock_unlock(&mx);
-			return(rb);
+			errno=-e;
+			perror("onionmount: image_grow");
 		}
-		case 2: // keystream
+		else if(image.size!=was)
 		{
-			size_t blk=offset/KS_BLKLEN;
-			size_t rb=0;
-			unsigned char ks[KS_BLKLEN];
-			pthread_rwlock_rdlock(&mx);
-			while(rb<size)
+			fprintf(stderr, "onionmount: image grew to %zu blocks\n", image.layers[0].nblk);
+			if(session)
 			{
-				if(blk>=nblk)
-					break;
-				unsigned char *block=im+(blk+1)*BLOCK_LENGTH;
-				int e;
-				if((e=decode_keystream(block, ks)))
-				{
-					fprintf(stderr, "Error on block %zu:\n", blk);
-					if(e<0) perror("decode_keystream");
-					else fprintf(stderr, "decode_keystream failed with code %d\n", e);
-					pthread_rwlock_unlock(&mx);
-					return(-EIO);
-				}
-				if(rb)
-				{
-					size_t left=size-rb;
-					if(left>KS_BLKLEN) left=KS_BLKLEN;
-					memcpy(buf+rb, ks, left);
-					rb+=left;
-				}
-				else
-				{
-					size_t off=offset%KS_BLKLEN;
-					memcpy(buf, ks+off, KS_BLKLEN-off);
-					rb=KS_BLKLEN-off;
-				}
-				blk++;
+				announce_size(0, INO_DATA, data);
+				announce_size(0, INO_KEYSTREAM, keystream);
 			}
-			pthread_rwlock_unlock(&mx);
-			return(rb);
 		}
-		default:
-			return(-EBADF);
 	}
+	return(NULL);
 }
 
-static int onion_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+static void start_threads(void)
 {
-	switch(fi->fh)
+	image_start(&image, nworkers);
+	hup_stop=false;
+	int e;
+	if((e=pthread_create(&hup_thread, NULL, hup_loop, NULL)))
 	{
-		case 1: // data
+		errno=e;
+		perror("onionmount: pthread_create (continuing without growing on SIGHUP)");
+	}
+	else
+		hup_running=true;
+	if(trace_fd>=0)
+	{
+		if(!(image.trace=trace_create(trace_fd)))
 		{
-			size_t blk=offset/SECTOR_LENGTH;
-			size_t rb=0;
-			pthread_rwlock_wrlock(&mx);
-			unsigned char derivedkey[header.key_size];
-			unsigned char decodedblk[SECTOR_LENGTH];
-			while(rb<size)
-			{
-				if(blk>=nblk)
-					break;
-				size_t left=size-rb;
-				if(left>SECTOR_LENGTH) left=SECTOR_LENGTH;
-				size_t off=offset%SECTOR_LENGTH;
-				bool partial_write;
-				partial_write=(left<SECTOR_LENGTH)||(off&&!rb);
-				unsigned char *block=im+(blk+1)*BLOCK_LENGTH;
-				if(partial_write)
-				{
-					int e;
-					if((e=derive_key(header.key_len, header.key_data, header.key_size, derivedkey, header.key_stride, blk)))
-					{
-						fprintf(stderr, "Error on block %zu:\n", blk);
-						if(e<0) perror("derive_key");
-						else fprintf(stderr, "derive_key failed with code %d\n", e);
-						pthread_rwlock_unlock(&mx);
-						return(-EIO);
-					}
-					if((e=decrypt_sector(header.key_size, derivedkey, block, block+IV_LENGTH, decodedblk)))
-					{
-						fprintf(stderr, "Error on block %zu:\n", blk);
-						if(e<0) perror("decrypt_sector");
-						else fprintf(stderr, "decrypt_sector failed with code %d\n", e);
-						pthread_rwlock_unlock(&mx);
-						return(-EIO);
-					}
-				}
-				if(rb)
-				{
-					memcpy(decodedblk, buf+rb, left);
-					rb+=left;
-				}
-				else
-				{
-					size_t bytes=SECTOR_LENGTH-off;
-					if(left<bytes) bytes=left;
-					memcpy(decodedblk+off, buf, bytes);
-					rb=bytes;
-				}
-				int e;
-				if((e=derive_key(header.key_len, header.key_data, header.key_size, derivedkey, header.key_stride, blk)))
-				{
-					fprintf(stderr, "Error on block %zu:\n", blk);
-					if(e<0) perror("derive_key");
-					else fprintf(stderr, "derive_key failed with code %d\n", e);
-					pthread_rwlock_unlock(&mx);
-					return(-EIO);
-				}
-				if((e=generate_newiv(block, block)))
-				{
-					fprintf(stderr, "Error on block %zu:\n", blk);
-					if(e<0) perror("generate_newiv");
-					else fprintf(stderr, "generate_newiv failed with code %d\n", e);
-					pthread_rwlock_unlock(&mx);
-					return(-EIO);
-				}
-				if((e=encrypt_sector(header.key_size, derivedkey, block, decodedblk, block+IV_LENGTH)))
-				{
-					fprintf(stderr, "Error on block %zu:\n", blk);
-					if(e<0) perror("encrypt_sector");
-					else fprintf(stderr, "encrypt_sector failed with code %d\n", e);
-					pthread_rwlock_unlock(&mx);
-					return(-EIO);
-				}
-				blk++;
-			}
-			pthread_rwlock_unlock(&mx);
-			return(rb);
+			perror("onionmount: trace_create (continuing without a trace)");
+			close(trace_fd);
 		}
-		case 2: // keystream
-		{
-			size_t blk=offset/KS_BLKLEN;
-			size_t rb=0;
-			pthread_rwlock_wrlock(&mx);
-			unsigned char derivedkey[header.key_size];
-			unsigned char decodedblk[SECTOR_LENGTH];
-			unsigned char keyblk[KS_BLKLEN];
-			while(rb<size)
-			{
-				if(blk>=nblk)
-					break;
-				size_t left=size-rb;
-				if(left>KS_BLKLEN) left=KS_BLKLEN;
-				size_t off=offset%KS_BLKLEN;
-				unsigned char *block=im+(blk+1)*BLOCK_LENGTH;
-				int e;
-				if((e=derive_key(header.key_len, header.key_data, header.key_size, derivedkey, header.key_stride, blk)))
-				{
-					fprintf(stderr, "Error on block %zu:\n", blk);
-					if(e<0) perror("derive_key");
-					else fprintf(stderr, "derive_key failed with code %d\n", e);
-					pthread_rwlock_unlock(&mx);
-					return(-EIO);
-				}
-				if((e=decrypt_sector(header.key_size, derivedkey, block, block+IV_LENGTH, decodedblk)))
-				{
-					fprintf(stderr, "Error on block %zu:\n", blk);
-					if(e<0) perror("decrypt_sector");
-					else fprintf(stderr, "decrypt_sector failed with code %d\n", e);
-					pthread_rwlock_unlock(&mx);
-					return(-EIO);
-				}
-				if((e=decode_keystream(block, keyblk)))
-				{
-					fprintf(stderr, "Error on block %zu:\n", blk);
-					if(e<0) perror("decode_keystream");
-					else fprintf(stderr, "decode_keystream failed with code %d\n", e);
-					pthread_rwlock_unlock(&mx);
-					return(-EIO);
-				}
-				if(rb)
-				{
-					memcpy(keyblk, buf+rb, left);
-					rb+=left;
-				}
-				else
-				{
-					size_t bytes=KS_BLKLEN-off;
-					if(left<bytes) bytes=left;
-					memcpy(keyblk+off, buf, bytes);
-					rb=bytes;
-				}
-				if((e=encode_keystream(keyblk, block)))
-				{
-					fprintf(stderr, "Error on block %zu:\n", blk);
-					if(e<0) perror("encode_keystream");
-					else fprintf(stderr, "encode_keystream failed with code %d\n", e);
-					pthread_rwlock_unlock(&mx);
-					return(-EIO);
-				}
-				if((e=encrypt_sector(header.key_size, derivedkey, block, decodedblk, block+IV_LENGTH)))
-				{
-					fprintf(stderr, "Error on block %zu:\n", blk);
-					if(e<0) perror("encrypt_sector");
-					else fprintf(stderr, "encrypt_sector failed with code %d\n", e);
-					pthread_rwlock_unlock(&mx);
-					return(-EIO);
-				}
-				blk++;
-			}
-			pthread_rwlock_unlock(&mx);
-			return(rb);
-		}
-		default:
-			return(-EBADF);
+		trace_fd=-1;
 	}
 }
 
-static struct fuse_operations onion_oper = {
+static void stop_threads(void)
+{
+	if(hup_running)
+	{
+		__atomic_store_n(&hup_stop, true, __ATOMIC_RELEASE);
+		pthread_kill(hup_thread, SIGHUP);
+		pthread_join(hup_thread, NULL);
+		hup_running=false;
+	}
+	image_stop(&image);
+	if(image.trace)
+	{
+		if(trace_close(image.trace))
+			perror("onionmount: trace_close");
+		image.trace=NULL;
+	}
+}
+
+static void onion_init(void *userdata, struct fuse_conn_info *conn)
+{
+	// big requests let the workers fan out, and the writeback cache merges the kernel's page-sized writes into them
+	conn->max_write=MAX_WRITE;
+	conn->want|=conn->capable&(FUSE_CAP_WRITEBACK_CACHE|FUSE_CAP_SPLICE_READ);
+	start_threads(); // here rather than in main(), since fuse_daemonize() forks and the threads wouldn't survive it
+}
+
+static void onion_destroy(void *userdata)
+{
+	stop_threads();
+}
+
+static const struct fuse_lowlevel_ops onion_oper = {
+	.init		= onion_init,
+	.destroy	= onion_destroy,
+	.lookup		= onion_lookup,
 	.getattr	= onion_getattr,
-	/*.access		= onion_access,
-	.readlink	= onion_readlink,*/
+	.setattr	= onion_setattr,
 	.readdir	= onion_readdir,
-	/*.mknod		= onion_mknod,
-	.mkdir		= onion_mkdir,
-	.symlink	= onion_symlink,
-	.unlink		= onion_unlink,
-	.rmdir		= onion_rmdir,
-	.rename		= onion_rename,
-	.link		= onion_link,
-	.chmod		= onion_chmod,
-	.chown		= onion_chown,*/
-	.truncate	= onion_truncate,
-	/*.utimens	= onion_utimens,*/
 	.open		= onion_open,
 	.read		= onion_read,
-	.write		= onion_write,
-	/*.statfs		= onion_statfs,
+	.write_buf	= onion_write_buf,
+	.flush		= onion_flush,
 	.release	= onion_release,
 	.fsync		= onion_fsync,
-	.setxattr	= onion_setxattr,
-	.getxattr	= onion_getxattr,
-	.listxattr	= onion_listxattr,
-	.removexattr= onion_removexattr,*/
 };
 
+static bool our_option(const char *arg)
+{
+	return(!strncmp(arg, "--workers=", 10)||!strncmp(arg, "--inline-max=", 13)||!strncmp(arg, "--layers=", 9)||!strncmp(arg, "--io=", 5)||!strncmp(arg, "--journal=", 10)||!strncmp(arg, "--nbd=", 6)||!strcmp(arg, "--nbd-keystream")||!strncmp(arg, "--trace=", 8)||!strncmp(arg, "--readahead=", 12)||!strncmp(arg, "--cache=", 8)||!strncmp(arg, "--stripe=", 9)||!strncmp(arg, "--stripe-chunk=", 15));
+}
+
 int main(int argc, char *argv[])
 {
-	if(argc<3)
+	if(argc<3) // with --nbd there's no mountpoint, but there is the option
 	{
-		fprintf(stderr, "Usage: onionmount <onion-image> <mountpoint> [options]\n");
+		fprintf(stderr, "Usage: onionmount <onion-image> <mountpoint> [--layers=N] [--io=mmap|window|pread|uring] [--journal=PATH] [--trace=PATH] [--workers=N] [--inline-max=BYTES] [--readahead=BYTES] [--cache=BYTES] [--stripe=PATH...] [--stripe-chunk=BYTES] [FUSE options]\n");
+		fprintf(stderr, "   or: onionmount <onion-image> --nbd=SOCKET [--nbd-keystream] [--layers=N] [--io=mmap|window|pread|uring] [--journal=PATH] [--trace=PATH] [--workers=N] [--inline-max=BYTES] [--readahead=BYTES] [--cache=BYTES] [--stripe=PATH...] [--stripe-chunk=BYTES]\n");
 		return(1);
 	}
-	uid=geteuid();
-	gid=getegid();
-	if(pthread_rwlock_init(&mx, NULL))
+	long ncpu=sysconf(_SC_NPROCESSORS_ONLN);
+	nworkers=ncpu>0?ncpu:0;
+	for(int arg=2;arg<argc;arg++)
 	{
-		perror("onionmount: pthread_rwlock_init");
-		return(1);
-	}
-	const char *img=argv[1];
-	struct stat st;
-	if(stat(img, &st))
-	{
-		fprintf(stderr, "onionmount: Failed to stat '%s'\n", img);
-		perror("\tstat");
-		pthread_rwlock_destroy(&mx);
-		return(1);
-	}
-	i_sz=st.st_size;
-	nblk=i_sz/BLOCK_LENGTH-1;
-	fprintf(stderr, "Image has %zu blocks\n", nblk);
-	int fd=open(img, O_RDWR);
-	if(fd<0)
-	{
-		perror("onionmount: open");
-		pthread_rwlock_destroy(&mx);
-		return(1);
-	}
-	if(flock(fd, LOCK_EX|LOCK_NB))
-	{
-		if(errno==EWOULDBLOCK)
+		if(strncmp(argv[arg], "--workers=", 10)==0)
 		{
-			fprintf(stderr, "onionmount: '%s' is locked by another process (flock: EWOULDBLOCK)\n", img);
+			if(sscanf(argv[arg]+10, "%u", &nworkers)!=1)
+			{
+				fprintf(stderr, "Bad --workers, `%s' not numeric\n", argv[arg]+10);
+				return(1);
+			}
+		}
+		else if(strncmp(argv[arg], "--inline-max=", 13)==0)
+		{
+			if(sscanf(argv[arg]+13, "%zu", &inline_max)!=1)
+			{
+				fprintf(stderr, "Bad --inline-max, `%s' not numeric\n", argv[arg]+13);
+				return(1);
+			}
+		}
+		else if(strncmp(argv[arg], "--readahead=", 12)==0)
+		{
+			if(sscanf(argv[arg]+12, "%zu", &readahead_max)!=1)
+			{
+				fprintf(stderr, "Bad --readahead, `%s' not numeric\n", argv[arg]+12);
+				return(1);
+			}
+		}
+		else if(strncmp(argv[arg], "--cache=", 8)==0)
+		{
+			if(sscanf(argv[arg]+8, "%zu", &cache_max)!=1)
+			{
+				fprintf(stderr, "Bad --cache, `%s' not numeric\n", argv[arg]+8);
+				return(1);
+			}
+		}
+		else if(strncmp(argv[arg], "--stripe=", 9)==0)
+		{
+			if(nmembers>=STRIPE_MAX)
+			{
+				fprintf(stderr, "Too many --stripe, at most %d files in all\n", STRIPE_MAX);
+				return(1);
+			}
+			members[nmembers++]=argv[arg]+9;
+		}
+		else if(strncmp(argv[arg], "--stripe-chunk=", 15)==0)
+		{
+			if(sscanf(argv[arg]+15, "%zu", &stripe_chunk)!=1||!stripe_chunk||stripe_chunk%BLOCK_LENGTH)
+			{
+				fprintf(stderr, "Bad --stripe-chunk, `%s' not a multiple of %d\n", argv[arg]+15, BLOCK_LENGTH);
+				return(1);
+			}
+		}
+		else if(strncmp(argv[arg], "--io=", 5)==0)
+		{
+			io_mode=argv[arg]+5;
+			if(strcmp(io_mode, "mmap")&&strcmp(io_mode, "window")&&strcmp(io_mode, "pread")&&strcmp(io_mode, "uring"))
+			{
+				fprintf(stderr, "Bad --io, `%s' should be mmap, window, pread or uring\n", io_mode);
+				return(1);
+			}
+		}
+		else if(strncmp(argv[arg], "--journal=", 10)==0)
+			journal_path=argv[arg]+10;
+		else if(strncmp(argv[arg], "--nbd=", 6)==0)
+			nbd_path=argv[arg]+6;
+		else if(strcmp(argv[arg], "--nbd-keystream")==0)
+			nbd_keystream=true;
+		else if(strncmp(argv[arg], "--trace=", 8)==0)
+		{
+			if(trace_fd>=0) close(trace_fd);
+			if((trace_fd=open(argv[arg]+8, O_WRONLY|O_CREAT|O_TRUNC, 0600))<0)
+			{
+				fprintf(stderr, "onionmount: Failed to open trace '%s'\n", argv[arg]+8);
+				perror("\topen");
+				return(1);
+			}
+		}
+		else if(strncmp(argv[arg], "--layers=", 9)==0)
+		{
+			if(sscanf(argv[arg]+9, "%zu", &nlayers)!=1)
+			{
+				fprintf(stderr, "Bad --layers, `%s' not numeric\n", argv[arg]+9);
+				return(1);
+			}
+			if(!nlayers||nlayers>IMAGE_MAX_LAYERS)
+			{
+				fprintf(stderr, "Bad --layers, must be between 1 and %d\n", IMAGE_MAX_LAYERS);
+				return(1);
+			}
 		}
-		else
-			perror("onionmount: flock");
-		pthread_rwlock_destroy(&mx);
-		return(1);
 	}
-	im=mmap(NULL, i_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, 0);
-	if(!im)
-	{
-		perror("onionmount: mmap");
-		flock(fd, LOCK_UN);
-		close(fd);
-		pthread_rwlock_destroy(&mx);
+	uid=geteuid();
+	gid=getegid();
+	// before any thread starts, so that they all inherit the mask and hup_loop() gets every SIGHUP (rather than FUSE's handler, which would unmount)
+	sigset_t hup;
+	sigemptyset(&hup);
+	sigaddset(&hup, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &hup, NULL);
+	enum image_io io=IO_WINDOW;
+	if(strcmp(io_mode, "mmap")==0) io=IO_MMAP;
+	else if(strcmp(io_mode, "pread")==0) io=IO_PREAD;
+	else if(strcmp(io_mode, "uring")==0) io=IO_URING;
+	members[0]=argv[1];
+	if(image_open_striped(&image, nmembers, members, stripe_chunk, io, journal_path))
 		return(1);
-	}
-	fprintf(stderr, "onionmount: '%s' mmap()ed in\n", img);
-	unsigned char headersector[SECTOR_LENGTH];
-	fprintf(stderr, "Enter your layer master passphrase (at most %u bytes will be used)\n", KEY_LENGTH_HIGH);
+	image.inline_max=inline_max;
+	image.readahead_max=readahead_max;
+	image.cache_max=cache_max;
+	int rv=EXIT_FAILURE;
 	unsigned char passphrase[KEY_LENGTH_HIGH+1];
-	memset(passphrase, 0, KEY_LENGTH_HIGH); // make sure it's initialised to all 0s
-	if(!fgets((char *)passphrase, KEY_LENGTH_HIGH+1, stdin))
+	char prompt[64];
+	while(image.nlayers<nlayers)
 	{
-		perror("Failed to read passphrase: fgets");
-		goto shutdown;
-	}
-	int e;
-	if((e=decrypt_sector(KEY_LENGTH_HIGH, passphrase, im, im+IV_LENGTH, headersector)))
-	{
-		if(e<0) perror("decrypt_sector");
-		else fprintf(stderr, "decrypt_sector failed with code %d\n", e);
-		goto shutdown;
+		if(nlayers>1)
+			snprintf(prompt, sizeof(prompt), "Enter the layer %zu master passphrase", image.nlayers+1);
+		else
+			snprintf(prompt, sizeof(prompt), "Enter your layer master passphrase");
+		if(image_get_passphrase(stdin, prompt, passphrase))
+		{
+			perror("Failed to read passphrase: fgets");
+			goto shutdown;
+		}
+		int e=image_unlock(&image, passphrase);
+		explicit_bzero(passphrase, sizeof(passphrase));
+		if(e)
+		{
+			fprintf(stderr, "onionmount: failed to unlock layer %zu\n", image.nlayers+1);
+			goto shutdown;
+		}
+		if(image.nlayers==1) // only now do we know the format, and so how many of the image's blocks hold sectors, as mkonion and onionresize count them
+		{
+			unsigned int format=image.layers[0].format;
+			fprintf(stderr, "Image has %zu blocks%s\n", format_blocks(format, image.size), format==FORMAT_CLUSTERED?", in clusters":"");
+		}
+		else
+			fprintf(stderr, "Layer %zu has %zu blocks\n", image.nlayers, image.layers[image.nlayers-1].nblk);
 	}
-	size_t blocklength=read32be(headersector);
-	if(blocklength!=BLOCK_LENGTH)
+	
+	if(nbd_path)
 	{
-		fprintf(stderr, "Bad image: blocklength is %zu, expected %zu\n", blocklength, BLOCK_LENGTH);
+		start_threads();
+		if(nbd_serve(nbd_path, &image, nbd_keystream))
+			perror("onionmount: nbd_serve");
+		else
+			rv=EXIT_SUCCESS;
+		stop_threads();
 		goto shutdown;
 	}
-	header.key_size=read32be(headersector+0x4);
-	header.key_len=read32be(headersector+0x8);
-	header.key_stride=read32be(headersector+0xC);
-	header.key_data=headersector+0x10;
-	
-	int rv=EXIT_FAILURE;
-	int fargc=argc-1;
-	char **fargv=(char **)malloc(fargc*sizeof(char *));
+	int fargc=1;
+	char **fargv=(char **)malloc(argc*sizeof(char *));
 	fargv[0]=argv[0];
-	for(int i=1;i<fargc;i++)
-		fargv[i]=argv[i+1];
+	for(int i=2;i<argc;i++) // pass everything but the image and our own options on to FUSE
+		if(!our_option(argv[i]))
+			fargv[fargc++]=argv[i];
 	
-	rv=fuse_main(fargc, fargv, &onion_oper, NULL);
+	struct fuse_args args=FUSE_ARGS_INIT(fargc, fargv);
+	struct fuse_cmdline_opts opts;
+	if(fuse_parse_cmdline(&args, &opts)==0)
+	{
+		struct fuse_session *se=NULL;
+		if(opts.show_help)
+		{
+			fuse_cmdline_help();
+			fuse_lowlevel_help();
+			rv=EXIT_SUCCESS;
+		}
+		else if(!opts.mountpoint)
+			fprintf(stderr, "onionmount: no mountpoint given\n");
+		else if(!(session=se=fuse_session_new(&args, &onion_oper, sizeof(onion_oper), NULL)))
+			fprintf(stderr, "onionmount: fuse_session_new failed\n");
+		else if(fuse_set_signal_handlers(se))
+			fprintf(stderr, "onionmount: fuse_set_signal_handlers failed\n");
+		else
+		{
+			if(fuse_session_mount(se, opts.mountpoint))
+				fprintf(stderr, "onionmount: fuse_session_mount failed\n");
+			else
+			{
+				fuse_daemonize(opts.foreground);
+				// -s for one thread; otherwise requests are spread over threads, each with its own /dev/fuse fd if -o clone_fd
+				int e=opts.singlethread?fuse_session_loop(se):fuse_session_loop_mt(se, opts.clone_fd);
+				rv=e?EXIT_FAILURE:EXIT_SUCCESS;
+				fuse_session_unmount(se);
+			}
+			fuse_remove_signal_handlers(se);
+		}
+		if(se) fuse_session_destroy(se);
+		free(opts.mountpoint);
+	}
+	fuse_opt_free_args(&args);
+	free(fargv);
 	shutdown:
-	pthread_rwlock_wrlock(&mx);
-	munmap(im, i_sz);
-	flock(fd, LOCK_UN);
-	close(fd);
-	pthread_rwlock_unlock(&mx);
-	pthread_rwlock_destroy(&mx);
+	if(trace_fd>=0) close(trace_fd); // never started
+	image_close(&image);
 	return(rv);
 }
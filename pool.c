@@ -0,0 +1,185 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	pool.c: bounded worker pool for fanning out crypto work
+*/
+
+#include "pool.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+// A group is one pool_run() call; its items are claimed one at a time by whoever gets there first, including the caller, so a group always completes even if every worker is busy
+struct group
+{
+	void (*fn)(void *arg, size_t i);
+	void *arg;
+	size_t n, next, done;
+	struct group *qnext;
+	pthread_cond_t finished;
+};
+
+struct pool
+{
+	pthread_mutex_t lock;
+	pthread_cond_t work; // signalled when a group is queued
+	struct group *head, *tail; // groups with unclaimed items
+	bool stopping;
+	unsigned int nthreads;
+	pthread_t threads[];
+};
+
+static bool claim(struct pool *p, struct group *g, size_t *i) // called with p->lock held
+{
+	if(g->next>=g->n) return(false);
+	*i=g->next++;
+	if(g->next==g->n) // nothing left to hand out, so take it off the queue
+	{
+		struct group **gp=&p->head, *prev=NULL;
+		while(*gp&&*gp!=g)
+		{
+			prev=*gp;
+			gp=&(*gp)->qnext;
+		}
+		if(*gp)
+		{
+			*gp=g->qnext;
+			if(p->tail==g) p->tail=prev;
+		}
+	}
+	return(true);
+}
+
+static void finish(struct group *g) // called with p->lock held
+{
+	if(++g->done==g->n)
+		pthread_cond_signal(&g->finished);
+}
+
+static void *worker(void *arg)
+{
+	struct pool *p=arg;
+	pthread_mutex_lock(&p->lock);
+	while(true)
+	{
+		while(!p->head&&!p->stopping)
+			pthread_cond_wait(&p->work, &p->lock);
+		if(!p->head) break;
+		struct group *g=p->head;
+		size_t i;
+		if(!claim(p, g, &i)) continue;
+		pthread_mutex_unlock(&p->lock);
+		g->fn(g->arg, i);
+		pthread_mutex_lock(&p->lock);
+		finish(g);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return(NULL);
+}
+
+struct pool *pool_create(unsigned int nthreads)
+{
+	struct pool *p=malloc(sizeof(struct pool)+nthreads*sizeof(pthread_t));
+	if(!p) return(NULL);
+	p->head=p->tail=NULL;
+	p->stopping=false;
+	p->nthreads=0;
+	if(pthread_mutex_init(&p->lock, NULL))
+	{
+		free(p);
+		return(NULL);
+	}
+	if(pthread_cond_init(&p->work, NULL))
+	{
+		pthread_mutex_destroy(&p->lock);
+		free(p);
+		return(NULL);
+	}
+	for(unsigned int t=0;t<nthreads;t++)
+	{
+		int e=pthread_create(p->threads+t, NULL, worker, p);
+		if(e)
+		{
+			pool_destroy(p);
+			errno=e;
+			return(NULL);
+		}
+		p->nthreads++;
+	}
+	return(p);
+}
+
+void pool_destroy(struct pool *p)
+{
+	if(!p) return;
+	pthread_mutex_lock(&p->lock);
+	p->stopping=true;
+	pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->lock);
+	for(unsigned int t=0;t<p->nthreads;t++)
+		pthread_join(p->threads[t], NULL);
+	pthread_cond_destroy(&p->work);
+	pthread_mutex_destroy(&p->lock);
+	free(p);
+}
+
+void pool_run(struct pool *p, size_t n, void (*fn)(void *arg, size_t i), void *arg)
+{
+	if(!n) return;
+	if(!p||n==1)
+	{
+		for(size_t i=0;i<n;i++)
+			fn(arg, i);
+		return;
+	}
+	struct group g={.fn=fn, .arg=arg, .n=n, .next=0, .done=0, .qnext=NULL};
+	pthread_cond_init(&g.finished, NULL);
+	pthread_mutex_lock(&p->lock);
+	if(p->tail)
+		p->tail->qnext=&g;
+	else
+		p->head=&g;
+	p->tail=&g;
+	pthread_cond_broadcast(&p->work);
+	size_t i;
+	while(claim(p, &g, &i))
+	{
+		pthread_mutex_unlock(&p->lock);
+		fn(arg, i);
+		pthread_mutex_lock(&p->lock);
+		finish(&g);
+	}
+	while(g.done<g.n)
+		pthread_cond_wait(&g.finished, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+	pthread_cond_destroy(&g.finished);
+}
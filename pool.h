@@ -0,0 +1,41 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	pool.h: bounded worker pool for fanning out crypto work
+*/
+
+#include <stddef.h>
+
+struct pool;
+
+struct pool *pool_create(unsigned int nthreads); // starts nthreads worker threads.  Returns NULL with errno set on failure
+void pool_destroy(struct pool *p); // stops and joins the workers; nothing may be running on the pool
+void pool_run(struct pool *p, size_t n, void (*fn)(void *arg, size_t i), void *arg); // calls fn(arg, i) for each i in [0,n), spread across the workers and the calling thread, and returns when all are done
@@ -0,0 +1,224 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	readahead.c: detecting sequential readers and decrypting ahead of them
+*/
+
+#include "readahead.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+static void *readahead_thread(void *arg)
+{
+	struct readahead *ra=arg;
+	pthread_mutex_lock(&ra->mx);
+	for(;;)
+	{
+		while(!ra->head&&!ra->stop)
+			pthread_cond_wait(&ra->cond, &ra->mx);
+		struct ra_stream *s=ra->head;
+		if(!s)
+			break;
+		if(!(ra->head=s->qnext))
+			ra->tail=NULL;
+		pthread_mutex_unlock(&ra->mx);
+		// busy, so pos can't move and nobody else writes past len
+		ssize_t rv=layer_read(s->l, s->f, s->buf+(s->fill_pos-s->pos), s->fill_len, s->fill_pos);
+		pthread_mutex_lock(&s->mx);
+		// if a write came in meanwhile, what was read may be stale (and the readers will have thrown away the rest of buf)
+		if(rv>0&&s->fill_gen==s->buf_gen&&s->fill_gen==__atomic_load_n(s->gen, __ATOMIC_ACQUIRE))
+		{
+			s->len+=rv;
+			stats_add(s->l->stats, STAT_READAHEAD_BYTES, rv);
+		}
+		s->busy=false;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->mx);
+		pthread_mutex_lock(&ra->mx);
+	}
+	pthread_mutex_unlock(&ra->mx);
+	return(NULL);
+}
+
+struct readahead *readahead_create(unsigned int nthreads)
+{
+	struct readahead *ra=malloc(sizeof(*ra)+nthreads*sizeof(pthread_t));
+	if(!ra)
+		return(NULL);
+	pthread_mutex_init(&ra->mx, NULL);
+	pthread_cond_init(&ra->cond, NULL);
+	ra->head=ra->tail=NULL;
+	ra->stop=false;
+	for(ra->nthreads=0;ra->nthreads<nthreads;ra->nthreads++)
+	{
+		int e=pthread_create(ra->threads+ra->nthreads, NULL, readahead_thread, ra);
+		if(e)
+		{
+			readahead_destroy(ra);
+			errno=e;
+			return(NULL);
+		}
+	}
+	return(ra);
+}
+
+void readahead_destroy(struct readahead *ra)
+{
+	pthread_mutex_lock(&ra->mx);
+	ra->stop=true;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->mx);
+	for(unsigned int i=0;i<ra->nthreads;i++)
+		pthread_join(ra->threads[i], NULL);
+	pthread_mutex_destroy(&ra->mx);
+	pthread_cond_destroy(&ra->cond);
+	free(ra);
+}
+
+struct ra_stream *ra_stream_open(struct layer *l, enum onion_file f, const uint64_t *gen, size_t max)
+{
+	struct ra_stream *s=calloc(1, sizeof(*s));
+	if(!s)
+		return(NULL);
+	s->l=l;
+	s->f=f;
+	s->gen=gen;
+	s->max=max;
+	s->window=READAHEAD_MIN<max?READAHEAD_MIN:max;
+	pthread_mutex_init(&s->mx, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	return(s);
+}
+
+// Called with s->mx held and no fill in flight, after a read that ended at s->next
+static void ra_stream_fill(struct ra_stream *s, struct readahead *ra, size_t pos, size_t fsize)
+{
+	if(!s->len||s->pos+s->len<s->next) // the reader has overtaken buf (or there isn't one), so start again from it
+	{
+		s->pos=s->next;
+		s->len=0;
+	}
+	size_t end=s->pos+s->len;
+	if(end>=fsize||end-s->next>=s->window/2)
+		return;
+	if(!s->buf&&!(s->buf=malloc(2*s->max)))
+		return;
+	if(pos>s->pos) // nothing before this read will be wanted again
+	{
+		size_t drop=pos-s->pos<s->len?pos-s->pos:s->len;
+		memmove(s->buf, s->buf+drop, s->len-drop);
+		s->pos+=drop;
+		s->len-=drop;
+	}
+	size_t room=2*s->max-s->len;
+	s->fill_pos=end;
+	s->fill_len=s->window<room?s->window:room;
+	if(s->fill_len>fsize-end) s->fill_len=fsize-end;
+	if(!s->fill_len)
+		return;
+	s->fill_gen=s->buf_gen;
+	s->busy=true;
+	if(s->window<s->max)
+		s->window=s->window*2<s->max?s->window*2:s->max;
+	s->qnext=NULL;
+	pthread_mutex_lock(&ra->mx);
+	if(ra->tail)
+		ra->tail->qnext=s;
+	else
+		ra->head=s;
+	ra->tail=s;
+	pthread_cond_signal(&ra->cond);
+	pthread_mutex_unlock(&ra->mx);
+}
+
+ssize_t ra_stream_read(struct ra_stream *s, struct readahead *ra, unsigned char *buf, size_t size, size_t pos)
+{
+	size_t fsize=layer_size(s->l, s->f);
+	if(!s->max||pos>=fsize)
+		return(layer_read(s->l, s->f, buf, size, pos));
+	if(size>fsize-pos) size=fsize-pos;
+	pthread_mutex_lock(&s->mx);
+	bool sequential=pos+size+READAHEAD_NEAR>s->next&&pos<s->next+READAHEAD_NEAR;
+	if(sequential)
+	{
+		if(s->seq<READAHEAD_TRIGGER) s->seq++;
+	}
+	else
+	{
+		s->seq=0;
+		s->window=READAHEAD_MIN<s->max?READAHEAD_MIN:s->max;
+	}
+	if(!sequential||pos+size>s->next)
+		s->next=pos+size;
+	ssize_t rv=-1;
+	for(;;)
+	{
+		uint64_t gen=__atomic_load_n(s->gen, __ATOMIC_ACQUIRE);
+		if(s->buf_gen!=gen) // written to since buf was filled
+		{
+			s->buf_gen=gen;
+			s->len=0;
+		}
+		if(pos>=s->pos&&pos+size<=s->pos+s->len)
+		{
+			memcpy(buf, s->buf+(pos-s->pos), size);
+			stats_add(s->l->stats, STAT_READAHEAD_HITS, 1);
+			rv=size;
+			break;
+		}
+		if(!s->busy||pos<s->pos||pos+size>s->fill_pos+s->fill_len||s->fill_gen!=s->buf_gen)
+			break;
+		pthread_cond_wait(&s->cond, &s->mx); // the fill in flight has it
+	}
+	if(rv<0)
+	{
+		pthread_mutex_unlock(&s->mx);
+		rv=layer_read(s->l, s->f, buf, size, pos);
+		pthread_mutex_lock(&s->mx);
+	}
+	if(ra&&rv>=0&&s->seq>=READAHEAD_TRIGGER&&!s->busy)
+		ra_stream_fill(s, ra, pos, fsize);
+	pthread_mutex_unlock(&s->mx);
+	return(rv);
+}
+
+void ra_stream_close(struct ra_stream *s)
+{
+	pthread_mutex_lock(&s->mx);
+	while(s->busy)
+		pthread_cond_wait(&s->cond, &s->mx);
+	pthread_mutex_unlock(&s->mx);
+	pthread_mutex_destroy(&s->mx);
+	pthread_cond_destroy(&s->cond);
+	free(s->buf);
+	free(s);
+}
@@ -0,0 +1,89 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	readahead.h: detecting sequential readers and decrypting ahead of them
+*/
+
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "layer.h"
+
+#define READAHEAD_MIN		(128<<10) // window of a stream's first fill; it doubles with each fill after that
+#define READAHEAD_MAX		(4<<20) // default ceiling for the window; a stream's buffer is twice its ceiling
+#define READAHEAD_NEAR		READAHEAD_MIN // a read this close to where the last one ended still counts as sequential, as the kernel's readahead may send requests a little out of order
+#define READAHEAD_TRIGGER	2 // sequential reads in a row before the first fill
+#define READAHEAD_THREADS	2
+
+// Threads that do the streams' fills, in the order they were queued
+struct readahead
+{
+	pthread_mutex_t mx;
+	pthread_cond_t cond;
+	struct ra_stream *head, *tail;
+	bool stop;
+	unsigned int nthreads;
+	pthread_t threads[];
+};
+
+/* One reader of a layer's file (in onionmount, one open file).  buf holds the decrypted bytes [pos, pos+len) of the file, and is good for as long as *gen is still buf_gen; so every write that could change the file must bump *gen once it's done.
+	A fill reads [fill_pos, fill_pos+fill_len), which starts at pos+len, into buf past len without holding mx.  While one is in flight (busy) nothing else moves buf, and readers that want what it's fetching wait on cond */
+struct ra_stream
+{
+	struct layer *l;
+	enum onion_file f;
+	const uint64_t *gen;
+	size_t max; // ceiling for window; 0 turns the readahead off
+	pthread_mutex_t mx;
+	pthread_cond_t cond;
+	size_t next; // where the last read ended
+	unsigned int seq; // sequential reads in a row
+	size_t window; // bytes to fetch at the next fill
+	unsigned char *buf; // [2*max], allocated at the first fill
+	size_t pos, len;
+	uint64_t buf_gen;
+	bool busy;
+	size_t fill_pos, fill_len;
+	uint64_t fill_gen;
+	struct ra_stream *qnext; // in the readahead's queue
+};
+
+struct readahead *readahead_create(unsigned int nthreads); // NULL with errno set on failure
+void readahead_destroy(struct readahead *ra); // does the fills already queued, then stops the threads
+struct ra_stream *ra_stream_open(struct layer *l, enum onion_file f, const uint64_t *gen, size_t max); // NULL with errno set on failure
+ssize_t ra_stream_read(struct ra_stream *s, struct readahead *ra, unsigned char *buf, size_t size, size_t pos); // as layer_read(), but served from buf where it can; once s looks sequential, each read queues a fill on ra (if not NULL) when what's left ahead of the reader runs below half the window
+void ra_stream_close(struct ra_stream *s); // waits for a fill in flight, and frees s
+
+#endif // READAHEAD_H
@@ -0,0 +1,399 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	replay.c: replay a trace recorded by onionmount --trace, against an image or a live mount, and report throughput and latency
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "libonion.h"
+#include "bits.h"
+#include "trace.h"
+
+#define REPLAY_THREADS	8 // default; with the original timing, enough to keep up with the requests that were in flight together
+#define NCLASSES		4 // data/keystream x read/write, indexed by a record's flags
+
+static const char *class_name[NCLASSES]={"data_read", "data_write", "keystream_read", "keystream_write"};
+
+struct replay
+{
+	struct trace_record *rec;
+	size_t nrec, next; // next is claimed with an atomic add
+	uint64_t *lat_ns; // [nrec]
+	bool *failed; // [nrec]
+	bool max_speed;
+	uint64_t start; // CLOCK_MONOTONIC ns at which the trace's time 0 is replayed
+	size_t maxsize;
+	unsigned char *wdata; // [maxsize] of random bytes, for the writes
+	struct onion_image *im; // replaying against the block engine, or...
+	int fd[IMAGE_MAX_LAYERS][2]; // ... against the files of a mount
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec*(uint64_t)1000000000+ts.tv_nsec);
+}
+
+static void sleep_until(uint64_t t)
+{
+	struct timespec ts={.tv_sec=t/1000000000, .tv_nsec=t%1000000000};
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)==EINTR);
+}
+
+static void *replay_thread(void *arg)
+{
+	struct replay *r=arg;
+	unsigned char *buf=malloc(r->maxsize?r->maxsize:1);
+	if(!buf)
+	{
+		perror("replay_thread: malloc");
+		return(NULL);
+	}
+	size_t i;
+	while((i=__atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED))<r->nrec)
+	{
+		const struct trace_record *t=r->rec+i;
+		bool write=t->flags&TRACE_WRITE;
+		enum onion_file f=t->flags&TRACE_KEYSTREAM?ONION_KEYSTREAM:ONION_DATA;
+		uint64_t t0;
+		if(r->max_speed)
+			t0=now_ns();
+		else // timed from when it was due, so that if the threads fall behind, the wait shows up in its latency rather than vanishing
+		{
+			t0=r->start+t->t_ns;
+			sleep_until(t0);
+		}
+		ssize_t n;
+		if(r->im)
+			n=write?image_write(r->im, t->layer-1, f, r->wdata, t->size, t->pos):image_read(r->im, t->layer-1, f, buf, t->size, t->pos);
+		else
+		{
+			int fd=r->fd[t->layer-1][f];
+			n=write?pwrite(fd, r->wdata, t->size, t->pos):pread(fd, buf, t->size, t->pos);
+		}
+		r->lat_ns[i]=now_ns()-t0;
+		r->failed[i]=n<0;
+	}
+	free(buf);
+	return(NULL);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x=*(const uint64_t *)a, y=*(const uint64_t *)b;
+	return(x<y?-1:x>y);
+}
+
+// Latency percentile p (0-100) of the n sorted values in v, in microseconds
+static double pct(const uint64_t *v, size_t n, double p)
+{
+	if(!n) return(0);
+	size_t i=(size_t)(p/100*(n-1)+0.5);
+	return(v[i]/1e3);
+}
+
+// Reads the whole trace into memory.  Returns the number of records, or -1 (having said why)
+static ssize_t load_trace(const char *path, struct trace_record **recp)
+{
+	int fd=open(path, O_RDONLY);
+	if(fd<0)
+	{
+		fprintf(stderr, "onionreplay: Failed to open trace '%s'\n", path);
+		perror("\topen");
+		return(-1);
+	}
+	struct stat st;
+	int e;
+	if(fstat(fd, &st))
+	{
+		perror("onionreplay: fstat");
+		close(fd);
+		return(-1);
+	}
+	if((e=trace_read_header(fd, NULL)))
+	{
+		if(e<0) perror("onionreplay: trace_read_header");
+		else fprintf(stderr, "onionreplay: '%s' isn't a trace (or is from a different version)\n", path);
+		close(fd);
+		return(-1);
+	}
+	size_t n=(st.st_size-TRACE_HEADER_LENGTH)/TRACE_RECORD_LENGTH, len=n*TRACE_RECORD_LENGTH;
+	unsigned char *raw=malloc(len?len:1);
+	struct trace_record *rec=malloc(n?n*sizeof(*rec):1);
+	if(!raw||!rec)
+	{
+		perror("onionreplay: malloc");
+		free(raw);
+		free(rec);
+		close(fd);
+		return(-1);
+	}
+	ssize_t got=readall(fd, raw, len);
+	close(fd);
+	if(got!=(ssize_t)len)
+	{
+		if(got<0) perror("onionreplay: read");
+		else fprintf(stderr, "onionreplay: trace shrank while being read\n");
+		free(raw);
+		free(rec);
+		return(-1);
+	}
+	for(size_t i=0;i<n;i++)
+		trace_decode(raw+i*TRACE_RECORD_LENGTH, rec+i);
+	free(raw);
+	*recp=rec;
+	return(n);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *trace_path=NULL, *img=NULL, *mount=NULL, *journal_path=NULL, *io_mode="window";
+	unsigned int nthreads=REPLAY_THREADS;
+	long ncpu=sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int nworkers=ncpu>0?ncpu:0;
+	bool max_speed=false;
+	for(int arg=1;arg<argc;arg++)
+	{
+		if(strncmp(argv[arg], "--mount=", 8)==0)
+			mount=argv[arg]+8;
+		else if(strcmp(argv[arg], "--max-speed")==0)
+			max_speed=true;
+		else if(strncmp(argv[arg], "--threads=", 10)==0)
+		{
+			if(sscanf(argv[arg]+10, "%u", &nthreads)!=1||!nthreads)
+			{
+				fprintf(stderr, "Bad --threads, `%s' not a positive number\n", argv[arg]+10);
+				return(1);
+			}
+		}
+		else if(strncmp(argv[arg], "--workers=", 10)==0)
+		{
+			if(sscanf(argv[arg]+10, "%u", &nworkers)!=1)
+			{
+				fprintf(stderr, "Bad --workers, `%s' not numeric\n", argv[arg]+10);
+				return(1);
+			}
+		}
+		else if(strncmp(argv[arg], "--io=", 5)==0)
+		{
+			io_mode=argv[arg]+5;
+			if(strcmp(io_mode, "mmap")&&strcmp(io_mode, "window")&&strcmp(io_mode, "pread")&&strcmp(io_mode, "uring"))
+			{
+				fprintf(stderr, "Bad --io, `%s' should be mmap, window, pread or uring\n", io_mode);
+				return(1);
+			}
+		}
+		else if(strncmp(argv[arg], "--journal=", 10)==0)
+			journal_path=argv[arg]+10;
+		else if(!trace_path)
+			trace_path=argv[arg];
+		else
+			img=argv[arg];
+	}
+	if(!trace_path||!img==!mount)
+	{
+		fprintf(stderr, "Usage: onionreplay <trace> <onion-image> [--io=mmap|window|pread|uring] [--journal=PATH] [--workers=N] [--threads=N] [--max-speed]\n");
+		fprintf(stderr, "   or: onionreplay <trace> --mount=DIR [--threads=N] [--max-speed]\n");
+		fprintf(stderr, "Writes are replayed with random data, so use a copy of the image!\n");
+		return(1);
+	}
+	struct replay r={.max_speed=max_speed};
+	ssize_t n=load_trace(trace_path, &r.rec);
+	if(n<0)
+		return(1);
+	r.nrec=n;
+	size_t nlayers=0;
+	bool used[IMAGE_MAX_LAYERS][2];
+	memset(used, 0, sizeof(used));
+	for(size_t i=0;i<r.nrec;i++)
+	{
+		if(!r.rec[i].layer||r.rec[i].layer>IMAGE_MAX_LAYERS)
+		{
+			fprintf(stderr, "onionreplay: record %zu is for layer %u, which can't be\n", i, r.rec[i].layer);
+			return(1);
+		}
+		if(r.rec[i].layer>nlayers) nlayers=r.rec[i].layer;
+		used[r.rec[i].layer-1][r.rec[i].flags&TRACE_KEYSTREAM?ONION_KEYSTREAM:ONION_DATA]=true;
+		if(r.rec[i].size>r.maxsize) r.maxsize=r.rec[i].size;
+	}
+	fprintf(stderr, "Trace has %zu requests to %zu layers\n", r.nrec, nlayers);
+	if(!(r.lat_ns=calloc(r.nrec?r.nrec:1, sizeof(*r.lat_ns)))||!(r.failed=calloc(r.nrec?r.nrec:1, sizeof(*r.failed)))||!(r.wdata=malloc(r.maxsize?r.maxsize:1)))
+	{
+		perror("onionreplay: malloc");
+		return(1);
+	}
+	int e;
+	if((e=random_bytes(r.maxsize, r.wdata)))
+	{
+		if(e<0) perror("random_bytes");
+		else fprintf(stderr, "random_bytes failed with code %d\n", e);
+		return(1);
+	}
+	struct onion_image im;
+	int rv=1;
+	for(size_t li=0;li<IMAGE_MAX_LAYERS;li++)
+		r.fd[li][0]=r.fd[li][1]=-1;
+	if(img)
+	{
+		enum image_io io=IO_WINDOW;
+		if(strcmp(io_mode, "mmap")==0) io=IO_MMAP;
+		else if(strcmp(io_mode, "pread")==0) io=IO_PREAD;
+		else if(strcmp(io_mode, "uring")==0) io=IO_URING;
+		if(image_open(&im, img, io, journal_path))
+			return(1);
+		r.im=&im;
+		unsigned char passphrase[KEY_LENGTH_HIGH+1];
+		char prompt[64];
+		while(im.nlayers<nlayers)
+		{
+			if(nlayers>1)
+				snprintf(prompt, sizeof(prompt), "Enter the layer %zu master passphrase", im.nlayers+1);
+			else
+				snprintf(prompt, sizeof(prompt), "Enter your layer master passphrase");
+			if(image_get_passphrase(stdin, prompt, passphrase))
+			{
+				perror("Failed to read passphrase: fgets");
+				goto out;
+			}
+			e=image_unlock(&im, passphrase);
+			explicit_bzero(passphrase, sizeof(passphrase));
+			if(e)
+			{
+				fprintf(stderr, "onionreplay: failed to unlock layer %zu\n", im.nlayers+1);
+				goto out;
+			}
+		}
+		image_start(&im, nworkers);
+	}
+	else
+	{
+		// a mount of one layer has its files at the top; of several, in numbered directories
+		char path[4096];
+		struct stat st;
+		snprintf(path, sizeof(path), "%s/1/data", mount);
+		bool layered=!stat(path, &st);
+		for(size_t li=0;li<nlayers;li++)
+			for(int f=0;f<2;f++)
+			{
+				if(!used[li][f])
+					continue;
+				if(layered)
+					snprintf(path, sizeof(path), "%s/%zu/%s", mount, li+1, f==ONION_DATA?"data":"keystream");
+				else if(li)
+				{
+					fprintf(stderr, "onionreplay: the trace has layer %zu, but '%s' only has one\n", li+1, mount);
+					goto out;
+				}
+				else
+					snprintf(path, sizeof(path), "%s/%s", mount, f==ONION_DATA?"data":"keystream");
+				if((r.fd[li][f]=open(path, O_RDWR))<0)
+				{
+					fprintf(stderr, "onionreplay: Failed to open '%s'\n", path);
+					perror("\topen");
+					goto out;
+				}
+			}
+	}
+	pthread_t *threads=malloc(nthreads*sizeof(*threads));
+	if(!threads)
+	{
+		perror("onionreplay: malloc");
+		goto out;
+	}
+	unsigned int started;
+	r.start=now_ns();
+	for(started=0;started<nthreads;started++)
+		if((e=pthread_create(threads+started, NULL, replay_thread, &r)))
+		{
+			errno=e;
+			perror("onionreplay: pthread_create");
+			break;
+		}
+	for(unsigned int i=0;i<started;i++)
+		pthread_join(threads[i], NULL);
+	double wall=(now_ns()-r.start)/1e9;
+	free(threads);
+	if(!started)
+		goto out;
+	if(r.next<r.nrec) // the threads gave up early
+	{
+		fprintf(stderr, "onionreplay: only replayed %zu of %zu requests\n", r.next, r.nrec);
+		goto out;
+	}
+	// Tab-separated, one line per kind of request and one for the lot; latencies are in microseconds
+	printf("# op\tcount\terrors\tMB\tMB/s\tops/s\tp50\tp90\tp99\tp99.9\tmax\n");
+	uint64_t *lat=malloc((r.nrec?r.nrec:1)*sizeof(*lat));
+	if(!lat)
+	{
+		perror("onionreplay: malloc");
+		goto out;
+	}
+	for(int c=0;c<=NCLASSES;c++) // NCLASSES is all of them
+	{
+		size_t m=0, errors=0;
+		uint64_t bytes=0;
+		for(size_t i=0;i<r.nrec;i++)
+			if(c==NCLASSES||r.rec[i].flags==c)
+			{
+				lat[m++]=r.lat_ns[i];
+				bytes+=r.rec[i].size;
+				if(r.failed[i]) errors++;
+			}
+		if(!m)
+			continue;
+		qsort(lat, m, sizeof(*lat), cmp_u64);
+		printf("%s\t%zu\t%zu\t%.1f\t%.1f\t%.0f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n", c<NCLASSES?class_name[c]:"all", m, errors, bytes/1e6, bytes/wall/1e6, m/wall, pct(lat, m, 50), pct(lat, m, 90), pct(lat, m, 99), pct(lat, m, 99.9), lat[m-1]/1e3);
+	}
+	free(lat);
+	fprintf(stderr, "Replayed in %.2fs%s\n", wall, max_speed?" (as fast as possible)":"");
+	rv=0;
+	out:
+	if(r.im)
+		image_close(r.im);
+	for(size_t li=0;li<IMAGE_MAX_LAYERS;li++)
+		for(int f=0;f<2;f++)
+			if(r.fd[li][f]>=0) close(r.fd[li][f]);
+	free(r.rec);
+	free(r.lat_ns);
+	free(r.failed);
+	free(r.wdata);
+	return(rv);
+}
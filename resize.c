@@ -0,0 +1,482 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	resize.c: grows an onion image, initialising the new blocks, and tells the onionmount using it
+*/
+
+#define _GNU_SOURCE // for F_OFD_SETLK
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "libonion.h"
+
+#define JOB_LENGTH	(1<<20) // bytes of the image a thread fills and writes at a time; a whole number of blocks and of clusters
+
+// The new tail is cut into jobs of JOB_LENGTH, claimed in turn by the threads
+struct grow
+{
+	int fd;
+	const struct layer *l; // layer 1, unlocked on the old size, for its format and sector keys
+	size_t old_size, new_size; // of the image file, in bytes
+	size_t old_nblk, new_nblk;
+	size_t lo; // where the first job starts: old_size rounded down to a block (or cluster), so that no job splits one
+	size_t njobs, next_job; // next_job is claimed with an atomic increment
+	bool fast; // leave the new blocks random instead of encrypting blank sectors
+	bool failed; // if set, everyone gives up
+};
+
+static const unsigned char blanksector[SECTOR_LENGTH];
+
+// The first block whose IV is at or after off, which is a block (or cluster) boundary past the header
+static size_t block_at(unsigned int format, size_t off)
+{
+	if(format==FORMAT_CLUSTERED)
+		return((off/CLUSTER_LENGTH-1)*CLUSTER_BLOCKS);
+	return(off/BLOCK_LENGTH-1);
+}
+
+// Fills image bytes from to to (clipped to the job's lo to hi) of buf with random bytes
+static int random_range(unsigned char *buf, size_t lo, size_t hi, size_t from, size_t to)
+{
+	if(from<lo) from=lo;
+	if(to>hi) to=hi;
+	if(from>=to) return(0);
+	return(random_bytes(to-from, buf+(from-lo)));
+}
+
+// Fills image bytes lo to hi into buf, the same as mkonion would have; the old blocks (in the first job) are left alone
+static int fill_job(const struct grow *g, size_t lo, size_t hi, unsigned char *buf)
+{
+	unsigned int format=g->l->format;
+	int e;
+	if(g->fast)
+		e=random_bytes(hi-lo, buf);
+	else
+	{
+		// beyond the last block, and the last cluster's unused IV slots, are random padding
+		size_t last=g->new_nblk-1;
+		e=random_range(buf, lo, hi, sector_offset(format, last)+SECTOR_LENGTH, hi);
+		if(!e&&format==FORMAT_CLUSTERED)
+			e=random_range(buf, lo, hi, iv_offset(format, last)+IV_LENGTH, iv_offset(format, last-last%CLUSTER_BLOCKS)+BLOCK_LENGTH);
+	}
+	if(e)
+	{
+		if(e<0) perror("random_bytes");
+		else fprintf(stderr, "random_bytes failed with code %d\n", e);
+		return(1);
+	}
+	if(g->fast)
+		return(0);
+	size_t b=block_at(format, lo);
+	if(b<g->old_nblk) b=g->old_nblk;
+	struct sector_op ops[SECTOR_BATCH];
+	while(b<g->new_nblk&&iv_offset(format, b)<hi)
+	{
+		size_t n=0;
+		for(;n<SECTOR_BATCH&&b+n<g->new_nblk&&iv_offset(format, b+n)<hi;n++)
+		{
+			unsigned char *iv=buf+(iv_offset(format, b+n)-lo);
+			if((e=generate_iv(iv)))
+			{
+				fprintf(stderr, "Error on block %zu:\n", b+n);
+				if(e<0) perror("generate_iv");
+				else fprintf(stderr, "generate_iv failed with code %d\n", e);
+				return(1);
+			}
+			ops[n]=(struct sector_op){.key=key_table_enc(&g->l->keys, b+n), .iv=iv, .in=blanksector, .out=buf+(sector_offset(format, b+n)-lo)};
+		}
+		if((e=encrypt_sectors(n, ops)))
+		{
+			fprintf(stderr, "Error on blocks %zu-%zu:\n", b, b+n-1);
+			if(e<0) perror("encrypt_sectors");
+			else fprintf(stderr, "encrypt_sectors failed with code %d\n", e);
+			return(1);
+		}
+		b+=n;
+	}
+	return(0);
+}
+
+static int pwriteall(int fd, const unsigned char *buf, size_t len, size_t off)
+{
+	for(size_t done=0;done<len;)
+	{
+		ssize_t rv=pwrite(fd, buf+done, len-done, off+done);
+		if(rv<0)
+		{
+			if(errno==EINTR) continue;
+			return(-1);
+		}
+		done+=rv;
+	}
+	return(0);
+}
+
+// Writes image bytes lo to hi from buf.  Below old_size only the new blocks' own bytes are written, as the image may be mounted, and the old blocks beside them in use
+static int write_job(const struct grow *g, size_t lo, size_t hi, const unsigned char *buf)
+{
+	unsigned int format=g->l->format;
+	if(lo<g->old_size)
+	{
+		for(size_t b=g->old_nblk;b<g->new_nblk;b++)
+		{
+			size_t part[2][2]={{iv_offset(format, b), IV_LENGTH}, {sector_offset(format, b), SECTOR_LENGTH}};
+			if(part[0][0]>=g->old_size&&part[1][0]>=g->old_size) break; // and so are all the blocks after it
+			for(size_t k=0;k<2;k++)
+			{
+				size_t off=part[k][0], len=part[k][1];
+				if(off>=g->old_size) continue;
+				if(len>g->old_size-off) len=g->old_size-off; // the rest goes with the tail
+				if(pwriteall(g->fd, buf+(off-lo), len, off))
+				{
+					fprintf(stderr, "Error writing block %zu:\n", b);
+					perror("pwrite");
+					return(1);
+				}
+			}
+		}
+		buf+=g->old_size-lo;
+		lo=g->old_size;
+	}
+	if(lo<hi&&pwriteall(g->fd, buf, hi-lo, lo))
+	{
+		fprintf(stderr, "Error writing bytes %zu-%zu:\n", lo, hi-1);
+		perror("pwrite");
+		return(1);
+	}
+	return(0);
+}
+
+static void *worker(void *arg)
+{
+	struct grow *g=arg;
+	unsigned char *buf=malloc(JOB_LENGTH);
+	if(!buf)
+	{
+		perror("malloc");
+		__atomic_store_n(&g->failed, true, __ATOMIC_RELAXED);
+		return(NULL);
+	}
+	while(!__atomic_load_n(&g->failed, __ATOMIC_RELAXED))
+	{
+		size_t j=__atomic_fetch_add(&g->next_job, 1, __ATOMIC_RELAXED);
+		if(j>=g->njobs) break;
+		size_t lo=g->lo+j*JOB_LENGTH, hi=lo+JOB_LENGTH;
+		if(hi>g->new_size) hi=g->new_size;
+		if(fill_job(g, lo, hi, buf)||write_job(g, lo, hi, buf))
+		{
+			__atomic_store_n(&g->failed, true, __ATOMIC_RELAXED);
+			break;
+		}
+		fputc('.', stderr);
+	}
+	free(buf);
+	return(NULL);
+}
+
+static int write_checkpoint(const char *ckfile, size_t old_size, size_t new_size)
+{
+	char tmp[strlen(ckfile)+5];
+	sprintf(tmp, "%s.tmp", ckfile);
+	FILE *fp=fopen(tmp, "w");
+	if(!fp) return(-1);
+	fprintf(fp, "%zu %zu\n", old_size, new_size);
+	if(fflush(fp)||fdatasync(fileno(fp)))
+	{
+		fclose(fp);
+		return(-1);
+	}
+	if(fclose(fp)) return(-1);
+	return(rename(tmp, ckfile)?-1:0);
+}
+
+// The process holding the image's flock(), from /proc/locks; 0 if there's none to be found
+static pid_t lock_holder(const struct stat *st)
+{
+	FILE *fp=fopen("/proc/locks", "r");
+	if(!fp) return(0);
+	char line[256], type[16];
+	int pid;
+	unsigned int maj, min;
+	unsigned long ino;
+	pid_t holder=0;
+	while(!holder&&fgets(line, sizeof(line), fp))
+		if(sscanf(line, "%*d: %15s %*s %*s %d %x:%x:%lu", type, &pid, &maj, &min, &ino)==5&&strcmp(type, "FLOCK")==0&&ino==st->st_ino&&maj==major(st->st_dev)&&min==minor(st->st_dev))
+			holder=pid;
+	fclose(fp);
+	return(holder);
+}
+
+// SIGHUP would kill anything else that holds the image, such as onioncat
+static bool is_onionmount(pid_t pid)
+{
+	char path[32], comm[32]="";
+	snprintf(path, sizeof(path), "/proc/%d/comm", (int)pid);
+	FILE *fp=fopen(path, "r");
+	if(!fp) return(false);
+	bool ok=fgets(comm, sizeof(comm), fp)&&strcmp(comm, "onionmount\n")==0;
+	fclose(fp);
+	return(ok);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t sz=0;
+	const char *path=NULL;
+	long ncpu=sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int nthreads=ncpu>0?ncpu:1;
+	bool fast=false;
+	const char *ckfile=NULL;
+	for(int arg=1;arg<argc;arg++)
+	{
+		if(strncmp(argv[arg], "-s", 2)==0)
+		{
+			if(sscanf(argv[arg]+2, "%zu", &sz)!=1)
+			{
+				fprintf(stderr, "Bad -s, `%s' not numeric\n", argv[arg]+2);
+				return(1);
+			}
+		}
+		else if(strncmp(argv[arg], "-ks", 3)==0)
+		{
+			size_t ksz;
+			if(sscanf(argv[arg]+3, "%zu", &ksz)!=1)
+			{
+				fprintf(stderr, "Bad -ks, `%s' not numeric\n", argv[arg]+3);
+				return(1);
+			}
+			sz=ksz<<10;
+		}
+		else if(strncmp(argv[arg], "-Ms", 3)==0)
+		{
+			size_t Msz;
+			if(sscanf(argv[arg]+3, "%zu", &Msz)!=1)
+			{
+				fprintf(stderr, "Bad -Ms, `%s' not numeric\n", argv[arg]+3);
+				return(1);
+			}
+			sz=Msz<<20;
+		}
+		else if(strncmp(argv[arg], "-Gs", 3)==0)
+		{
+			size_t Gsz;
+			if(sscanf(argv[arg]+3, "%zu", &Gsz)!=1)
+			{
+				fprintf(stderr, "Bad -Gs, `%s' not numeric\n", argv[arg]+3);
+				return(1);
+			}
+			sz=Gsz<<30;
+		}
+		else if(strncmp(argv[arg], "-j", 2)==0)
+		{
+			if(sscanf(argv[arg]+2, "%u", &nthreads)!=1||!nthreads)
+			{
+				fprintf(stderr, "Bad -j, `%s' not a positive number\n", argv[arg]+2);
+				return(1);
+			}
+		}
+		else if(strcmp(argv[arg], "-f")==0)
+			fast=true;
+		else if(strncmp(argv[arg], "-C", 2)==0&&argv[arg][2])
+			ckfile=argv[arg]+2;
+		else if(!path&&argv[arg][0]!='-')
+			path=argv[arg];
+		else
+		{
+			fprintf(stderr, "Unrecognised argument `%s'\n", argv[arg]);
+			return(1);
+		}
+	}
+	if(!path)
+	{
+		fprintf(stderr, "Usage: onionresize <onion-image> -s<bytes>|-ks<kB>|-Ms<MB>|-Gs<GB> [-j<threads>] [-f] [-C<ckfile>]\n");
+		return(1);
+	}
+	int fd=open(path, O_RDWR);
+	if(fd<0)
+	{
+		fprintf(stderr, "Failed to open '%s'\n", path);
+		perror("\topen");
+		return(1);
+	}
+	// one onionresize at a time; this is an OFD lock, so it doesn't get in the way of the flock() a mount holds
+	struct flock ofd={.l_type=F_WRLCK, .l_whence=SEEK_SET, .l_start=0, .l_len=BLOCK_LENGTH};
+	if(fcntl(fd, F_OFD_SETLK, &ofd))
+	{
+		if(errno==EAGAIN||errno==EACCES)
+			fprintf(stderr, "'%s' is already being resized\n", path);
+		else
+			perror("fcntl(F_OFD_SETLK)");
+		return(1);
+	}
+	struct stat st;
+	if(fstat(fd, &st))
+	{
+		perror("fstat");
+		return(1);
+	}
+	/* With -C<ckfile>, an interrupted run leaves ckfile recording the old and new sizes, so that running it again starts the tail afresh.  As with mkonion it's opt-in and goes where the user says, since it would say what the image is.
+		Without it there's no resuming: the image has to be truncated back to its old size first */
+	size_t old_size=st.st_size, cksz=0;
+	FILE *ckfp=ckfile?fopen(ckfile, "r"):NULL;
+	if(ckfp)
+	{
+		if(fscanf(ckfp, "%zu %zu", &old_size, &cksz)!=2||old_size>(size_t)st.st_size)
+		{
+			fprintf(stderr, "Bad checkpoint file `%s'; check the image's size and delete it to start again\n", ckfile);
+			fclose(ckfp);
+			return(1);
+		}
+		fclose(ckfp);
+		if(sz&&sz!=cksz)
+		{
+			fprintf(stderr, "Size mismatch; interrupted resize was to %zu bytes\n", cksz);
+			return(1);
+		}
+		sz=cksz;
+		fprintf(stderr, "Resuming interrupted resize from %zu bytes\n", old_size);
+	}
+	if(!sz)
+	{
+		fprintf(stderr, "Must supply the new size with -s, -ks, -Ms or -Gs\n");
+		return(1);
+	}
+	if(sz<=old_size)
+	{
+		fprintf(stderr, "Image is already %zu bytes; onionresize only grows images\n", old_size);
+		return(1);
+	}
+	// if it's mounted, the mount keeps to the old blocks until it's told, and we keep away from them
+	bool online=false;
+	if(flock(fd, LOCK_EX|LOCK_NB))
+	{
+		if(errno!=EWOULDBLOCK)
+		{
+			perror("flock");
+			return(1);
+		}
+		online=true;
+		fprintf(stderr, "Image is in use; growing it in place\n");
+	}
+	unsigned char passphrase[KEY_LENGTH_HIGH+1];
+	if(image_get_passphrase(stdin, "Enter your layer master passphrase", passphrase))
+	{
+		perror("Failed to read passphrase: fgets");
+		return(1);
+	}
+	struct backing *store=backing_pread(fd, old_size);
+	if(!store)
+	{
+		perror("backing_pread");
+		return(1);
+	}
+	struct layer l;
+	int e=layer_open(&l, store, passphrase);
+	explicit_bzero(passphrase, sizeof(passphrase));
+	if(e)
+	{
+		fprintf(stderr, "Failed to unlock the image; wrong passphrase?\n");
+		return(1);
+	}
+	struct grow g={.fd=fd, .l=&l, .old_size=old_size, .new_size=sz, .old_nblk=l.nblk, .new_nblk=format_blocks(l.format, sz), .fast=fast};
+	if(g.new_nblk<=g.old_nblk)
+	{
+		fprintf(stderr, "Growing to %zu bytes would add no blocks\n", sz);
+		return(1);
+	}
+	g.lo=old_size-old_size%(l.format==FORMAT_CLUSTERED?CLUSTER_LENGTH:BLOCK_LENGTH);
+	g.njobs=(sz-g.lo+JOB_LENGTH-1)/JOB_LENGTH;
+	if(!ckfile)
+		fprintf(stderr, "Image is %zu bytes; if this is interrupted, truncate it back to that before trying again\n", old_size);
+	else if(!cksz&&write_checkpoint(ckfile, old_size, sz))
+	{
+		perror("Failed to record checkpoint");
+		return(1);
+	}
+	fprintf(stderr, "Adding %zu blocks to the %zu there are, with %u threads\n", g.new_nblk-g.old_nblk, g.old_nblk, nthreads);
+	pthread_t threads[nthreads];
+	unsigned int started=0;
+	for(;started<nthreads;started++)
+		if((e=pthread_create(threads+started, NULL, worker, &g)))
+		{
+			errno=e;
+			perror("pthread_create");
+			if(!started) return(1);
+			break;
+		}
+	for(unsigned int t=0;t<started;t++)
+		pthread_join(threads[t], NULL);
+	layer_close(&l);
+	store->release(store);
+	if(g.failed)
+	{
+		if(ckfile)
+			fprintf(stderr, "\nResize failed; run again with the same -C to resume\n");
+		else
+			fprintf(stderr, "\nResize failed; truncate the image back to %zu bytes before trying again\n", old_size);
+		return(1);
+	}
+	if(fdatasync(fd))
+	{
+		perror("fdatasync");
+		return(1);
+	}
+	if(ckfile&&unlink(ckfile)&&errno!=ENOENT)
+		perror("Failed to remove checkpoint: unlink");
+	fprintf(stderr, "\nImage now has %zu blocks\n", g.new_nblk);
+	if(online)
+	{
+		pid_t pid=lock_holder(&st);
+		if(pid&&is_onionmount(pid))
+		{
+			if(kill(pid, SIGHUP))
+				perror("kill");
+			else
+				fprintf(stderr, "Told onionmount (pid %d) to take in the new blocks\n", (int)pid);
+		}
+		else if(pid)
+			fprintf(stderr, "Image is held by pid %d, which isn't an onionmount; reopen it to use the new blocks\n", (int)pid);
+		else
+			fprintf(stderr, "Couldn't tell what holds the image; send its onionmount a SIGHUP to use the new blocks\n");
+	}
+	close(fd);
+	return(0);
+}
@@ -0,0 +1,154 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	stats.c: low-overhead counters and latency histograms for the layer engine
+*/
+
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *counter_name[STAT_COUNTERS]=
+{
+	[STAT_SECTORS_DECRYPTED]="onion_sectors_decrypted_total",
+	[STAT_SECTORS_ENCRYPTED]="onion_sectors_encrypted_total",
+	[STAT_IV_REGENERATIONS]="onion_iv_regenerations_total",
+	[STAT_FULL_WRITES]="onion_full_sector_writes_total",
+	[STAT_PARTIAL_WRITES]="onion_partial_sector_writes_total",
+	[STAT_DIRTY_ABSORBED]="onion_dirty_absorbed_total",
+	[STAT_DIRTY_FLUSHES]="onion_dirty_flushes_total",
+	[STAT_LOCK_WAITS]="onion_lock_waits_total",
+	[STAT_LOCK_WAIT_NS]="onion_lock_wait_ns_total",
+	[STAT_CACHE_HITS]="onion_cache_hits_total",
+	[STAT_CACHE_MISSES]="onion_cache_misses_total",
+	[STAT_READAHEAD_HITS]="onion_readahead_hits_total",
+	[STAT_READAHEAD_BYTES]="onion_readahead_bytes_total",
+	[STAT_RANGE_DECRYPTS]="onion_sectors_range_decrypted_total",
+};
+
+static const char *op_name[STAT_OPS]=
+{
+	[STAT_DATA_READ]="data_read",
+	[STAT_DATA_WRITE]="data_write",
+	[STAT_KS_READ]="keystream_read",
+	[STAT_KS_WRITE]="keystream_write",
+};
+
+static unsigned int next_shard;
+static __thread unsigned int my_shard=-1;
+
+static struct stats_shard *shard(struct stats *s)
+{
+	if(my_shard==(unsigned int)-1)
+		my_shard=__atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED)%STATS_SHARDS;
+	return(s->shard+my_shard);
+}
+
+struct stats *stats_new(void)
+{
+	struct stats *s;
+	int e=posix_memalign((void **)&s, 64, sizeof(*s));
+	if(e)
+		return(NULL);
+	memset(s, 0, sizeof(*s));
+	return(s);
+}
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec*(uint64_t)1000000000+ts.tv_nsec);
+}
+
+void stats_add(struct stats *s, enum stat_counter c, uint64_t n)
+{
+	__atomic_fetch_add(shard(s)->counter+c, n, __ATOMIC_RELAXED);
+}
+
+void stats_time(struct stats *s, enum stat_op op, uint64_t t0)
+{
+	uint64_t ns=stats_now()-t0;
+	unsigned int b=0;
+	while(b<STATS_BUCKETS-1&&ns>=(uint64_t)1024<<b)
+		b++;
+	struct stats_shard *sh=shard(s);
+	__atomic_fetch_add(sh->op[op].bucket+b, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&sh->op[op].count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&sh->op[op].sum_ns, ns, __ATOMIC_RELAXED);
+}
+
+// Appends to buf as snprintf would, keeping count of the length needed even once buf is full
+#define EMIT(...)	do { int n_=snprintf(buf+(used<len?used:len), used<len?len-used:0, __VA_ARGS__); if(n_>0) used+=n_; } while(0)
+
+size_t stats_format(const struct stats *s, const char *labels, char *buf, size_t len)
+{
+	struct stats_shard sum;
+	memset(&sum, 0, sizeof(sum));
+	for(size_t i=0;i<STATS_SHARDS;i++)
+	{
+		const struct stats_shard *sh=s->shard+i;
+		for(size_t c=0;c<STAT_COUNTERS;c++)
+			sum.counter[c]+=__atomic_load_n(sh->counter+c, __ATOMIC_RELAXED);
+		for(size_t o=0;o<STAT_OPS;o++)
+		{
+			for(size_t b=0;b<STATS_BUCKETS;b++)
+				sum.op[o].bucket[b]+=__atomic_load_n(sh->op[o].bucket+b, __ATOMIC_RELAXED);
+			sum.op[o].count+=__atomic_load_n(&sh->op[o].count, __ATOMIC_RELAXED);
+			sum.op[o].sum_ns+=__atomic_load_n(&sh->op[o].sum_ns, __ATOMIC_RELAXED);
+		}
+	}
+	size_t used=0;
+	if(len) *buf=0;
+	for(size_t c=0;c<STAT_COUNTERS;c++)
+	{
+		EMIT("# TYPE %s counter\n", counter_name[c]);
+		EMIT("%s{%s} %llu\n", counter_name[c], labels, (unsigned long long)sum.counter[c]);
+	}
+	EMIT("# TYPE onion_op_latency_ns histogram\n");
+	for(size_t o=0;o<STAT_OPS;o++)
+	{
+		uint64_t cum=0; // Prometheus buckets are cumulative
+		for(size_t b=0;b<STATS_BUCKETS;b++)
+		{
+			cum+=sum.op[o].bucket[b];
+			if(b<STATS_BUCKETS-1)
+				EMIT("onion_op_latency_ns_bucket{%s,op=\"%s\",le=\"%llu\"} %llu\n", labels, op_name[o], (unsigned long long)1024<<b, (unsigned long long)cum);
+			else
+				EMIT("onion_op_latency_ns_bucket{%s,op=\"%s\",le=\"+Inf\"} %llu\n", labels, op_name[o], (unsigned long long)cum);
+		}
+		EMIT("onion_op_latency_ns_sum{%s,op=\"%s\"} %llu\n", labels, op_name[o], (unsigned long long)sum.op[o].sum_ns);
+		EMIT("onion_op_latency_ns_count{%s,op=\"%s\"} %llu\n", labels, op_name[o], (unsigned long long)sum.op[o].count);
+	}
+	return(used);
+}
@@ -0,0 +1,89 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	stats.h: low-overhead counters and latency histograms for the layer engine
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATS_SHARDS	32 // threads are spread over this many copies of the counters, so they don't fight over cache lines
+#define STATS_BUCKETS	24 // latency histogram buckets: bucket 0 is under 1024ns, bucket i under 1024<<i ns, and the last catches the rest
+
+enum stat_counter
+{
+	STAT_SECTORS_DECRYPTED,
+	STAT_SECTORS_ENCRYPTED,
+	STAT_IV_REGENERATIONS, // new IVs made for rewritten blocks
+	STAT_FULL_WRITES, // whole sectors written
+	STAT_PARTIAL_WRITES, // sectors written only in part, whether through the dirty cache or not
+	STAT_DIRTY_ABSORBED, // partial writes the dirty cache took without encrypting anything
+	STAT_DIRTY_FLUSHES, // cached sectors encrypted back to the store
+	STAT_LOCK_WAITS, // lock acquisitions that had to wait
+	STAT_LOCK_WAIT_NS, // total time spent waiting for them
+	STAT_CACHE_HITS, // sectors read from the clean cache
+	STAT_CACHE_MISSES, // sectors that had to be decrypted, while there was a clean cache
+	STAT_READAHEAD_HITS, // reads served from what a stream had decrypted ahead
+	STAT_READAHEAD_BYTES, // bytes decrypted ahead
+	STAT_RANGE_DECRYPTS, // sectors of which only the part a read wanted was decrypted
+	STAT_COUNTERS
+};
+
+enum stat_op {STAT_DATA_READ, STAT_DATA_WRITE, STAT_KS_READ, STAT_KS_WRITE, STAT_OPS};
+
+struct stats_shard
+{
+	uint64_t counter[STAT_COUNTERS];
+	struct
+	{
+		uint64_t bucket[STATS_BUCKETS], count, sum_ns;
+	}
+	op[STAT_OPS];
+}
+__attribute__((aligned(64)));
+
+struct stats
+{
+	struct stats_shard shard[STATS_SHARDS];
+};
+
+struct stats *stats_new(void); // zeroed; NULL with errno set on failure.  Free it with free()
+uint64_t stats_now(void); // CLOCK_MONOTONIC, in ns
+// These are safe from any thread, and cost a relaxed atomic add on the thread's own shard
+void stats_add(struct stats *s, enum stat_counter c, uint64_t n);
+void stats_time(struct stats *s, enum stat_op op, uint64_t t0); // records an op that started at t0 (from stats_now) and has just finished
+// Sums the shards and writes them to buf in the Prometheus text format, each sample labelled with labels (eg. layer="1").  Returns the length it needed, as snprintf does
+size_t stats_format(const struct stats *s, const char *labels, char *buf, size_t len);
+
+#endif // STATS_H
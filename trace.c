@@ -0,0 +1,199 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	trace.c: recording and reading back traces of the I/O made to onion layers
+*/
+
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "bits.h"
+
+static uint64_t clock_ns(clockid_t clk)
+{
+	struct timespec ts;
+	clock_gettime(clk, &ts);
+	return(ts.tv_sec*(uint64_t)1000000000+ts.tv_nsec);
+}
+
+static void *trace_writer(void *arg)
+{
+	struct trace *t=arg;
+	pthread_mutex_lock(&t->mx);
+	for(;;)
+	{
+		while(!t->full&&!t->stop)
+			pthread_cond_wait(&t->cond, &t->mx);
+		if(!t->full)
+			break;
+		size_t len=t->full;
+		pthread_mutex_unlock(&t->mx);
+		ssize_t n=writeall(t->fd, t->buf[1], len);
+		int e=n<0?errno:(size_t)n<len?EIO:0;
+		pthread_mutex_lock(&t->mx);
+		if(e&&!t->err)
+			t->err=e;
+		t->full=0;
+	}
+	pthread_mutex_unlock(&t->mx);
+	return(NULL);
+}
+
+struct trace *trace_create(int fd)
+{
+	int e;
+	struct trace *t=calloc(1, sizeof(*t));
+	if(!t)
+		return(NULL);
+	t->fd=fd;
+	if(!(t->buf[0]=malloc(TRACE_BUFFER))||!(t->buf[1]=malloc(TRACE_BUFFER)))
+		goto fail;
+	unsigned char hdr[TRACE_HEADER_LENGTH];
+	memcpy(hdr, TRACE_MAGIC, 8);
+	write32be(TRACE_VERSION, hdr+8);
+	write32be(0, hdr+12);
+	write64be(clock_ns(CLOCK_REALTIME), hdr+16);
+	t->t0=clock_ns(CLOCK_MONOTONIC);
+	ssize_t n=writeall(t->fd, hdr, sizeof(hdr));
+	if(n!=(ssize_t)sizeof(hdr))
+	{
+		if(n>=0) errno=EIO;
+		goto fail;
+	}
+	pthread_mutex_init(&t->mx, NULL);
+	pthread_cond_init(&t->cond, NULL);
+	if((e=pthread_create(&t->writer, NULL, trace_writer, t)))
+	{
+		pthread_mutex_destroy(&t->mx);
+		pthread_cond_destroy(&t->cond);
+		errno=e;
+		goto fail;
+	}
+	return(t);
+	fail:
+	e=errno;
+	free(t->buf[0]);
+	free(t->buf[1]);
+	free(t);
+	errno=e;
+	return(NULL);
+}
+
+void trace_record(struct trace *t, uint8_t layer, uint8_t flags, uint64_t pos, uint32_t size)
+{
+	pthread_mutex_lock(&t->mx);
+	if(t->fill+TRACE_RECORD_LENGTH>TRACE_BUFFER)
+	{
+		if(t->full) // the writer hasn't caught up
+		{
+			t->dropped++;
+			pthread_mutex_unlock(&t->mx);
+			return;
+		}
+		unsigned char *b=t->buf[1];
+		t->buf[1]=t->buf[0];
+		t->buf[0]=b;
+		t->full=t->fill;
+		t->fill=0;
+		pthread_cond_signal(&t->cond);
+	}
+	unsigned char *rec=t->buf[0]+t->fill;
+	write64be(clock_ns(CLOCK_MONOTONIC)-t->t0, rec); // taken under mx, so the records' times are in order
+	write64be(pos, rec+8);
+	write32be(size, rec+16);
+	rec[20]=layer;
+	rec[21]=flags;
+	write16be(0, rec+22);
+	t->fill+=TRACE_RECORD_LENGTH;
+	pthread_mutex_unlock(&t->mx);
+}
+
+int trace_close(struct trace *t)
+{
+	pthread_mutex_lock(&t->mx);
+	t->stop=true;
+	pthread_cond_signal(&t->cond);
+	pthread_mutex_unlock(&t->mx);
+	pthread_join(t->writer, NULL);
+	int rv=0;
+	if(t->fill)
+	{
+		ssize_t n=writeall(t->fd, t->buf[0], t->fill);
+		if(n!=(ssize_t)t->fill&&!t->err)
+			t->err=n<0?errno:EIO;
+	}
+	if(close(t->fd)&&!t->err)
+		t->err=errno;
+	if(t->dropped)
+		fprintf(stderr, "trace: %llu records were dropped because the trace couldn't be written fast enough\n", (unsigned long long)t->dropped);
+	if(t->err)
+	{
+		errno=t->err;
+		rv=-1;
+	}
+	pthread_mutex_destroy(&t->mx);
+	pthread_cond_destroy(&t->cond);
+	free(t->buf[0]);
+	free(t->buf[1]);
+	free(t);
+	return(rv);
+}
+
+int trace_read_header(int fd, uint64_t *start_realtime_ns)
+{
+	unsigned char hdr[TRACE_HEADER_LENGTH];
+	ssize_t n=readall(fd, hdr, sizeof(hdr));
+	if(n<0)
+		return(-1);
+	if((size_t)n<sizeof(hdr)||memcmp(hdr, TRACE_MAGIC, 8))
+		return(1);
+	if(read32be(hdr+8)!=TRACE_VERSION)
+		return(2);
+	if(start_realtime_ns)
+		*start_realtime_ns=read64be(hdr+16);
+	return(0);
+}
+
+int trace_decode(const unsigned char *rec, struct trace_record *r)
+{
+	if(!rec) return(1);
+	if(!r) return(2);
+	r->t_ns=read64be(rec);
+	r->pos=read64be(rec+8);
+	r->size=read32be(rec+16);
+	r->layer=rec[20];
+	r->flags=rec[21];
+	return(0);
+}
@@ -0,0 +1,88 @@
+/*
+	diskonion - a layered deniable disk encryption scheme
+	Copyright (C) 2012 Edward Cree
+	
+	This library is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this library.  If not, see <http://www.gnu.org/licenses/>.
+	
+	In addition, as a special exception, the copyright holders give
+	permission to link the code of portions of this program with the
+	OpenSSL library under certain conditions as described in each
+	individual source file, and distribute linked combinations
+	including the two.
+	
+	You must obey the GNU General Public License in all respects
+	for all of the code used other than OpenSSL.  If you modify
+	file(s) with this exception, you may extend this exception to your
+	version of the file(s), but you are not obligated to do so.  If you
+	do not wish to do so, delete this exception statement from your
+	version.  If you delete this exception statement from all source
+	files in the program, then also delete it here.
+	
+	trace.h: recording and reading back traces of the I/O made to onion layers
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* A trace file is a TRACE_HEADER_LENGTH-byte header ("ONIONTRC", then the version, then the CLOCK_REALTIME at which recording began, in ns) followed by TRACE_RECORD_LENGTH-byte records, all big-endian:
+	0	time since recording began, in ns (CLOCK_MONOTONIC)
+	8	byte offset within the file
+	16	length in bytes
+	20	layer, counting from 1
+	21	TRACE_* flags
+	22	reserved (0)
+	Records are in the order their requests arrived, so their times only ever go forwards */
+#define TRACE_MAGIC			"ONIONTRC"
+#define TRACE_VERSION		1
+#define TRACE_HEADER_LENGTH	24
+#define TRACE_RECORD_LENGTH	24
+#define TRACE_WRITE			1
+#define TRACE_KEYSTREAM		2
+#define TRACE_BUFFER		(1<<20) // bytes of records gathered before they're handed to the writer thread
+
+struct trace_record
+{
+	uint64_t t_ns, pos;
+	uint32_t size;
+	uint8_t layer, flags;
+};
+
+/* Records are appended to one of two buffers under mx, and a full buffer is written out by a thread of the trace's own, so the requests being traced never wait on the disk.  If the writer falls a whole buffer behind, records are dropped (and counted) rather than held up */
+struct trace
+{
+	int fd;
+	uint64_t t0; // CLOCK_MONOTONIC at the start, in ns
+	pthread_mutex_t mx;
+	pthread_cond_t cond;
+	pthread_t writer;
+	unsigned char *buf[2];
+	size_t fill; // of buf[0], the one being appended to
+	size_t full; // of buf[1], waiting for the writer; 0 if it's free
+	bool stop;
+	int err; // first write error, as an errno
+	uint64_t dropped;
+};
+
+// For these functions, a return of 0 indicates success, positive indicates failure, and negative indicates failure with errno set
+struct trace *trace_create(int fd); // starts recording to fd, which should be empty, and takes ownership of it (but not on failure).  NULL with errno set on failure
+void trace_record(struct trace *t, uint8_t layer, uint8_t flags, uint64_t pos, uint32_t size); // safe from any thread; timestamped now
+int trace_close(struct trace *t); // writes out what's buffered, stops the writer, closes the file and frees t.  Warns about dropped records
+int trace_read_header(int fd, uint64_t *start_realtime_ns); // checks the header; leaves fd at the first record
+int trace_decode(const unsigned char *rec, struct trace_record *r); // decodes one record
+
+#endif // TRACE_H